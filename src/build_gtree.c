@@ -2,341 +2,1434 @@
  * encapsulate methods for building a gtree from a reference genome file.
  */
 #include "build_gtree.h"
+#include "fasta.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <unistd.h>
 
-// global pushback buffer defs for getc wrappers
-char PUSHBACK_BUFFER[MAX_WINDOW_SIZE];
-int PUSHBACK_POS = -1;
+/**
+ * add a slot to the rolling window of "scanner". Once MAX_WINDOW_SIZE slots
+ * are held, the window starting at the oldest is full and handed over.
+ */
+void _scan_slot( window_scanner_t *scanner, bp_t base, int is_illegal,
+                 window_handler_t handler, void *ctx ) {
+    scanner->bases = (scanner->bases << 2) | base;
+    scanner->illegal = (scanner->illegal << 1) | is_illegal;
+    scanner->n_held++;
+    scanner->pos++;
 
-char bufgetc(FILE *stream) {
-    if (PUSHBACK_POS < 0) {
-        return getc(stream);
+    if (scanner->n_held == MAX_WINDOW_SIZE) {
+        // the newest slot is not part of the oldest window
+        handler(scanner, scanner->n_held - 1, ctx);
+        scanner->n_held--;
     }
-    else {
-        return PUSHBACK_BUFFER[PUSHBACK_POS--];
+}
+
+/**
+ * end every window held by "scanner", handing each over as far as it got.
+ */
+void _scan_break( window_scanner_t *scanner,
+                  window_handler_t handler, void *ctx ) {
+    while (scanner->n_held > 0) {
+        handler(scanner, scanner->n_held, ctx);
+        scanner->n_held--;
+    }
+}
+
+/**
+ * feed a single event of a reference sequence to "scanner".
+ */
+void _scan_event( window_scanner_t *scanner, uint8_t event,
+                  window_handler_t handler, void *ctx ) {
+    if (event & REF_EVENT_BREAK) {
+        _scan_break(scanner, handler, ctx);
+        if (event & REF_EVENT_NEW_SEQ) {
+            scanner->desc++;
+            scanner->pos = 0;
+        }
+        return;
+    }
+    _scan_slot(scanner, event & REF_EVENT_BASE_MASK,
+               (event & REF_EVENT_ILLEGAL) != 0, handler, ctx);
+}
+
+/**
+ * start "scanner" on the first sequence of a reference, "desc".
+ */
+void _init_window_scanner( window_scanner_t *scanner, uint32_t desc ) {
+    scanner->bases = 0;
+    scanner->illegal = 0;
+    scanner->n_held = 0;
+    scanner->pos = 0;
+    scanner->desc = desc;
+}
+
+/**
+ * hand over the windows "scanner" holds at the end of a file.
+ */
+void _end_window_scanner( window_scanner_t *scanner,
+                          window_handler_t handler, void *ctx ) {
+    // a window that ran into a dead end was never in progress at the end
+    while (scanner->n_held > 0
+            && handler(scanner, scanner->n_held, ctx)) {
+        scanner->n_held--;
+    }
+}
+
+/**
+ * find every window of "ref" in order, exactly as a rewinding reader of the
+ * FASTA file would: windows start at each slot and end after
+ * MAX_WINDOW_SIZE - 1 slots or at an 'N' or '>', and at the end of the file
+ * only the oldest window held is handed over, along with those after it for
+ * as long as they run into dead ends.
+ */
+void _scan_ref_seq( ref_seq_t *ref, uint32_t desc,
+                    window_handler_t handler, void *ctx ) {
+    window_scanner_t scanner;
+    _init_window_scanner(&scanner, desc);
+
+    long i;
+    for (i = 0; i < ref->n_events; i++) {
+        _scan_event(&scanner, ref->events[i], handler, ctx);
     }
+    _end_window_scanner(&scanner, handler, ctx);
 }
 
-int bufungetc(char c) { 
-    PUSHBACK_POS++;
-    PUSHBACK_BUFFER[PUSHBACK_POS] = c;
+/**
+ * window handler inserting each window into the gtree. A partitioned worker
+ * only inserts the windows of its own partitions, from the "part_depth"'th
+ * base on; the nodes above are left to _build_top_window.
+ */
+int _build_window( window_scanner_t *scanner, int n_slots, void *ctx ) {
+    build_worker_t *worker = ctx;
+    ix_t *ix = worker->ix;
+    long pos = scanner->pos - scanner->n_held;
+    gtree_cursor_t cursor;
+    int i = 0;
+
+    if (worker->part_depth == 0) {
+        init_gtree_cursor(&cursor, ix->root, ix->table);
+    }
+    else {
+        // find the partition of the window and the node just above it
+        node_id_t parent = ix->root;
+        uint32_t part = 0;
+        int depth = 0;
+        for (i = 0; i < n_slots; i++) {
+            int shift = scanner->n_held - 1 - i;
+            if ((scanner->illegal >> shift) & 0x1) {
+                continue;
+            }
+            bp_t base = (scanner->bases >> (2 * shift)) & 0x3;
+            part = (part << 2) | base;
+            if (++depth == worker->part_depth) {
+                break;
+            }
+            parent = GTREE_NODE(ix->arena, parent)->next[base];
+        }
+        if (depth < worker->part_depth
+                || part % worker->n_threads != worker->id) {
+            return 0;
+        }
+
+        init_gtree_cursor(&cursor, parent, NULL);
+        cursor.depth = worker->part_depth - 1;
+        cursor.plain_depth = ix->table->k;
+    }
+
+    for (; i < n_slots; i++) {
+        int shift = scanner->n_held - 1 - i;
+        if ((scanner->illegal >> shift) & 0x1) {
+            continue;
+        }
+        step_gtree_cursor(worker->arena, &cursor,
+                          (bp_t) ((scanner->bases >> (2 * shift)) & 0x3),
+                          scanner->desc, pos, 1);
+    }
+    finish_gtree_cursor(worker->arena, &cursor, scanner->desc, pos, 1);
+
+    if (worker->iter % 1000000 == 0 && worker->n_threads == 1) {
+        worker->iter = 0;
+        printf("Working at desc:%s, pos:%ld, window:%d\n",
+                ix->descs[scanner->desc], pos, n_slots);
+    }
+    worker->iter++;
     return 0;
 }
 
-int read_desc ( FILE *in, char *desc ) {
-    char c;
-    int head = 0;
-    while ((c = fgetc(in)) != '\n') {
-        desc[head++] = c;
+/**
+ * window handler recording the matches of each window less than
+ * "part_depth" bases down, and making sure the node of its partition exists.
+ */
+int _build_top_window( window_scanner_t *scanner, int n_slots, void *ctx ) {
+    build_worker_t *worker = ctx;
+    ix_t *ix = worker->ix;
+    long pos = scanner->pos - scanner->n_held;
+    node_id_t id = ix->root;
+    int depth = 0;
+
+    int i;
+    for (i = 0; i < n_slots && depth < worker->part_depth; i++) {
+        int shift = scanner->n_held - 1 - i;
+        if ((scanner->illegal >> shift) & 0x1) {
+            continue;
+        }
+        bp_t base = (scanner->bases >> (2 * shift)) & 0x3;
+        gtree_t *node = GTREE_NODE(ix->arena, id);
+        if (node->next[base] == NULL_NODE) {
+            node->next[base] = init_gtree_node(ix->arena);
+        }
+        id = node->next[base];
+        if (++depth < worker->part_depth) {
+            visit_gtree_node(ix->arena, GTREE_NODE(ix->arena, id),
+                             scanner->desc, pos);
+        }
     }
-    desc[head] = '\0';
+
+    if (worker->iter % 1000000 == 0) {
+        worker->iter = 0;
+        printf("Working at desc:%s, pos:%ld, window:%d\n",
+                ix->descs[scanner->desc], pos, n_slots);
+    }
+    worker->iter++;
     return 0;
 }
 
-int process_base_mask(bp_t base, gtree_t **cur_node_ref, long pos, char *desc) {
-    gtree_t *cur_node = *cur_node_ref;
+/**
+ * prune the whole of a finished gtree, as "gtree ix prune" would, once its
+ * subtrees may already have been pruned as they were completed.
+ */
+void _prune_ix( ix_t *ix, int n_threads ) {
+    prune_gtree_threaded(ix->arena, ix->root, n_threads);
+    reset_root_table(ix->table);
+}
+
+void *_build_worker_main( void *arg ) {
+    build_worker_t *worker = arg;
+    _scan_ref_seq(worker->ref, worker->first_desc, _build_window, worker);
 
-    if (cur_node->next[base] == NULL) { 
-        // should signal that no next base available in the tree.
+    if (worker->prune) {
+        // the partitions of a worker are complete, and no one else's
+        ix_t *ix = worker->ix;
+        uint32_t part;
+        for (part = worker->id; part < ROOT_TABLE_SIZE(worker->part_depth);
+                part += worker->n_threads) {
+            node_id_t id = ix->root;
+            int i;
+            for (i = worker->part_depth - 1; i >= 0 && id != NULL_NODE; i--) {
+                id = GTREE_NODE(ix->arena, id)->next[(part >> (2 * i)) & 0x3];
+            }
+            if (id != NULL_NODE) {
+                prune_gtree(worker->arena, id);
+            }
+        }
+    }
+    return NULL;
+}
+
+int build_gtree( char *ix_file, ix_t *ix, int n_threads, int prune ) {
+    printf("Building gtree on FASTA input %s.\n", ix_file);
+
+    // the reference is read once, and shared by every worker
+    uint32_t first_desc = ix->n_descs - 1;
+    ref_seq_t *ref = read_fasta(ix_file, ix, n_threads);
+    if (ref == NULL) {
         return 1;
     }
-    // move to the next node
-    cur_node = cur_node->next[base];
-    
-    if (cur_node->n_matches < MAX_LOCS_PER_NODE) {
-        cur_node->locs[cur_node->n_matches].desc = NULL;
-        cur_node->locs[cur_node->n_matches].pos = pos;
-        cur_node->n_matches++;
+
+    build_worker_t top;
+    top.ix = ix;
+    top.arena = ix->arena;
+    top.id = 0;
+    top.n_threads = 1;
+    top.part_depth = 0;
+    top.ref = ref;
+    top.first_desc = first_desc;
+    top.iter = 0;
+    top.prune = prune;
+
+    if (n_threads <= 1) {
+        _scan_ref_seq(ref, first_desc, _build_window, &top);
+        destroy_ref_seq(ref);
+        return 0;
     }
-    else if (! cur_node->too_full && cur_node->n_matches == MAX_LOCS_PER_NODE) {
-        cur_node->too_full = 1;
-    } 
 
-    *cur_node_ref = cur_node;
+    // split the gtree into partitions by their leading bases. Nodes above
+    // the partitions are shared, so their matches are recorded up front.
+    while (ROOT_TABLE_SIZE(top.part_depth)
+                < (unsigned long) BUILD_PARTS_PER_THREAD * n_threads) {
+        top.part_depth++;
+    }
+    gtree_t *root = GTREE_NODE(ix->arena, ix->root);
+    if (top.part_depth > ix->table->k
+            && (root->next[A] | root->next[C] | root->next[T] | root->next[G])
+                    != NULL_NODE) {
+        // a loaded gtree is only plain down to the root table, so may hold
+        // path nodes above the partitions
+        printf("INFO: root table too small to partition, building with "
+               "1 thread\n");
+        _scan_ref_seq(ref, first_desc, _build_window, &top);
+        destroy_ref_seq(ref);
+        return 0;
+    }
+    printf("INFO: building with %d threads over %lu partitions\n",
+           n_threads, ROOT_TABLE_SIZE(top.part_depth));
+    _scan_ref_seq(ref, first_desc, _build_top_window, &top);
+
+    // each worker walks every window in order, inserting those of its own
+    // partitions, so that the first matches at each node win as before
+    build_worker_t *workers = malloc(sizeof(build_worker_t) * n_threads);
+    pthread_t *threads = malloc(sizeof(pthread_t) * n_threads);
+    int i;
+    for (i = 0; i < n_threads; i++) {
+        // arenas are shared before any worker takes slabs from the owner
+        workers[i] = top;
+        workers[i].arena = share_node_arena(ix->arena);
+        workers[i].id = i;
+        workers[i].n_threads = n_threads;
+    }
+    for (i = 0; i < n_threads; i++) {
+        pthread_create(&threads[i], NULL, _build_worker_main, &workers[i]);
+    }
+    for (i = 0; i < n_threads; i++) {
+        pthread_join(threads[i], NULL);
+        destroy_node_arena(workers[i].arena);
+    }
+
+    free(threads);
+    free(workers);
+    destroy_ref_seq(ref);
+
     return 0;
 }
 
-int process_base_create(bp_t base, gtree_t **cur_node_ref, long pos, char *desc) {
-    gtree_t *cur_node = *cur_node_ref;
+/**
+ * pack the first "n_slots" slots held by "scanner" into "window", left
+ * aligned so that windows sort in the order of the gtree.
+ *
+ * @return:
+ *      the number of bases in the window
+ */
+int _pack_window( window_scanner_t *scanner, int n_slots,
+                  bulk_window_t *window ) {
+    uint64_t bases = 0;
+    int n_bases = 0;
 
-    if (cur_node->next[base] == NULL) { 
-        cur_node->next[base] = init_gtree_node(); 
+    int i;
+    for (i = 0; i < n_slots; i++) {
+        int shift = scanner->n_held - 1 - i;
+        if ((scanner->illegal >> shift) & 0x1) {
+            continue;
+        }
+        bases |= ((scanner->bases >> (2 * shift)) & 0x3)
+                    << (62 - 2 * n_bases);
+        n_bases++;
     }
-    // move to the next node
-    cur_node = cur_node->next[base];
-    
-    if (cur_node->n_matches < MAX_LOCS_PER_NODE) {
-        cur_node->locs[cur_node->n_matches].desc = desc;
-        cur_node->locs[cur_node->n_matches].pos = pos;
-        cur_node->n_matches++;
+
+    window->bases = bases;
+    window->pos = scanner->pos - scanner->n_held;
+    // windows before the first header have no descriptor, and come first
+    window->desc_len = ((scanner->desc + 1) << BULK_LEN_BITS) | n_bases;
+    return n_bases;
+}
+
+/**
+ * window handler collecting each window as a bulk_window_t. Windows without
+ * a single base visit no node and are dropped.
+ */
+int _collect_window( window_scanner_t *scanner, int n_slots, void *ctx ) {
+    bulk_windows_t *bulk = ctx;
+    bulk_window_t window;
+    if (_pack_window(scanner, n_slots, &window) == 0) {
+        return 0;
     }
-    else if (! cur_node->too_full && cur_node->n_matches == MAX_LOCS_PER_NODE) {
-        cur_node->too_full = 1;
-    } 
 
-    *cur_node_ref = cur_node;
+    if (bulk->n_windows == bulk->cap_windows) {
+        bulk->cap_windows = bulk->cap_windows == 0
+                                ? 4096 : 2 * bulk->cap_windows;
+        bulk->windows = realloc(bulk->windows,
+                                sizeof(bulk_window_t) * bulk->cap_windows);
+    }
+    bulk->windows[bulk->n_windows++] = window;
     return 0;
 }
 
-int build_gtree( char *ix_file,
-                 gtree_t **gtree_root, 
-                 char ***desc_strings,
-                 unsigned int *n_descs ) { 
-    printf("Building gtree on FASTA input %s.\n", ix_file);
+unsigned int _radix_digit( bulk_window_t *window, int digit ) {
+    if (digit == 0) {
+        return window->desc_len & BULK_LEN_MASK;
+    }
+    return (window->bases >> (8 * (digit - 1))) & 0xFF;
+}
 
-    // declare local copies for readability
-    char **descs = *desc_strings;
-    gtree_t *root = *gtree_root;
-
-    FILE *in = fopen(ix_file, "r");
-
-    // define current position values
-    char *cur_desc = malloc(MAX_DESC_LEN); 
-    long cur_pos = 0; 
-    *n_descs = 0;
-
-    // define rolling window for build
-    long cur_window_size = 0;
-    char window_buffer[MAX_WINDOW_SIZE];
-    gtree_t *cur_node = root;
-
-    char force_window_rewind = 0;
-    long iter = 0;
-
-    char c;
-    while ((c = bufgetc(in)) != EOF) {
-        if (c == '>' && cur_window_size == 0) { 
-            read_desc(in, cur_desc);
-            descs = realloc(descs, sizeof(char *)*(*n_descs + 1));
-            descs[*n_descs] = malloc(strlen(cur_desc) + 1);
-            strcpy(descs[*n_descs], cur_desc);
-            *n_descs = *n_descs + 1;
-            cur_pos = 0;
-            cur_node = root;
-            continue;
+void *_radix_count( void *arg ) {
+    radix_worker_t *worker = arg;
+    memset(worker->counts, 0, sizeof(worker->counts));
+    long i;
+    for (i = worker->lo; i < worker->hi; i++) {
+        worker->counts[_radix_digit(&worker->src[i], worker->digit)]++;
+    }
+    return NULL;
+}
+
+void *_radix_scatter( void *arg ) {
+    radix_worker_t *worker = arg;
+    long i;
+    for (i = worker->lo; i < worker->hi; i++) {
+        unsigned int d = _radix_digit(&worker->src[i], worker->digit);
+        worker->dst[worker->counts[d]++] = worker->src[i];
+    }
+    return NULL;
+}
+
+void _run_radix_workers( radix_worker_t *workers, int n_threads,
+                         void *(*fn)(void *) ) {
+    if (n_threads == 1) {
+        fn(&workers[0]);
+        return;
+    }
+    pthread_t *threads = malloc(sizeof(pthread_t) * n_threads);
+    int t;
+    for (t = 0; t < n_threads; t++) {
+        pthread_create(&threads[t], NULL, fn, &workers[t]);
+    }
+    for (t = 0; t < n_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+}
+
+/**
+ * stable LSD radix sort of "bulk" by bases, then number of bases, with each
+ * pass split over "n_threads" threads. Windows with equal bases keep their
+ * file order. Passes where every window shares a digit are skipped.
+ */
+void _sort_windows( bulk_windows_t *bulk, int n_threads ) {
+    long n = bulk->n_windows;
+    bulk_window_t *src = bulk->windows;
+    bulk_window_t *dst = malloc(sizeof(bulk_window_t) * (n > 0 ? n : 1));
+    radix_worker_t *workers = malloc(sizeof(radix_worker_t) * n_threads);
+
+    int t, digit;
+    for (t = 0; t < n_threads; t++) {
+        workers[t].lo = n * t / n_threads;
+        workers[t].hi = n * (t + 1) / n_threads;
+    }
+
+    for (digit = 0; digit <= 8; digit++) {
+        for (t = 0; t < n_threads; t++) {
+            workers[t].src = src;
+            workers[t].dst = dst;
+            workers[t].digit = digit;
         }
-        else if (c == '>') {
-            //rewind window and move forward.
-            force_window_rewind = 1;
+        _run_radix_workers(workers, n_threads, _radix_count);
+
+        // turn counts into the first slot of each worker for each value,
+        // values outermost so that the sort stays stable
+        long next = 0;
+        int d, n_used = 0;
+        for (d = 0; d < 256; d++) {
+            long total = 0;
+            for (t = 0; t < n_threads; t++) {
+                long count = workers[t].counts[d];
+                workers[t].counts[d] = next + total;
+                total += count;
+            }
+            next += total;
+            n_used += total > 0;
         }
-        else if (c == '\n') {
+        if (n_used <= 1) {
             continue;
         }
-        else if ( (c == 'N' || c == 'n') && cur_window_size == 0) {
-            continue;
+
+        _run_radix_workers(workers, n_threads, _radix_scatter);
+        bulk_window_t *swap = src;
+        src = dst;
+        dst = swap;
+    }
+
+    bulk->windows = src;
+    free(dst);
+    free(workers);
+}
+
+uint64_t _window_order( bulk_window_t *window ) {
+    return ((uint64_t) (window->desc_len >> BULK_LEN_BITS) << 32)
+                | window->pos;
+}
+
+/**
+ * build the node reached by the sorted windows [lo, hi), all of which share
+ * their first "depth" bases, and its subtree. Nodes are handed out before
+ * their subtrees, so that the gtree is laid out in the order it is walked.
+ * The indices of the first MAX_LOCS_PER_NODE windows in file order are left
+ * in "first" and their number in "n_first".
+ */
+node_id_t _bulk_build_node( ix_t *ix, bulk_window_t *windows, long lo,
+                            long hi, int depth, int prune,
+                            long *first, int *n_first ) {
+    node_id_t id;
+    gtree_t *node;
+
+    if (hi - lo == 1 && depth > ix->table->k) {
+        // a lone window makes a single chain down to its last base
+        int len = (windows[lo].desc_len & BULK_LEN_MASK) - depth + 1;
+        uint64_t bases = 0;
+        int i;
+        for (i = 0; i < len - 1; i++) {
+            bases |= ((windows[lo].bases >> (62 - 2 * (depth + i))) & 0x3)
+                        << (2 * i);
         }
-        else if (c == 'N' || c == 'n') {
-            //rewind window and move forward.
-            force_window_rewind = 1;
-        }
-        
-        // add current character to buffer
-        window_buffer[cur_window_size] = c;
-        cur_window_size++;
-        cur_pos++;
-        
-        if (force_window_rewind || cur_window_size == MAX_WINDOW_SIZE) {
-            // update window size
-            int i;
-            for (i = cur_window_size - 1; i > 0; i--) {
-                // push back onto buffer
-                bufungetc(window_buffer[i]);
-            }
-            cur_pos = cur_pos - cur_window_size + 1;
-            cur_node = root;
-            cur_window_size = 0; // delete the first char to move forward
-            force_window_rewind = 0;
+        id = init_gtree_path(ix->arena, len, bases);
+        node = GTREE_NODE(ix->arena, id);
+        node->locs = init_loc_run(ix->arena, 1);
+        GTREE_LOC(ix->arena, node->locs)->desc =
+                            (windows[lo].desc_len >> BULK_LEN_BITS) - 1;
+        GTREE_LOC(ix->arena, node->locs)->pos = windows[lo].pos;
+        node->info |= 1;
+        first[0] = lo;
+        *n_first = 1;
+        return id;
+    }
 
-            continue;
+    id = init_gtree_node(ix->arena);
+    node = GTREE_NODE(ix->arena, id);
+
+    // windows ending here sort first and are already in file order
+    long candidates[MAX_LOCS_PER_NODE * 5];
+    int n_candidates = 0;
+    long i = lo;
+    while (i < hi && (windows[i].desc_len & BULK_LEN_MASK) == depth) {
+        if (n_candidates < MAX_LOCS_PER_NODE) {
+            candidates[n_candidates++] = i;
         }
+        i++;
+    }
 
-        switch (c) { 
-            case 'a':
-            case 'A':
-                process_base_create(A, &cur_node, 
-                             cur_pos - cur_window_size, descs[*n_descs - 1]);
-                break;
-                
-            case 't':
-            case 'T':
-                process_base_create(T, &cur_node, 
-                             cur_pos - cur_window_size, descs[*n_descs - 1]);
-                break;
-                
-            case 'c':
-            case 'C':
-                process_base_create(C, &cur_node, 
-                             cur_pos - cur_window_size, descs[*n_descs - 1]);
-                break;
+    // the rest go on to the children, in order of their next base
+    int shift = 62 - 2 * depth;
+    while (i < hi) {
+        bp_t base = (windows[i].bases >> shift) & 0x3;
+        long j = i;
+        while (j < hi && ((windows[j].bases >> shift) & 0x3) == base) {
+            j++;
+        }
+        int n_child;
+        node->next[base] = _bulk_build_node(ix, windows, i, j, depth + 1,
+                                            prune, candidates + n_candidates,
+                                            &n_child);
+        n_candidates += n_child;
+        i = j;
+    }
 
-            case 'g':
-            case 'G':
-                process_base_create(G, &cur_node, 
-                             cur_pos - cur_window_size, descs[*n_descs - 1]);
-                break; 
-            default:
-                printf("ERROR - encountered illegal character [%c|%d] in %s:%ld",
-                            c, c, descs[*n_descs - 1], cur_pos - cur_window_size); 
-                break;
+    // the first matches at this node are the first of all windows below it
+    int n_matches = 0;
+    while (n_matches < MAX_LOCS_PER_NODE && n_matches < n_candidates) {
+        int best = n_matches, k;
+        for (k = n_matches + 1; k < n_candidates; k++) {
+            if (_window_order(&windows[candidates[k]])
+                    < _window_order(&windows[candidates[best]])) {
+                best = k;
+            }
         }
+        long swap = candidates[best];
+        candidates[best] = candidates[n_matches];
+        candidates[n_matches] = swap;
+        n_matches++;
+    }
+
+    if (n_matches > 0) {
+        node->locs = init_loc_run(ix->arena, n_matches);
+    }
+    for (i = 0; i < n_matches; i++) {
+        loc_t *loc = GTREE_LOC(ix->arena, node->locs + i);
+        bulk_window_t *window = &windows[candidates[i]];
+        loc->desc = (window->desc_len >> BULK_LEN_BITS) - 1;
+        loc->pos = window->pos;
+        first[i] = candidates[i];
+    }
+    node->info |= n_matches;
+    if (hi - lo > MAX_LOCS_PER_NODE) {
+        node->info |= GTREE_TOO_FULL_FLAG;
+    }
+    *n_first = n_matches;
+
+    if (depth > ix->table->k) {
+        compress_gtree_node(ix->arena, id);
+    }
+    if (prune && depth == BULK_PRUNE_DEPTH) {
+        // nothing more will be added below, and released nodes are reused
+        // by the next subtree
+        prune_gtree(ix->arena, id);
+    }
+    return id;
+}
 
-        if (iter % 1000000 == 0) {
-            iter = 0;
-            printf("Working at desc:%s, pos:%ld, window:%ld\n",
-                    descs[*n_descs - 1], cur_pos, cur_window_size);
+int build_gtree_bulk( char *ix_file, ix_t *ix, int n_threads,
+                      int prune ) {
+    printf("Bulk building gtree on FASTA input %s.\n", ix_file);
+
+    uint32_t first_desc = ix->n_descs - 1;
+    ref_seq_t *ref = read_fasta(ix_file, ix, n_threads);
+    if (ref == NULL) {
+        return 1;
+    }
+
+    if (ix->n_descs > BULK_MAX_DESCS) {
+        printf("ERROR: too many sequences in %s for a bulk build\n", ix_file);
+        destroy_ref_seq(ref);
+        return 1;
+    }
+
+    bulk_windows_t bulk;
+    bulk.windows = NULL;
+    bulk.n_windows = 0;
+    bulk.cap_windows = 0;
+    _scan_ref_seq(ref, first_desc, _collect_window, &bulk);
+    destroy_ref_seq(ref);
+    printf("INFO: sorting %ld windows\n", bulk.n_windows);
+
+    _sort_windows(&bulk, n_threads);
+
+    // the root records no matches, build each of its subtrees in turn
+    long i = 0;
+    while (i < bulk.n_windows) {
+        bp_t base = bulk.windows[i].bases >> 62;
+        long j = i;
+        while (j < bulk.n_windows && (bulk.windows[j].bases >> 62) == base) {
+            j++;
         }
-        iter++; 
+        long first[MAX_LOCS_PER_NODE];
+        int n_first;
+        node_id_t child = _bulk_build_node(ix, bulk.windows, i, j, 1,
+                                           prune, first, &n_first);
+        GTREE_NODE(ix->arena, ix->root)->next[base] = child;
+        i = j;
+    }
 
-    } 
+    free(bulk.windows);
+    return 0;
+}
 
-    *desc_strings = descs;
-    free(cur_desc);
-    fclose(in);
+/**
+ * window handler growing the nodes above the buckets, as _build_top_window,
+ * and spilling each window that reaches a bucket to the file of its bucket.
+ */
+int _spill_window( window_scanner_t *scanner, int n_slots, void *ctx ) {
+    spill_state_t *spill = ctx;
+    if (spill->err) {
+        return 0;
+    }
+    _build_top_window(scanner, n_slots, &spill->top);
 
+    bulk_window_t window;
+    if (_pack_window(scanner, n_slots, &window) < spill->depth) {
+        return 0;
+    }
+    uint32_t bucket = window.bases >> (64 - 2 * spill->depth);
+    if (fwrite(&window, sizeof(bulk_window_t), 1,
+               spill->files[bucket]) != 1) {
+        printf("ERROR: could not write to the spill file of bucket %u\n",
+               bucket);
+        spill->err = 1;
+        return 0;
+    }
+    spill->n_windows[bucket]++;
     return 0;
 }
 
-int mask_gtree( char *ix_file, ix_t *ix ) {
-    printf("Masking gtree on FASTA input %s.\n", ix_file);
+/**
+ * ref_sink_t spilling the windows of each chunk of the reference as it is
+ * tokenized, so that the reference is never held whole.
+ */
+void _spill_events( ref_seq_t *ref, void *ctx ) {
+    spill_state_t *spill = ctx;
+    // windows only have room for BULK_MAX_DESCS descriptor ids
+    if (spill->top.ix->n_descs > BULK_MAX_DESCS) {
+        spill->err = 1;
+    }
+    if (spill->err) {
+        return;
+    }
+    long i;
+    for (i = 0; i < ref->n_events; i++) {
+        _scan_event(&spill->scanner, ref->events[i], _spill_window, spill);
+    }
+}
+
+/**
+ * insert the windows spilled to bucket "kmer" below "parent", the node just
+ * above the bucket, in file order, exactly as a partitioned worker of
+ * build_gtree would.
+ *
+ * @return:
+ *      0 on success, 1 if not every window spilled could be read back
+ */
+int _fill_bucket( spill_state_t *spill, uint32_t kmer, node_arena_t *arena,
+                  node_id_t parent ) {
+    FILE *file = spill->files[kmer];
+
+    if (spill->n_windows[kmer] * SPILL_BYTES_PER_WINDOW > spill->mem_limit) {
+        printf("WARNING: bucket %u of %ld windows may not fit in the "
+               "memory limit\n", kmer, spill->n_windows[kmer]);
+    }
 
-    FILE *in = fopen(ix_file, "r");
+    rewind(file);
+    bulk_window_t window;
+    long n_read = 0;
+    while (fread(&window, sizeof(bulk_window_t), 1, file) == 1) {
+        n_read++;
+        uint32_t desc = (window.desc_len >> BULK_LEN_BITS) - 1;
+        int n_bases = window.desc_len & BULK_LEN_MASK;
 
-    // get file size
-    fseek(in, 0L, SEEK_END);
-    long int in_size = ftell(in);
-    rewind(in);
+        gtree_cursor_t cursor;
+        init_gtree_cursor(&cursor, parent, NULL);
+        cursor.depth = spill->depth - 1;
+        cursor.plain_depth = spill->top.ix->table->k;
 
-    // define current position values
-    char *cur_desc = malloc(MAX_DESC_LEN); 
-    long cur_pos = 0; 
+        int i;
+        for (i = spill->depth - 1; i < n_bases; i++) {
+            step_gtree_cursor(arena, &cursor,
+                              (bp_t) ((window.bases >> (62 - 2 * i)) & 0x3),
+                              desc, window.pos, 1);
+        }
+        finish_gtree_cursor(arena, &cursor, desc, window.pos, 1);
+    }
+    int err = ferror(file) || n_read != spill->n_windows[kmer];
+    if (fclose(file) != 0) {
+        err = 1;
+    }
+    spill->files[kmer] = NULL;
+    if (err) {
+        printf("ERROR: could not read back the spill file of bucket %u\n",
+               kmer);
+        spill->err = 1;
+    }
+    return err;
+}
 
-    // define rolling window for build
-    long cur_window_size = 0;
-    char window_buffer[MAX_WINDOW_SIZE];
-    gtree_t *cur_node = ix->root;
+/**
+ * bucket_loader_t building the subtree of a bucket from its spill file, in
+ * an arena of its own below a stand-in for the node above the bucket. A
+ * bucket that could not be read back is handed over as far as it got, with
+ * "err" of "spill" set.
+ */
+node_id_t _load_bucket( void *ctx, uint32_t kmer, node_arena_t **arena ) {
+    spill_state_t *spill = ctx;
+    node_arena_t *bucket_arena = init_node_arena();
+    node_id_t parent = init_gtree_node(bucket_arena);
+    _fill_bucket(spill, kmer, bucket_arena, parent);
 
-    char force_window_rewind = 0;
-    long iter = 0;
+    node_id_t bucket = GTREE_NODE(bucket_arena, parent)->next[kmer & 0x3];
+    spill->n_nodes += count_gtree_nodes(bucket_arena, bucket) - 1;
+    *arena = bucket_arena;
+    return bucket;
+}
 
-    int process_base_res;
-    char c;
-    while ((c = bufgetc(in)) != EOF) {
-        if (c == '>' && cur_window_size == 0) { 
-            read_desc(in, cur_desc);
-            cur_pos = 0;
-            cur_node = ix->root;
+/**
+ * build the subtree of every bucket in place in the gtree of "ix", pruning
+ * each as soon as it is complete so that its released nodes are reused by
+ * the next.
+ *
+ * @return:
+ *      0 on success, 1 if a bucket could not be read back
+ */
+int _fill_pruned_buckets( spill_state_t *spill, ix_t *ix ) {
+    uint32_t kmer;
+    for (kmer = 0; kmer < ROOT_TABLE_SIZE(spill->depth); kmer++) {
+        if (spill->n_windows[kmer] == 0) {
             continue;
         }
-        else if (c == '>') {
-            //rewind window and move forward.
-            force_window_rewind = 1;
+        node_id_t parent = ix->root;
+        int i;
+        for (i = spill->depth - 1; i > 0; i--) {
+            parent = GTREE_NODE(ix->arena, parent)
+                        ->next[(kmer >> (2 * i)) & 0x3];
         }
-        else if (c == '\n') {
-            continue;
+        if (_fill_bucket(spill, kmer, ix->arena, parent) != 0) {
+            return 1;
         }
-        else if ( (c == 'N' || c == 'n') && cur_window_size == 0) {
+        prune_gtree(ix->arena,
+                    GTREE_NODE(ix->arena, parent)->next[kmer & 0x3]);
+    }
+    return 0;
+}
+
+/**
+ * estimate the number of events in the FASTA file "filename" from its size,
+ * before it is read.
+ */
+long _estimate_ref_events( char *filename ) {
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) {
+        return 0;
+    }
+    unsigned char magic[2];
+    int gzip = fread(magic, 1, 2, file) == 2
+                && magic[0] == 0x1f && magic[1] == 0x8b;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fclose(file);
+    return gzip ? size * SPILL_GZIP_RATIO : size;
+}
+
+int build_gtree_out_of_core( char *ix_file, ix_t *ix, int n_threads,
+                             long mem_limit, int prune, char *outfile ) {
+    printf("Building gtree out of core on FASTA input %s.\n", ix_file);
+
+    // split into as many buckets as it takes for the largest to fit, judged
+    // by the size of the file, as the reference is streamed into buckets
+    // without being held
+    long n_events = _estimate_ref_events(ix_file);
+    spill_state_t spill;
+    spill.depth = 1;
+    while (spill.depth < MAX_SPILL_DEPTH
+            && n_events * SPILL_BYTES_PER_WINDOW * SPILL_BUCKET_SKEW
+                    / ROOT_TABLE_SIZE(spill.depth) > mem_limit) {
+        spill.depth++;
+    }
+    unsigned long n_buckets = ROOT_TABLE_SIZE(spill.depth);
+    printf("INFO: spilling windows into %lu buckets\n", n_buckets);
+
+    spill.mem_limit = mem_limit;
+    spill.n_nodes = 0;
+    spill.err = 0;
+    spill.files = malloc(sizeof(FILE *) * n_buckets);
+    spill.n_windows = calloc(n_buckets, sizeof(long));
+    char *name = malloc(strlen(outfile) + 32);
+    unsigned long b;
+    for (b = 0; b < n_buckets; b++) {
+        // spill files live next to the index, and go once they are closed
+        sprintf(name, "%s.spill%lu", outfile, b);
+        spill.files[b] = fopen(name, "w+");
+        if (spill.files[b] == NULL) {
+            printf("ERROR: could not create spill file %s\n", name);
+            break;
+        }
+        unlink(name);
+    }
+    free(name);
+    if (b < n_buckets) {
+        while (b > 0) {
+            fclose(spill.files[--b]);
+        }
+        free(spill.files);
+        free(spill.n_windows);
+        return 1;
+    }
+
+    uint32_t first_desc = ix->n_descs - 1;
+    spill.top.ix = ix;
+    spill.top.arena = ix->arena;
+    spill.top.id = 0;
+    spill.top.n_threads = 1;
+    spill.top.part_depth = spill.depth;
+    spill.top.ref = NULL;
+    spill.top.first_desc = first_desc;
+    spill.top.iter = 0;
+    spill.top.prune = 0;
+    _init_window_scanner(&spill.scanner, first_desc);
+    int status = stream_fasta(ix_file, ix, n_threads, _spill_events, &spill);
+    if (status == 0 && ix->n_descs > BULK_MAX_DESCS) {
+        printf("ERROR: too many sequences in %s for an out-of-core build\n",
+               ix_file);
+        status = 1;
+    }
+    if (status == 0) {
+        _end_window_scanner(&spill.scanner, _spill_window, &spill);
+    }
+    // writes still buffered may fail too
+    for (b = 0; status == 0 && !spill.err && b < n_buckets; b++) {
+        if (fflush(spill.files[b]) != 0 || ferror(spill.files[b])) {
+            printf("ERROR: could not write to the spill file of bucket "
+                   "%lu\n", b);
+            spill.err = 1;
+        }
+    }
+    if (spill.err) {
+        status = 1;
+    }
+
+    if (status == 0 && prune) {
+        // pruned buckets are expected to fit side by side
+        status = _fill_pruned_buckets(&spill, ix);
+        if (status == 0) {
+            _prune_ix(ix, n_threads);
+            spill.n_nodes = count_gtree_nodes(ix->arena, ix->root);
+            status = serialize_ix(ix, outfile);
+        }
+    }
+    else if (status == 0) {
+        // every bucket reached by a window holds a node in the gtree above
+        spill.n_nodes = count_gtree_nodes(ix->arena, ix->root);
+        status = serialize_ix_by_bucket(ix, outfile, spill.depth,
+                                        _load_bucket, &spill);
+        if (status == 0 && spill.err) {
+            // an index missing part of a bucket must not pass for a whole one
+            unlink(outfile);
+            status = 1;
+        }
+    }
+    if (status == 0) {
+        printf("number of nodes: %ld\n", spill.n_nodes);
+    }
+
+    // buckets left over if the index could not be written
+    for (b = 0; b < n_buckets; b++) {
+        if (spill.files[b] != NULL) {
+            fclose(spill.files[b]);
+        }
+    }
+    free(spill.files);
+    free(spill.n_windows);
+    return status;
+}
+
+/**
+ * mark the nodes on the "trail" of a window saturated, from the deepest up,
+ * for as long as each is too_full with only saturated children.
+ */
+void _mark_saturated( node_arena_t *arena, node_id_t *trail, int n ) {
+    int i, j;
+    for (i = n - 1; i >= 0; i--) {
+        gtree_t *node = GTREE_NODE(arena, trail[i]);
+        if (GTREE_SATURATED(node)) {
             continue;
         }
-        else if (c == 'N' || c == 'n') {
-            //rewind window and move forward.
-            force_window_rewind = 1;
-        }
-        
-        // add current character to buffer
-        window_buffer[cur_window_size] = c;
-        cur_window_size++;
-        cur_pos++;
- 
-        if (force_window_rewind 
-                || cur_window_size == MAX_WINDOW_SIZE) {
-            // update window size
-            int i;
-            for (i = cur_window_size - 1; i > 0; i--) {
-                // push back onto buffer
-                bufungetc(window_buffer[i]);
+        if (!GTREE_TOO_FULL(node)) {
+            return;
+        }
+        int n_next = GTREE_KIND(node) == GTREE_KIND_PATH ? 1 : 4;
+        for (j = 0; j < n_next; j++) {
+            if (node->next[j] != NULL_NODE
+                    && !GTREE_SATURATED(GTREE_NODE(arena, node->next[j]))) {
+                return;
             }
-            cur_pos = cur_pos - cur_window_size + 1;
-            cur_node = ix->root;
-            cur_window_size = 0; // delete the first char to move forward
-            force_window_rewind = 0;
+        }
+        node->info |= GTREE_SATURATED_FLAG;
+    }
+}
+
+/**
+ * whether the dead end of a window may be needed: at a break or the end of
+ * the file, where it is returned, or when the next window opens on an
+ * illegal character and inherits it. Other windows may stop walking as
+ * soon as they enter a saturated subtree.
+ */
+int _needs_dead_end( window_scanner_t *scanner, int n_slots ) {
+    return n_slots == scanner->n_held
+            || ((scanner->illegal >> (scanner->n_held - 2)) & 0x1);
+}
 
+/**
+ * window handler walking each window down the gtree without growing it, up
+ * to the first dead end.
+ */
+int _mask_window( window_scanner_t *scanner, int n_slots, void *ctx ) {
+    mask_state_t *mask = ctx;
+    ix_t *ix = mask->ix;
+    long pos = scanner->pos - scanner->n_held;
+
+    // a window opening on an illegal character inherits the dead end of the
+    // last window walked, as it always has
+    if (((scanner->illegal >> (scanner->n_held - 1)) & 0x1)
+            && mask->dead_end) {
+        return 1;
+    }
+
+    gtree_cursor_t cursor;
+    init_gtree_cursor(&cursor, ix->root, ix->table);
+    int walked = 0;
+    int dead_end = 0;
+    int exact = _needs_dead_end(scanner, n_slots);
+    int saturated = 0;
+
+    // nodes entered by the window, for _mark_saturated
+    node_id_t trail[MAX_WINDOW_SIZE + 1];
+    int n_trail = 0;
+    trail[n_trail++] = cursor.node;
+
+    int i;
+    for (i = 0; i < n_slots && !dead_end; i++) {
+        int shift = scanner->n_held - 1 - i;
+        if ((scanner->illegal >> shift) & 0x1) {
             continue;
-        }       
-
-        switch (c) { 
-            case 'a':
-            case 'A':
-                process_base_res = process_base_mask(A, &cur_node, 
-                             cur_pos - cur_window_size,
-                             ix->descs[ix->n_descs - 1]);
-                break;
-                
-            case 't':
-            case 'T':
-                process_base_res = process_base_mask(T, &cur_node, 
-                             cur_pos - cur_window_size,
-                             ix->descs[ix->n_descs - 1]);
-                break;
-                
-            case 'c':
-            case 'C':
-                process_base_res = process_base_mask(C, &cur_node, 
-                             cur_pos - cur_window_size,
-                             ix->descs[ix->n_descs - 1]);
-                break;
+        }
+        walked = 1;
+        dead_end = step_gtree_cursor(ix->arena, &cursor,
+                            (bp_t) ((scanner->bases >> (2 * shift)) & 0x3),
+                            LOC_NO_DESC, pos, 0);
+        if (cursor.node != trail[n_trail - 1]) {
+            trail[n_trail++] = cursor.node;
+        }
+        if (!exact && GTREE_SATURATED(GTREE_NODE(ix->arena, cursor.node))) {
+            // every match left to record is a no-op, and nothing needs to
+            // know whether the rest of the window runs into a dead end
+            saturated = 1;
+            break;
+        }
+    }
+    if (!dead_end && !saturated) {
+        dead_end = finish_gtree_cursor(ix->arena, &cursor,
+                                       LOC_NO_DESC, pos, 0);
+    }
+    if (walked) {
+        mask->dead_end = dead_end;
+    }
+    _mark_saturated(ix->arena, trail, n_trail);
 
-            case 'g':
-            case 'G':
-                process_base_res = process_base_mask(G, &cur_node, 
-                             cur_pos - cur_window_size,
-                             ix->descs[ix->n_descs - 1]);
-                break; 
-            default:
-                printf("ERROR - encountered illegal character [%c|%d] in %s:%ld",
-                            c, c, ix->descs[ix->n_descs - 1],
-                            cur_pos - cur_window_size); 
-                break;
+    if (mask->n_windows % 1000000 == 0) {
+        printf("INFO: %02ld%% of file processed;"
+               " working at pos:%ld, window:%d\n",
+               100 * mask->n_windows / (mask->n_events > 0 ? mask->n_events : 1),
+               pos, n_slots);
+    }
+    mask->n_windows++;
+
+    return dead_end;
+}
+
+/**
+ * note a visit by a probed window to "node", or to its first bases only if
+ * a path node is not "full"y walked. The window may still record a match
+ * unless the node is too_full, or the worker alone has already seen enough
+ * full visits to fill it. Visits are only counted if "count" is set. A node
+ * taking over the slot of another starts counting afresh, which can only
+ * replay more windows than needed.
+ */
+void _probe_visit( mask_worker_t *worker, node_id_t id, gtree_t *node,
+                   int full, int count, int *hit ) {
+    if (GTREE_TOO_FULL(node)) {
+        return;
+    }
+    if (!full || !count) {
+        *hit = 1;
+    }
+    else {
+        mask_count_t *slot = &worker->counts[id & worker->count_mask];
+        if (slot->id != id) {
+            slot->id = id;
+            slot->n = 0;
+        }
+        if (slot->n < MAX_LOCS_PER_NODE + 1) {
+            slot->n++;
+            *hit = 1;
         }
+    }
+}
 
-        if (process_base_res) {
-            // update window size
-            int i;
-            for (i = cur_window_size - 1; i > 0; i--) {
-                // push back onto buffer
-                bufungetc(window_buffer[i]);
+/**
+ * walk a window down the gtree as _mask_window would, but without touching
+ * it, and note in "hit" whether the window may record any match.
+ *
+ * @return:
+ *      1 if the window ran into a dead end, 0 otherwise
+ */
+int _probe_window( mask_worker_t *worker, window_scanner_t *scanner,
+                   int n_slots, int count, int *walked, int *hit ) {
+    node_arena_t *arena = worker->ix->arena;
+    node_id_t id = worker->ix->root;
+    gtree_t *node = GTREE_NODE(arena, id);
+    int pending = 0;    // on a path node, visits up to "off" still due
+    int off = 0;
+    int exact = _needs_dead_end(scanner, n_slots);
+    *walked = 0;
+    *hit = 0;
+
+    int i;
+    for (i = 0; i < n_slots; i++) {
+        int shift = scanner->n_held - 1 - i;
+        if ((scanner->illegal >> shift) & 0x1) {
+            continue;
+        }
+        *walked = 1;
+        bp_t base = (scanner->bases >> (2 * shift)) & 0x3;
+
+        if (pending) {
+            int len = GTREE_PATH_LEN(node);
+            if (off + 1 < len) {
+                if (GTREE_PATH_BASE(node, off) == base) {
+                    off++;
+                    continue;
+                }
+                _probe_visit(worker, id, node, 0, count, hit);
+                return 1;
+            }
+            _probe_visit(worker, id, node, 1, count, hit);
+            pending = 0;
+            if (node->next[0] == NULL_NODE
+                    || GTREE_PATH_BASE(node, len - 1) != base) {
+                return 1;
+            }
+            id = node->next[0];
+        }
+        else {
+            if (node->next[base] == NULL_NODE) {
+                return 1;
             }
-            cur_pos = cur_pos - cur_window_size + 1;
-            cur_node = ix->root;
-            cur_window_size = 0; // delete the first char to move forward
-            force_window_rewind = 0;
+            id = node->next[base];
+        }
 
+        node = GTREE_NODE(arena, id);
+        if (!exact && GTREE_SATURATED(node)) {
+            return 0;
+        }
+        if (GTREE_KIND(node) == GTREE_KIND_PATH) {
+            pending = 1;
+            off = 0;
+        }
+        else {
+            _probe_visit(worker, id, node, 1, count, hit);
+        }
+    }
+
+    if (pending) {
+        _probe_visit(worker, id, node, off + 1 == GTREE_PATH_LEN(node),
+                     count, hit);
+    }
+    return 0;
+}
+
+/**
+ * window handler probing each window of a chunk, and keeping those that may
+ * record a match to be replayed by _mask_window in order. Past the end of the
+ * chunk, only the windows that started within it are handled.
+ */
+int _probe_mask_window( window_scanner_t *scanner, int n_slots, void *ctx ) {
+    mask_worker_t *worker = ctx;
+    if (worker->remaining == 0) {
+        return 0;
+    }
+    if (worker->remaining > 0) {
+        worker->remaining--;
+    }
+    worker->n_windows++;
+
+    // whether a window opening on an illegal character is walked depends on
+    // the window before it, which may lie in an earlier chunk
+    int illegal_start = (scanner->illegal >> (scanner->n_held - 1)) & 0x1;
+    int unknown = illegal_start
+                    && worker->dead_end == MASK_DEAD_END_UNKNOWN;
+    if (illegal_start && worker->dead_end == 1) {
+        return 1;
+    }
+
+    int walked, hit;
+    int dead_end = _probe_window(worker, scanner, n_slots, !unknown,
+                                 &walked, &hit);
+
+    if (hit || unknown) {
+        if (worker->n_hits == worker->cap_hits) {
+            worker->cap_hits = worker->cap_hits == 0
+                                    ? 1024 : 2 * worker->cap_hits;
+            worker->hits = realloc(worker->hits,
+                                   sizeof(mask_hit_t) * worker->cap_hits);
+        }
+        mask_hit_t *entry = &worker->hits[worker->n_hits++];
+        entry->scanner = *scanner;
+        entry->n_slots = n_slots;
+        entry->dead_end = worker->dead_end;
+    }
+    if (walked) {
+        // an unknown window that ran into a dead end leaves one behind
+        // whether it was walked or not
+        worker->dead_end = unknown && !dead_end
+                            ? MASK_DEAD_END_UNKNOWN : dead_end;
+    }
+    return dead_end;
+}
+
+void *_mask_worker_main( void *arg ) {
+    mask_worker_t *worker = arg;
+    ref_seq_t *ref = worker->ref;
+    window_scanner_t scanner;
+    scanner.bases = 0;
+    scanner.illegal = 0;
+    scanner.n_held = 0;
+    scanner.pos = 0;       // relative to the start of the chunk until the
+    scanner.desc = 0;      // next sequence, fixed up once all are done
+
+    long i;
+    worker->remaining = -1;
+    for (i = worker->lo; i < worker->hi; i++) {
+        _scan_event(&scanner, ref->events[i], _probe_mask_window, worker);
+    }
+    worker->end_pos = scanner.pos;
+    worker->end_desc = scanner.desc;
+
+    if (worker->hi == ref->n_events) {
+        // the end of the file is left to the replay
+        worker->tail = scanner;
+        return NULL;
+    }
+    worker->remaining = scanner.n_held;
+    for (; i < ref->n_events && worker->remaining > 0; i++) {
+        _scan_event(&scanner, ref->events[i], _probe_mask_window, worker);
+    }
+    return NULL;
+}
+
+/**
+ * mask "ix" against "ref" on "n_chunks" threads. Each thread probes the
+ * windows starting in its chunk of the reference without touching the
+ * gtree. The windows that may still record a match are then replayed by
+ * _mask_window in file order, together with the end of the file, so that
+ * the result is that of a serial scan.
+ */
+void _mask_parallel( ix_t *ix, ref_seq_t *ref, int n_chunks ) {
+    mask_worker_t *workers = malloc(sizeof(mask_worker_t) * n_chunks);
+    pthread_t *threads = malloc(sizeof(pthread_t) * n_chunks);
+    // as many count slots as there are node ids, up to MASK_COUNT_SLOTS
+    size_t n_ids = (size_t) ix->arena->n_slabs << NODE_ARENA_SLAB_BITS;
+    size_t n_counts = MASK_COUNT_SLOTS;
+    while (n_counts / 2 >= n_ids) {
+        n_counts /= 2;
+    }
+    int t;
+    for (t = 0; t < n_chunks; t++) {
+        workers[t].ix = ix;
+        workers[t].ref = ref;
+        workers[t].lo = ref->n_events * t / n_chunks;
+        workers[t].hi = ref->n_events * (t + 1) / n_chunks;
+        workers[t].counts = calloc(n_counts, sizeof(mask_count_t));
+        workers[t].count_mask = n_counts - 1;
+        workers[t].dead_end = t == 0 ? 0 : MASK_DEAD_END_UNKNOWN;
+        workers[t].hits = NULL;
+        workers[t].n_hits = 0;
+        workers[t].cap_hits = 0;
+        workers[t].n_windows = 0;
+        pthread_create(&threads[t], NULL, _mask_worker_main, &workers[t]);
+    }
+    long n_windows = 0, n_hits = 0;
+    for (t = 0; t < n_chunks; t++) {
+        pthread_join(threads[t], NULL);
+        free(workers[t].counts);
+        n_windows += workers[t].n_windows;
+        n_hits += workers[t].n_hits;
+    }
+    printf("INFO: replaying %ld of %ld windows\n", n_hits, n_windows);
+
+    mask_state_t mask;
+    mask.ix = ix;
+    mask.dead_end = 0;
+    mask.n_events = ref->n_events;
+    mask.n_windows = 0;
+
+    long base = 0;          // position of the first slot of the chunk
+    char incoming = 0;      // dead end of the last window walked before it
+    for (t = 0; t < n_chunks; t++) {
+        mask_worker_t *worker = &workers[t];
+        long i;
+        for (i = 0; i < worker->n_hits; i++) {
+            mask_hit_t *entry = &worker->hits[i];
+            if (entry->scanner.desc == 0) {
+                entry->scanner.pos += base;
+            }
+            mask.dead_end = entry->dead_end == MASK_DEAD_END_UNKNOWN
+                                ? incoming : entry->dead_end;
+            _mask_window(&entry->scanner, entry->n_slots, &mask);
+        }
+        if (worker->dead_end != MASK_DEAD_END_UNKNOWN) {
+            incoming = worker->dead_end;
+        }
+        if (t == n_chunks - 1 && worker->tail.desc == 0) {
+            worker->tail.pos += base;
+        }
+        base = worker->end_desc > 0 ? worker->end_pos
+                                    : base + worker->end_pos;
+        free(worker->hits);
+    }
+
+    // a window that ran into a dead end was never in progress at the end
+    window_scanner_t *tail = &workers[n_chunks - 1].tail;
+    mask.dead_end = incoming;
+    while (tail->n_held > 0 && _mask_window(tail, tail->n_held, &mask)) {
+        tail->n_held--;
+    }
+
+    free(threads);
+    free(workers);
+}
+
+int mask_gtree( char *ix_file, ix_t *ix, int n_threads ) {
+    printf("Masking gtree on FASTA input %s.\n", ix_file);
+
+    ref_seq_t *ref = read_fasta(ix_file, NULL, n_threads);
+    if (ref == NULL) {
+        return 1;
+    }
+
+    int n_chunks = n_threads;
+    if (n_chunks > ref->n_events / MASK_MIN_CHUNK) {
+        n_chunks = ref->n_events / MASK_MIN_CHUNK;
+    }
+    if (n_chunks > 1 && ix->lazy != NULL) {
+        // probing workers walk the gtree by hand, and cannot read shards in
+        printf("INFO: lazy index, masking on one thread\n");
+        n_chunks = 1;
+    }
+    if (n_chunks > 1) {
+        printf("INFO: masking with %d threads\n", n_chunks);
+        _mask_parallel(ix, ref, n_chunks);
+        destroy_ref_seq(ref);
+        return 0;
+    }
+
+    mask_state_t mask;
+    mask.ix = ix;
+    mask.dead_end = 0;
+    mask.n_events = ref->n_events;
+    mask.n_windows = 0;
+    _scan_ref_seq(ref, LOC_NO_DESC, _mask_window, &mask);
+
+    destroy_ref_seq(ref);
+
+    // a shard that failed to read was masked as if it were empty
+    return ix->lazy != NULL && ix->lazy->err;
+}
+
+/**
+ * find the nodes "depth" levels below "root", in pre-order. The walk never
+ * goes deeper than "depth", which must be at most MAX_WINDOW_SIZE.
+ *
+ * @return:
+ *      the number of nodes found
+ */
+long _collect_prune_tasks( node_arena_t *arena, node_id_t root, int depth,
+                           node_id_t **tasks ) {
+    node_id_t ids[MAX_WINDOW_SIZE + 1];
+    int next[MAX_WINDOW_SIZE + 1];
+    int top = 0;
+    long n_tasks = 0, cap_tasks = 0;
+
+    ids[0] = root;
+    next[0] = 0;
+    *tasks = NULL;
+    while (top >= 0) {
+        if (top == depth) {
+            if (n_tasks == cap_tasks) {
+                cap_tasks = cap_tasks == 0 ? 1024 : 2 * cap_tasks;
+                *tasks = realloc(*tasks, sizeof(node_id_t) * cap_tasks);
+            }
+            (*tasks)[n_tasks++] = ids[top];
+            top--;
             continue;
         }
 
-        if (iter % 1000000 == 0) {
-            iter = 0;
-            long int in_pos = ftell(in);
+        gtree_t *node = GTREE_NODE(arena, ids[top]);
+        int n_next = GTREE_KIND(node) == GTREE_KIND_PATH ? 1 : 4;
+        while (next[top] < n_next && node->next[next[top]] == NULL_NODE) {
+            next[top]++;
+        }
+        if (next[top] == n_next) {
+            top--;
+            continue;
+        }
+        ids[top + 1] = node->next[next[top]];
+        next[top]++;
+        top++;
+        next[top] = 0;
+    }
+    return n_tasks;
+}
+
+void *_prune_worker_main( void *arg ) {
+    prune_worker_t *worker = arg;
+    prune_pool_t *pool = worker->pool;
 
-            printf("INFO: %02ld%% of file processed;"
-                   " working at desc:%s, pos:%ld, window:%ld\n",
-                   100 * in_pos / in_size,
-                   ix->descs[ix->n_descs - 1], cur_pos, cur_window_size);
+    // subtrees are handed out one at a time, so that a thread finished with
+    // small ones takes on more while another is busy with a large one
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        long task = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (task >= pool->n_tasks) {
+            break;
         }
-        iter++; 
+        pool->fewest[task] = prune_gtree_above(worker->arena,
+                                               pool->tasks[task], -1, NULL);
+    }
+    return NULL;
+}
+
+void prune_gtree_threaded( node_arena_t *arena, node_id_t root,
+                           int n_threads ) {
+    if (n_threads <= 1) {
+        prune_gtree(arena, root);
+        return;
+    }
 
-    } 
+    // go down until there are enough subtrees to go around
+    prune_pool_t pool;
+    int depth = 0;
+    pool.n_tasks = 1;
+    pool.tasks = NULL;
+    while (pool.n_tasks < (long) PRUNE_TASKS_PER_THREAD * n_threads
+            && depth < MAX_WINDOW_SIZE) {
+        node_id_t *tasks;
+        long n_tasks = _collect_prune_tasks(arena, root, depth + 1, &tasks);
+        if (n_tasks == 0) {
+            free(tasks);
+            break;
+        }
+        free(pool.tasks);
+        pool.tasks = tasks;
+        pool.n_tasks = n_tasks;
+        depth++;
+    }
+    if (depth == 0) {
+        prune_gtree(arena, root);
+        return;
+    }
+    printf("INFO: pruning with %d threads over %ld subtrees\n",
+           n_threads, pool.n_tasks);
 
-    free(cur_desc);
-    fclose(in);
+    pool.fewest = malloc(sizeof(int) * pool.n_tasks);
+    pool.next = 0;
+    pthread_mutex_init(&pool.lock, NULL);
 
-    return 0;
+    prune_worker_t *workers = malloc(sizeof(prune_worker_t) * n_threads);
+    pthread_t *threads = malloc(sizeof(pthread_t) * n_threads);
+    int i;
+    for (i = 0; i < n_threads; i++) {
+        workers[i].pool = &pool;
+        workers[i].arena = share_node_arena(arena);
+    }
+    for (i = 0; i < n_threads; i++) {
+        pthread_create(&threads[i], NULL, _prune_worker_main, &workers[i]);
+    }
+    for (i = 0; i < n_threads; i++) {
+        pthread_join(threads[i], NULL);
+        destroy_node_arena(workers[i].arena);
+    }
+
+    prune_gtree_above(arena, root, depth, pool.fewest);
+
+    pthread_mutex_destroy(&pool.lock);
+    free(threads);
+    free(workers);
+    free(pool.fewest);
+    free(pool.tasks);
 }
 
-ix_t *build_ix_from_ref_seq( char *ref_filename ) {
-    ix_t *ix = init_ix();
-    build_gtree(ref_filename, &(ix->root), &(ix->descs), &(ix->n_descs));
+ix_t *build_ix_from_ref_seq( char *ref_filename, int root_k,
+                             int n_threads, int bulk, int prune ) {
+    ix_t *ix = init_ix(root_k);
+    int status;
+    if (bulk) {
+        status = build_gtree_bulk(ref_filename, ix, n_threads, prune);
+    }
+    else {
+        status = build_gtree(ref_filename, ix, n_threads, prune);
+    }
+    if (status != 0) {
+        destroy_ix(ix);
+        return NULL;
+    }
+    if (prune) {
+        _prune_ix(ix, n_threads);
+    }
     return ix;
 }
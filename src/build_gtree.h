@@ -18,83 +18,99 @@
 #include <stdio.h>
 
 /**
- * "getc()"-like interface to a file, with MAX_WINDOW_SIZE allowable chars of
- * pushback in a global buffer, allowing for efficient and easy-to-understand
- * index contruction logic.
+ * build gtree index from a FASTA file into "ix". Nodes are allocated from the
+ * node arena of "ix" and description strings are appended to "ix->descs".
  *
- * @args:
- *      stream - a FILE pointer from which to get the next char
- * @return
- *      the last character pushed back with "bufungetc" or the next character
- *      in "stream" if the buffer is empty.
- */
-char bufgetc(FILE *stream);
-
-/**
- * push back character to buffer, will return an error code if buffer is full.
+ * ASSUME:
+ *      - no description strings are greater than MAX_DESC_LEN chars long.
+ *
+ * The FASTA file is read into memory once. With more than one thread, the
+ * gtree is split into partitions by the first few bases of each window and
+ * every thread grows its own partitions without locking. Each thread still
+ * sees the windows in file order, so the result is identical to a serial
+ * build.
+ *
+ * "ix" may already hold a gtree, e.g. one loaded with "deserialize_ix", in
+ * which case the new sequences are added to it much as if they had followed
+ * the old ones in a single build: each node keeps its first matches, and
+ * nodes already too_full stay so. The short windows left at the end of the
+ * old file by its own build are not made up for. A loaded gtree is only split between threads if
+ * its root table covers the partitions.
  *
  * @args:
- *      c - the character to push back
+ *      ix_file - FASTA file to build index from
+ *      ix - gtree index to build
+ *      n_threads - number of threads to build with
+ *      prune - if non-zero, each thread prunes its partitions once they are
+ *              complete, leaving the nodes above them to "prune_gtree"
  *
  * @return:
- *      0         on success
- *      errcode   otherwise
+ *      0        on success
+ *      errcode  otherwise
+ *
  */
-int bufungetc(char c);
+int build_gtree( char *ix_file, ix_t *ix, int n_threads, int prune );
 
 /**
- * copy a description string from "in" to desc (terminated by a newline
- * character)
+ * build gtree index from a FASTA file into "ix" by sorting rather than by
+ * inserting one window at a time. Every window is packed into a 64-bit key,
+ * the keys are radix sorted, and the gtree is then built bottom up in one
+ * sequential pass over them, laid out in the order it will be walked. The
+ * result is identical to that of "build_gtree".
  *
  * ASSUME:
  *      - no description strings are greater than MAX_DESC_LEN chars long.
  *
  * @args:
- *      in - FILE to read from 
- *      desc - string to read data into
+ *      ix_file - FASTA file to build index from
+ *      ix - gtree index to build
+ *      n_threads - number of threads to sort with
+ *      prune - if non-zero, every subtree BULK_PRUNE_DEPTH bases down is
+ *              pruned as soon as it is built, leaving the nodes above them
+ *              to "prune_gtree"
  *
  * @return:
  *      0        on success
  *      errcode  otherwise
  *
  */
-int read_desc ( FILE *in, char *desc );
+int build_gtree_bulk( char *ix_file, ix_t *ix, int n_threads, int prune );
 
 /**
- * process a new base and advance the current node
- *
- * @args:
- *      base - the base pair to process
- *      cur_node_ref - a reference to the current node, which will be updated
- *                     with "base".
- *      desc - a description of the sequence being indexed.
- *      pos - the current position in sequence being indexed.
- */
-int process_base(bp_t base, gtree_t **cur_node_ref, long pos, char *desc);
-
-/**
- * build gtree index, assign to "gtree_root".
+ * build gtree index from a FASTA file straight into the serialized index
+ * "outfile", for references whose gtree does not fit in memory. Windows are
+ * bucketed by their leading bases into spill files next to "outfile" as the
+ * reference is tokenized, with enough buckets, judged by the size of the
+ * file, for each to be built within "mem_limit" bytes. Each bucket is then
+ * built on its own, in file order, written out and released before the
+ * next. Only a chunk of the reference and the nodes above the buckets are
+ * held throughout. The index written is identical to that of "build_gtree",
+ * but "ix" is left holding only the nodes above the buckets. A spill file
+ * that cannot be written or read back in full fails the build.
+ *
+ * With "prune" set, each bucket is instead built in place in "ix" and pruned
+ * at once, so that only the pruned gtree and a single unpruned bucket are
+ * ever held. The whole gtree is then pruned and written as by "gtree ix
+ * prune", and left in "ix".
  *
  * ASSUME:
  *      - no description strings are greater than MAX_DESC_LEN chars long.
  *
  * @args:
  *      ix_file - FASTA file to build index from
- *      ix - gtree index to build
- *      gtree_root - pointer to to assign gtree_root to
- *      desc_strings - pointer to an array of strings;
- *                     assign description strings to for free later
- *      n_descs - number of description strings in desc_strings
+ *      ix - gtree index to build, holding the description strings after
+ *      n_threads - number of threads to read the FASTA file with
+ *      mem_limit - number of bytes each bucket should be built within
+ *      prune - if non-zero, write the index pruned
+ *      outfile - the name of the file to serialize the index to
  *
  * @return:
  *      0        on success
  *      errcode  otherwise
  *
  */
-int build_gtree( char *ix_file,
-                 gtree_t **gtree_root, 
-                 char ***desc_strings,
-                 unsigned int *n_descs );
+int build_gtree_out_of_core( char *ix_file, ix_t *ix, int n_threads,
+                             long mem_limit, int prune, char *outfile );
 
 /**
  * tests a gtree index for uniqueness against a reference FASTA file by
@@ -105,23 +121,54 @@ int build_gtree( char *ix_file,
  *
  * ***NOTE*** this function will modify the index "ix" passed in.
  *
+ * With more than one thread, the FASTA file is split into chunks which are
+ * walked down the gtree in parallel without modifying it. Each thread counts
+ * its own visits to each node, and keeps only the windows that may still
+ * record a match. Those are then replayed in file order on one thread, so
+ * the result is identical to a serial mask. A lazy index, opened with
+ * "open_ix_lazy", is always masked on one thread.
+ *
  * @args:
  *      mask_file - FASTA file to run against index
  *      ix - gtree index to test
+ *      n_threads - number of threads to mask with
  *
  * @return:
  *      0        on success
  *      errcode  otherwise
  */
-int mask_gtree( char *mask_file, ix_t *ix );
+int mask_gtree( char *mask_file, ix_t *ix, int n_threads );
+
+/**
+ * prune the gtree of "root" as prune_gtree does, on "n_threads" threads.
+ * The gtree is cut into disjoint subtrees a few levels down, which are
+ * handed out to the threads one at a time, each releasing the nodes it
+ * prunes back to "arena". The nodes above them are pruned last. The result
+ * is identical to prune_gtree.
+ *
+ * @args:
+ *      arena - the node arena that the gtree was allocated from
+ *      root - the id of the root of the gtree
+ *      n_threads - number of threads to prune with
+ */
+void prune_gtree_threaded( node_arena_t *arena, node_id_t root,
+                           int n_threads );
 
 /**
  * Construct an index from a basic FASTA file
  *
  * @args:
  *      ref_filename - filename for the reference sequence
- *
+ *      root_k - number of leading bases covered by the root table, 0 for none
+ *      n_threads - number of threads to build with
+ *      bulk - if non-zero, build with "build_gtree_bulk"
+ *      prune - if non-zero, prune subtrees as they are completed and then
+ *              the whole index, with the same result as "prune_gtree" on
+ *              the index built without
+ * @return:
+ *      the index built, or NULL if the reference could not be read
  */
-ix_t *build_ix_from_ref_seq( char *ref_filename );
+ix_t *build_ix_from_ref_seq( char *ref_filename, int root_k,
+                             int n_threads, int bulk, int prune );
 
 #endif
@@ -14,9 +14,18 @@
 #define EXEC_MODE_IX_MASK 1
 #define EXEC_MODE_IX_PRUNE 2
 #define EXEC_MODE_IX_STAT 3
+#define EXEC_MODE_IX_APPEND 4
+#define EXEC_MODE_IX_CONVERT 5
 
 #define EXEC_MODE_ALN 100
 
+// formats `gtree ix` writes indexes in, used in args_t
+#define IX_ENCODING_STREAM 0
+#define IX_ENCODING_FLAT 1
+#define IX_ENCODING_COMPACT 2
+#define IX_ENCODING_SHARDED 3
+#define IX_COMPACT_DEFAULT_LEVEL 6
+
 // output format modes
 #define OUTPUT_FORMAT_SAM 0
 #define OUTPUT_FORMAT_BAM 1
@@ -27,7 +36,127 @@
 // maximum window size to search during gtree index construction.
 #define MAX_WINDOW_SIZE 32
 
+// events of a reference sequence packed one per byte in memory, a base in
+// the low 2 bits unless flagged otherwise
+#define REF_EVENT_BASE_MASK 0x03
+#define REF_EVENT_ILLEGAL   0x04    // slot taken by an illegal character
+#define REF_EVENT_BREAK     0x08    // 'N' or '>', ends every window held
+#define REF_EVENT_NEW_SEQ   0x10    // '>', the next sequence starts here
+
+// partitions of the gtree handed to each thread of a parallel build
+#define BUILD_PARTS_PER_THREAD 16
+
+// subtrees of the gtree handed out to the threads of a parallel prune, at
+// least this many per thread so that uneven ones even out
+#define PRUNE_TASKS_PER_THREAD 64
+
+// split of bulk_window_t.desc_len between descriptor id and window length
+#define BULK_LEN_BITS 5
+#define BULK_LEN_MASK ((1 << BULK_LEN_BITS) - 1)
+#define BULK_MAX_DESCS ((1U << (32 - BULK_LEN_BITS)) - 1)
+
+// depth of the subtrees pruned by a bulk build as soon as they are complete
+#define BULK_PRUNE_DEPTH 12
+
+// out-of-core builds: estimated bytes of unpruned gtree grown per window,
+// headroom for uneven buckets, and the most leading bases to split buckets
+// by, giving at most 4^MAX_SPILL_DEPTH spill files
+#define SPILL_BYTES_PER_WINDOW 64
+#define SPILL_BUCKET_SKEW 4
+#define MAX_SPILL_DEPTH 4
+
+// bases taken to be held by each byte of a gzip'd reference, which is only
+// streamed, in picking the number of buckets for it
+#define SPILL_GZIP_RATIO 4
+
+// a parallel mask splits the reference into chunks of at least this many
+// events, and marks the dead end of a window walked in an earlier chunk
+#define MASK_MIN_CHUNK (1 << 16)
+#define MASK_DEAD_END_UNKNOWN 2
+
+// most slots a probing worker counts node visits in, so that each thread
+// holds a fixed table rather than a count for every node of the index
+#define MASK_COUNT_SLOTS (1 << 18)
+
+// bytes inflated at a time from a plain gzip FASTA file, and tokenized at a
+// time from a plain FASTA file whose events are streamed
+#define GZIP_CHUNK_SIZE (1 << 20)
+#define FASTA_STREAM_CHUNK_SIZE (1 << 20)
+
+// largest uncompressed BGZF block, and blocks queued ahead per helper thread
+#define BGZF_MAX_BLOCK_SIZE 65536
+#define BGZF_SLOTS_PER_THREAD 4
+
 // maximum number of hits per node before declaring "too_full"
 #define MAX_LOCS_PER_NODE 4
 
+// number of gtree nodes carved out of each node arena slab
+#define NODE_ARENA_SLAB_BITS 16
+#define NODE_ARENA_SLAB_SIZE (1 << NODE_ARENA_SLAB_BITS)
+#define NODE_ARENA_MAX_SLABS (1 << (32 - NODE_ARENA_SLAB_BITS))
+
+// node id reserved to mean "no node", never handed out by a node arena
+#define NULL_NODE 0
+
+// default and maximum number of leading bases covered by the root table,
+// which directly indexes the 4^k nodes found k bases below the root
+#define DEFAULT_ROOT_TABLE_K 10
+#define MAX_ROOT_TABLE_K 13
+
+// leading bytes and current version of the on-disk index format
+#define IX_FORMAT_MAGIC "GTIX"
+#define IX_FORMAT_VERSION 1
+
+// version of the flat index format, which shares the magic, and its
+// sections: description strings, then the node and loc slabs of the gtree
+#define IX_FLAT_FORMAT_VERSION 2
+#define IX_SECTION_DESCS 1
+#define IX_SECTION_NODES 2
+#define IX_SECTION_LOCS  3
+#define IX_FLAT_N_SECTIONS 3
+#define IX_FLAT_ALIGN 4096
+
+// compact indexes, bit-packed heads and varint locs in zlib blocks
+#define IX_COMPACT_FORMAT_VERSION 3
+#define IX_COMPACT_TOO_FULL 0x10          // head bits after the child mask
+#define IX_COMPACT_SAME 0x20              // data as in the parent node
+#define IX_COMPACT_N_MATCHES_SHIFT 6
+#define IX_COMPACT_N_MATCHES_MAX 3        // n_matches from here on follow
+                                          // as a varint
+
+// sharded indexes, the gtree cut IX_SHARD_DEPTH bases down into subtrees
+// that are read in parallel, marked by IX_SHARD_MARK where they hang off
+#define IX_SHARDED_FORMAT_VERSION 4
+#define IX_SHARD_DEPTH 4
+#define IX_SHARD_MARK 2
+#define IX_SHARD_MAX (1 << 24)
+#define IX_SHARD_MAX_DEPTH 12   // deepest cut that stays within IX_SHARD_MAX
+
+// bytes of a streamed index held back in memory before they are written,
+// while the subtree they belong to might still be pruned
+#define PRUNE_STREAM_BUF_SIZE (1 << 20)
+
+// bytes an index is read and written in at a time
+#define IX_IO_BUF_SIZE (1 << 22)
+
+// maximum number of bases collapsed into a single path-compressed node
+#define MAX_PATH_LEN 32
+
+// number of locs carved out of each node arena loc slab
+#define LOC_ARENA_SLAB_BITS 16
+#define LOC_ARENA_SLAB_SIZE (1 << LOC_ARENA_SLAB_BITS)
+#define LOC_ARENA_MAX_SLABS (1 << (32 - LOC_ARENA_SLAB_BITS))
+
+// loc id reserved to mean "no locs", never handed out by a node arena
+#define NULL_LOC 0
+
+// loc runs are sized in powers of two, enough classes for any n_matches
+#define LOC_RUN_CLASSES 8
+
+// descriptor id of locs recorded without a sequence description
+#define LOC_NO_DESC 0xFFFFFFFF
+
+// largest position a loc holds, sequences indexed may be no longer
+#define LOC_MAX_POS 0xFFFFFFFFL
+
 #endif
@@ -0,0 +1,591 @@
+/** fasta.c
+ * tokenize FASTA files into packed reference events.
+ */
+
+#include "fasta.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// event for each character of a sequence line, filled in on first use
+uint8_t BASE_EVENTS[256];
+int BASE_EVENTS_READY = 0;
+
+void _init_base_events() {
+    memset(BASE_EVENTS, REF_EVENT_ILLEGAL, sizeof(BASE_EVENTS));
+    BASE_EVENTS['A'] = BASE_EVENTS['a'] = A;
+    BASE_EVENTS['C'] = BASE_EVENTS['c'] = C;
+    BASE_EVENTS['T'] = BASE_EVENTS['t'] = T;
+    BASE_EVENTS['G'] = BASE_EVENTS['g'] = G;
+    BASE_EVENTS_READY = 1;
+}
+
+/**
+ * find the first '\n', '>', 'N' or 'n' in [p, end), or end if there is none.
+ */
+const char *_find_special( const char *p, const char *end ) {
+#if defined(__AVX2__)
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i gt = _mm256_set1_epi8('>');
+    const __m256i n = _mm256_set1_epi8('n');
+    const __m256i fold = _mm256_set1_epi8(0x20);
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) p);
+        __m256i hit = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, nl),
+                                _mm256_cmpeq_epi8(v, gt)),
+                _mm256_cmpeq_epi8(_mm256_or_si256(v, fold), n));
+        unsigned int mask = (unsigned int) _mm256_movemask_epi8(hit);
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+#elif defined(__SSE2__)
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i gt = _mm_set1_epi8('>');
+    const __m128i n = _mm_set1_epi8('n');
+    const __m128i fold = _mm_set1_epi8(0x20);
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        __m128i hit = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, gt)),
+                _mm_cmpeq_epi8(_mm_or_si128(v, fold), n));
+        unsigned int mask = (unsigned int) _mm_movemask_epi8(hit);
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    for (; p < end; p++) {
+        if (*p == '\n' || *p == '>' || *p == 'N' || *p == 'n') {
+            break;
+        }
+    }
+    return p;
+}
+
+/**
+ * find the first character in [p, end) that is not 'N', 'n' or '\n', or end
+ * if there is none.
+ */
+const char *_skip_n_run( const char *p, const char *end ) {
+#if defined(__AVX2__)
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i n = _mm256_set1_epi8('n');
+    const __m256i fold = _mm256_set1_epi8(0x20);
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) p);
+        __m256i run = _mm256_or_si256(
+                _mm256_cmpeq_epi8(v, nl),
+                _mm256_cmpeq_epi8(_mm256_or_si256(v, fold), n));
+        unsigned int mask = ~(unsigned int) _mm256_movemask_epi8(run);
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+#elif defined(__SSE2__)
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i n = _mm_set1_epi8('n');
+    const __m128i fold = _mm_set1_epi8(0x20);
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        __m128i run = _mm_or_si128(
+                _mm_cmpeq_epi8(v, nl),
+                _mm_cmpeq_epi8(_mm_or_si128(v, fold), n));
+        unsigned int mask = ~(unsigned int) _mm_movemask_epi8(run) & 0xFFFF;
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    for (; p < end; p++) {
+        if (*p != '\n' && *p != 'N' && *p != 'n') {
+            break;
+        }
+    }
+    return p;
+}
+
+void _reserve_ref_events( ref_seq_t *ref, long n_events ) {
+    if (ref->n_events + n_events <= ref->cap_events) {
+        return;
+    }
+    while (ref->n_events + n_events > ref->cap_events) {
+        ref->cap_events = ref->cap_events == 0 ? 4096 : 2 * ref->cap_events;
+    }
+    ref->events = realloc(ref->events, ref->cap_events);
+}
+
+void _end_fasta_header( fasta_reader_t *reader ) {
+    ix_t *ix = reader->ix;
+    reader->desc[reader->desc_len] = '\0';
+    reader->in_header = 0;
+    reader->cur_pos = 0;
+    if (ix == NULL) {
+        return;
+    }
+    ix->descs = realloc(ix->descs, sizeof(char *) * (ix->n_descs + 1));
+    ix->descs[ix->n_descs] = malloc(reader->desc_len + 1);
+    strcpy(ix->descs[ix->n_descs], reader->desc);
+    ix->n_descs++;
+}
+
+void init_fasta_reader( fasta_reader_t *reader, ix_t *ix ) {
+    if (!BASE_EVENTS_READY) {
+        _init_base_events();
+    }
+    reader->ref = malloc(sizeof(ref_seq_t));
+    reader->ref->events = NULL;
+    reader->ref->n_events = 0;
+    reader->ref->cap_events = 0;
+    reader->sink = NULL;
+    reader->sink_ctx = NULL;
+    reader->ix = ix;
+    reader->desc[0] = '\0';
+    reader->desc_len = 0;
+    reader->in_header = 0;
+    reader->cur_pos = 0;
+    reader->too_long = 0;
+}
+
+void _tokenize_fasta( fasta_reader_t *reader, const char *buf, size_t len ) {
+    ref_seq_t *ref = reader->ref;
+    const char *p = buf;
+    const char *end = buf + len;
+
+    while (p < end) {
+        if (reader->in_header) {
+            const char *eol = memchr(p, '\n', end - p);
+            const char *stop = eol != NULL ? eol : end;
+            // descriptions longer than MAX_DESC_LEN are cut short
+            size_t n = stop - p;
+            if (n > MAX_DESC_LEN - 1 - reader->desc_len) {
+                n = MAX_DESC_LEN - 1 - reader->desc_len;
+            }
+            memcpy(reader->desc + reader->desc_len, p, n);
+            reader->desc_len += n;
+            if (eol == NULL) {
+                return;
+            }
+            _end_fasta_header(reader);
+            p = eol + 1;
+            continue;
+        }
+
+        // translate the span up to the next special character in one go
+        const char *q = _find_special(p, end);
+        _reserve_ref_events(ref, (q - p) + 1);
+        uint8_t *events = ref->events + ref->n_events;
+        const char *c;
+        for (c = p; c < q; c++) {
+            uint8_t event = BASE_EVENTS[(unsigned char) *c];
+            if (event == REF_EVENT_ILLEGAL) {
+                printf("ERROR - encountered illegal character [%c|%d] in %s:%ld",
+                            *c, *c, reader->desc,
+                            reader->cur_pos + (long) (c - p));
+            }
+            *events++ = event;
+        }
+        ref->n_events += q - p;
+        reader->cur_pos += q - p;
+        // locs only hold 32 bit positions, which would silently wrap
+        if (reader->ix != NULL && reader->cur_pos - 1 > LOC_MAX_POS
+                && !reader->too_long) {
+            printf("ERROR: sequence %s is longer than the %ld bases an "
+                   "index holds\n", reader->desc, LOC_MAX_POS + 1);
+            reader->too_long = 1;
+        }
+
+        if (q == end) {
+            return;
+        }
+        switch (*q) {
+            case '\n':
+                p = q + 1;
+                break;
+
+            case '>':
+                ref->events[ref->n_events++] =
+                        REF_EVENT_BREAK | REF_EVENT_NEW_SEQ;
+                reader->in_header = 1;
+                reader->desc_len = 0;
+                p = q + 1;
+                break;
+
+            default:
+                // a run of N ends every window as a single break
+                ref->events[ref->n_events++] = REF_EVENT_BREAK;
+                p = _skip_n_run(q + 1, end);
+                break;
+        }
+    }
+}
+
+void tokenize_fasta( fasta_reader_t *reader, const char *buf, size_t len ) {
+    _tokenize_fasta(reader, buf, len);
+    if (reader->sink != NULL && reader->ref->n_events > 0) {
+        reader->sink(reader->ref, reader->sink_ctx);
+        reader->ref->n_events = 0;
+    }
+}
+
+ref_seq_t *finish_fasta_reader( fasta_reader_t *reader ) {
+    if (reader->in_header) {
+        _end_fasta_header(reader);
+    }
+    return reader->ref;
+}
+
+/**
+ * inflate a gzip file, of one or more members, and tokenize it a chunk at a
+ * time.
+ *
+ * @return:
+ *      0 on success, 1 if the file is corrupt or truncated
+ */
+int _read_gzip( fasta_reader_t *reader, const uint8_t *map, size_t size ) {
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (inflateInit2(&z, 15 + 16) != Z_OK) {
+        return 1;
+    }
+    char *out = malloc(GZIP_CHUNK_SIZE);
+    size_t fed = 0;
+    int status = 0;
+
+    while (1) {
+        // zlib takes its input in pieces of at most 4 GB
+        if (z.avail_in == 0 && fed < size) {
+            size_t n = size - fed < (1U << 30) ? size - fed : (1U << 30);
+            z.next_in = (Bytef *) map + fed;
+            z.avail_in = n;
+            fed += n;
+        }
+        z.next_out = (Bytef *) out;
+        z.avail_out = GZIP_CHUNK_SIZE;
+
+        int ret = inflate(&z, Z_NO_FLUSH);
+        tokenize_fasta(reader, out, GZIP_CHUNK_SIZE - z.avail_out);
+
+        if (ret == Z_STREAM_END) {
+            if (z.avail_in == 0 && fed == size) {
+                break;
+            }
+            // concatenated members, as written by bgzip or cat
+            inflateReset(&z);
+        }
+        else if (ret != Z_OK || (z.avail_in == 0 && fed == size
+                                   && z.avail_out != 0)) {
+            status = 1;
+            break;
+        }
+    }
+
+    free(out);
+    inflateEnd(&z);
+    return status;
+}
+
+/**
+ * size of the BGZF block starting at "p", or 0 if it does not start one.
+ */
+size_t _bgzf_block_size( const uint8_t *p, size_t avail ) {
+    if (avail < 18 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8
+            || !(p[3] & 0x04)) {
+        return 0;
+    }
+    size_t xlen = p[10] | (p[11] << 8);
+    if (12 + xlen > avail) {
+        return 0;
+    }
+    size_t i = 12;
+    while (i + 4 <= 12 + xlen) {
+        size_t slen = p[i + 2] | (p[i + 3] << 8);
+        if (p[i] == 'B' && p[i + 1] == 'C' && slen == 2) {
+            size_t bsize = (p[i + 4] | (p[i + 5] << 8)) + 1;
+            return bsize >= 12 + xlen + 8 && bsize <= avail ? bsize : 0;
+        }
+        i += 4 + slen;
+    }
+    return 0;
+}
+
+/**
+ * inflate a single BGZF block into "slot".
+ *
+ * @return:
+ *      0 on success, 1 if the block is corrupt
+ */
+int _inflate_bgzf_block( z_stream *z, const uint8_t *block, size_t bsize,
+                         bgzf_slot_t *slot ) {
+    size_t xlen = block[10] | (block[11] << 8);
+    const uint8_t *footer = block + bsize - 8;
+    size_t isize = footer[4] | (footer[5] << 8) | (footer[6] << 16)
+                    | ((size_t) footer[7] << 24);
+    if (isize > BGZF_MAX_BLOCK_SIZE) {
+        return 1;
+    }
+
+    inflateReset(z);
+    z->next_in = (Bytef *) block + 12 + xlen;
+    z->avail_in = bsize - 12 - xlen - 8;
+    z->next_out = (Bytef *) slot->data;
+    z->avail_out = BGZF_MAX_BLOCK_SIZE;
+    if (inflate(z, Z_FINISH) != Z_STREAM_END || z->total_out != isize) {
+        return 1;
+    }
+    slot->len = isize;
+    return 0;
+}
+
+void *_bgzf_helper_main( void *arg ) {
+    bgzf_queue_t *queue = arg;
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    inflateInit2(&z, -15);
+
+    pthread_mutex_lock(&queue->lock);
+    while (1) {
+        // stay at most n_slots blocks ahead of the tokenizer
+        while (queue->next < queue->n_blocks && !queue->error
+                && queue->next >= queue->consumed + queue->n_slots) {
+            pthread_cond_wait(&queue->drained, &queue->lock);
+        }
+        if (queue->next >= queue->n_blocks || queue->error) {
+            break;
+        }
+        long i = queue->next++;
+        bgzf_slot_t *slot = &queue->slots[i % queue->n_slots];
+        pthread_mutex_unlock(&queue->lock);
+
+        int failed = _inflate_bgzf_block(&z, queue->map + queue->offsets[i],
+                            queue->offsets[i + 1] - queue->offsets[i], slot);
+
+        pthread_mutex_lock(&queue->lock);
+        if (failed) {
+            queue->error = 1;
+            pthread_cond_broadcast(&queue->drained);
+        }
+        slot->ready = 1;
+        pthread_cond_broadcast(&queue->filled);
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    inflateEnd(&z);
+    return NULL;
+}
+
+/**
+ * inflate the blocks of a BGZF file on "n_threads" helper threads, and
+ * tokenize them in order as they become ready.
+ *
+ * @return:
+ *      0 on success, 1 if a block is corrupt
+ */
+int _read_bgzf( fasta_reader_t *reader, const uint8_t *map,
+                size_t *offsets, long n_blocks, int n_threads ) {
+    bgzf_queue_t queue;
+    queue.map = map;
+    queue.offsets = offsets;
+    queue.n_blocks = n_blocks;
+    queue.n_slots = n_threads * BGZF_SLOTS_PER_THREAD;
+    queue.slots = malloc(sizeof(bgzf_slot_t) * queue.n_slots);
+    int i;
+    for (i = 0; i < queue.n_slots; i++) {
+        queue.slots[i].data = malloc(BGZF_MAX_BLOCK_SIZE);
+        queue.slots[i].ready = 0;
+    }
+    queue.next = 0;
+    queue.consumed = 0;
+    queue.error = 0;
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.filled, NULL);
+    pthread_cond_init(&queue.drained, NULL);
+
+    pthread_t *helpers = malloc(sizeof(pthread_t) * n_threads);
+    for (i = 0; i < n_threads; i++) {
+        pthread_create(&helpers[i], NULL, _bgzf_helper_main, &queue);
+    }
+
+    long b;
+    for (b = 0; b < n_blocks; b++) {
+        bgzf_slot_t *slot = &queue.slots[b % queue.n_slots];
+
+        pthread_mutex_lock(&queue.lock);
+        while (!slot->ready && !queue.error) {
+            pthread_cond_wait(&queue.filled, &queue.lock);
+        }
+        int failed = queue.error;
+        pthread_mutex_unlock(&queue.lock);
+        if (failed) {
+            break;
+        }
+
+        tokenize_fasta(reader, slot->data, slot->len);
+
+        pthread_mutex_lock(&queue.lock);
+        slot->ready = 0;
+        queue.consumed++;
+        pthread_cond_broadcast(&queue.drained);
+        pthread_mutex_unlock(&queue.lock);
+    }
+
+    for (i = 0; i < n_threads; i++) {
+        pthread_join(helpers[i], NULL);
+    }
+    free(helpers);
+
+    for (i = 0; i < queue.n_slots; i++) {
+        free(queue.slots[i].data);
+    }
+    free(queue.slots);
+    pthread_mutex_destroy(&queue.lock);
+    pthread_cond_destroy(&queue.filled);
+    pthread_cond_destroy(&queue.drained);
+
+    return queue.error;
+}
+
+/**
+ * tokenize a gzip'd FASTA file, on helper threads if it is made of BGZF
+ * blocks that can be inflated independently.
+ */
+int _read_compressed( fasta_reader_t *reader, const uint8_t *map,
+                      size_t size, int n_threads ) {
+    long n_blocks = 0;
+    long cap_blocks = 1024;
+    size_t *offsets = malloc(sizeof(size_t) * (cap_blocks + 1));
+    size_t off = 0;
+    while (off < size) {
+        size_t bsize = _bgzf_block_size(map + off, size - off);
+        if (bsize == 0) {
+            break;
+        }
+        if (n_blocks == cap_blocks) {
+            cap_blocks *= 2;
+            offsets = realloc(offsets, sizeof(size_t) * (cap_blocks + 1));
+        }
+        offsets[n_blocks++] = off;
+        off += bsize;
+    }
+    offsets[n_blocks] = off;
+
+    int status;
+    if (off == size) {
+        status = _read_bgzf(reader, map, offsets, n_blocks, n_threads);
+    }
+    else {
+        status = _read_gzip(reader, map, size);
+    }
+    free(offsets);
+    return status;
+}
+
+/**
+ * feed the whole FASTA file "filename" to "reader", mapped into memory.
+ *
+ * @return:
+ *      0 on success, 1 if the file could not be read or indexed
+ */
+int _read_fasta_file( fasta_reader_t *reader, char *filename,
+                      int n_threads ) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("ERROR: could not open FASTA file %s\n", filename);
+        return 1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        printf("ERROR: could not stat FASTA file %s\n", filename);
+        close(fd);
+        return 1;
+    }
+
+    if (st.st_size > 0) {
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            printf("ERROR: could not map FASTA file %s\n", filename);
+            close(fd);
+            return 1;
+        }
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+        int status = 0;
+        if (st.st_size >= 2 && (uint8_t) map[0] == 0x1f
+                            && (uint8_t) map[1] == 0x8b) {
+            status = _read_compressed(reader, (const uint8_t *) map,
+                                      st.st_size, n_threads);
+        }
+        else if (reader->sink != NULL) {
+            // a chunk at a time, so that only a chunk of events is held
+            size_t off;
+            for (off = 0; off < (size_t) st.st_size;
+                    off += FASTA_STREAM_CHUNK_SIZE) {
+                size_t n = st.st_size - off;
+                tokenize_fasta(reader, map + off,
+                               n < FASTA_STREAM_CHUNK_SIZE
+                                   ? n : FASTA_STREAM_CHUNK_SIZE);
+            }
+        }
+        else {
+            tokenize_fasta(reader, map, st.st_size);
+        }
+        munmap(map, st.st_size);
+
+        if (status != 0) {
+            printf("ERROR: corrupt or truncated gzip FASTA file %s\n",
+                        filename);
+            close(fd);
+            return 1;
+        }
+    }
+    close(fd);
+
+    return reader->too_long;
+}
+
+ref_seq_t *read_fasta( char *filename, ix_t *ix, int n_threads ) {
+    fasta_reader_t reader;
+    init_fasta_reader(&reader, ix);
+
+    if (_read_fasta_file(&reader, filename, n_threads) != 0) {
+        destroy_ref_seq(finish_fasta_reader(&reader));
+        return NULL;
+    }
+    return finish_fasta_reader(&reader);
+}
+
+int stream_fasta( char *filename, ix_t *ix, int n_threads,
+                  ref_sink_t sink, void *ctx ) {
+    fasta_reader_t reader;
+    init_fasta_reader(&reader, ix);
+    reader.sink = sink;
+    reader.sink_ctx = ctx;
+
+    int status = _read_fasta_file(&reader, filename, n_threads);
+    destroy_ref_seq(finish_fasta_reader(&reader));
+    return status;
+}
+
+void destroy_ref_seq( ref_seq_t *ref ) {
+    free(ref->events);
+    free(ref);
+}
@@ -0,0 +1,90 @@
+#ifndef FASTA_H
+#define FASTA_H
+
+/** fasta.h
+ * tokenize FASTA files into the packed reference events that the gtree
+ * builders walk windows over. Line breaks are dropped, 'N' runs and headers
+ * become breaks between windows, and every other character takes up a slot.
+ */
+
+#include "types.h"
+#include "consts.h"
+
+#include <stddef.h>
+
+/**
+ * prepare "reader" to tokenize a FASTA file from its start.
+ *
+ * @args:
+ *      reader - the reader to initialize
+ *      ix - index to add each description string to, or NULL to drop them
+ */
+void init_fasta_reader( fasta_reader_t *reader, ix_t *ix );
+
+/**
+ * tokenize the next "len" bytes of a FASTA file. A file may be fed in chunks
+ * of any size, split anywhere, and the events of each are handed to the sink
+ * of "reader" if it has one. Line breaks, headers and 'N' runs are found
+ * with vector compares where available, and the spans in between are
+ * translated to bases in one pass. Illegal characters are reported as they
+ * are found.
+ *
+ * @args:
+ *      reader - the reader to feed
+ *      buf - the next bytes of the file
+ *      len - number of bytes in "buf"
+ */
+void tokenize_fasta( fasta_reader_t *reader, const char *buf, size_t len );
+
+/**
+ * end the file fed to "reader" and hand over the events read.
+ *
+ * @args:
+ *      reader - the reader to finish
+ * @return:
+ *      the events of the file, to be free'd with "destroy_ref_seq"
+ */
+ref_seq_t *finish_fasta_reader( fasta_reader_t *reader );
+
+/**
+ * tokenize a whole FASTA file, mapped into memory rather than read. Files
+ * starting with the gzip magic are inflated as they are tokenized; BGZF
+ * files have their blocks inflated ahead of the tokenizer on helper threads.
+ *
+ * @args:
+ *      filename - the FASTA file to read, plain or gzip'd
+ *      ix - index to add each description string to, or NULL to drop them
+ *      n_threads - number of helper threads inflating BGZF blocks
+ * @return:
+ *      the events of the file, to be free'd with "destroy_ref_seq"
+ *      NULL if the file could not be read
+ */
+ref_seq_t *read_fasta( char *filename, ix_t *ix, int n_threads );
+
+/**
+ * tokenize a whole FASTA file as "read_fasta" does, but hand its events to
+ * "sink" a chunk at a time as they are read instead of holding them all.
+ * Description strings are added to "ix" before the events that follow them
+ * are handed over.
+ *
+ * @args:
+ *      filename - the FASTA file to read, plain or gzip'd
+ *      ix - index to add each description string to, or NULL to drop them
+ *      n_threads - number of helper threads inflating BGZF blocks
+ *      sink - called with each chunk of events, which are dropped after
+ *      ctx - passed on to "sink"
+ * @return:
+ *      0 on success, 1 if the file could not be read
+ */
+int stream_fasta( char *filename, ix_t *ix, int n_threads,
+                  ref_sink_t sink, void *ctx );
+
+/**
+ * free "ref" and its events.
+ *
+ * @args:
+ *      ref - the reference events to be free'd
+ */
+void destroy_ref_seq( ref_seq_t *ref );
+
+#endif
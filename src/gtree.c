@@ -10,118 +10,829 @@
 #include <string.h>
 #include <limits.h>
 
-gtree_t *init_gtree_node() { 
-    gtree_t *node = malloc(sizeof(gtree_t));
-    node->too_full  = 0;
-    node->n_matches = 0;
+node_arena_t *init_node_arena() {
+    node_arena_t *arena = malloc(sizeof(node_arena_t));
+    // slab tables never move, so that arenas sharing them may run in parallel
+    arena->slabs = malloc(sizeof(gtree_t *) * NODE_ARENA_MAX_SLABS);
+    arena->n_slabs = 0;
+    arena->cur_slab = 0;
+    arena->slab_used = NODE_ARENA_SLAB_SIZE;  // forces a slab on first alloc
+    arena->free_nodes = NULL_NODE;
+    arena->n_bytes = 0;
+
+    arena->loc_slabs = malloc(sizeof(loc_t *) * LOC_ARENA_MAX_SLABS);
+    arena->n_loc_slabs = 0;
+    arena->cur_loc_slab = 0;
+    arena->loc_slab_used = LOC_ARENA_SLAB_SIZE;
+    int i;
+    for (i = 0; i < LOC_RUN_CLASSES; i++) {
+        arena->free_locs[i] = NULL_LOC;
+    }
+
+    arena->owner = NULL;
+    pthread_mutex_init(&arena->lock, NULL);
+    arena->n_mapped_slabs = 0;
+    arena->n_mapped_loc_slabs = 0;
+    arena->fault = NULL;
+    arena->fault_ctx = NULL;
+    return arena;
+}
+
+node_arena_t *share_node_arena( node_arena_t *owner ) {
+    node_arena_t *arena = malloc(sizeof(node_arena_t));
+    *arena = *owner;
+    arena->owner = owner;
+    arena->slab_used = NODE_ARENA_SLAB_SIZE;
+    arena->free_nodes = NULL_NODE;
+    arena->n_bytes = 0;
+    arena->loc_slab_used = LOC_ARENA_SLAB_SIZE;
+    int i;
+    for (i = 0; i < LOC_RUN_CLASSES; i++) {
+        arena->free_locs[i] = NULL_LOC;
+    }
+    return arena;
+}
+
+void _release_gtree_slot( node_arena_t *arena, node_id_t id ) {
+    GTREE_NODE(arena, id)->next[0] = arena->free_nodes;
+    arena->free_nodes = id;
+    arena->n_bytes -= sizeof(gtree_t);
+}
+
+/**
+ * hand what is left of the current slab of nodes to the free list. Those
+ * slots were never handed out, so they do not count as released.
+ */
+void _release_slab_tail( node_arena_t *arena ) {
+    while (arena->slab_used < NODE_ARENA_SLAB_SIZE) {
+        _release_gtree_slot(arena,
+                (arena->cur_slab << NODE_ARENA_SLAB_BITS) | arena->slab_used);
+        arena->slab_used++;
+        arena->n_bytes += sizeof(gtree_t);
+    }
+}
+
+/**
+ * hand the nodes and loc runs released to the shared "arena" back to its
+ * owner, along with what is left of its current slab of nodes.
+ */
+void _return_to_owner( node_arena_t *arena ) {
+    node_arena_t *owner = arena->owner;
+
+    _release_slab_tail(arena);
+
+    pthread_mutex_lock(&owner->lock);
+    if (arena->free_nodes != NULL_NODE) {
+        node_id_t last = arena->free_nodes;
+        while (GTREE_NODE(arena, last)->next[0] != NULL_NODE) {
+            last = GTREE_NODE(arena, last)->next[0];
+        }
+        GTREE_NODE(arena, last)->next[0] = owner->free_nodes;
+        owner->free_nodes = arena->free_nodes;
+    }
+    int i;
+    for (i = 0; i < LOC_RUN_CLASSES; i++) {
+        if (arena->free_locs[i] == NULL_LOC) {
+            continue;
+        }
+        loc_id_t last = arena->free_locs[i];
+        while (GTREE_LOC(arena, last)->desc != NULL_LOC) {
+            last = GTREE_LOC(arena, last)->desc;
+        }
+        GTREE_LOC(arena, last)->desc = owner->free_locs[i];
+        owner->free_locs[i] = arena->free_locs[i];
+    }
+    pthread_mutex_unlock(&owner->lock);
+}
+
+void destroy_node_arena( node_arena_t *arena ) {
+    if (arena->owner != NULL) {
+        // slabs belong to the owner, and so does whatever was released
+        _return_to_owner(arena);
+        free(arena);
+        return;
+    }
+
+    int i;
+    for (i = arena->n_mapped_slabs; i < arena->n_slabs; i++) {
+        free(arena->slabs[i]);
+    }
+    free(arena->slabs);
+    for (i = arena->n_mapped_loc_slabs; i < arena->n_loc_slabs; i++) {
+        free(arena->loc_slabs[i]);
+    }
+    free(arena->loc_slabs);
+    pthread_mutex_destroy(&arena->lock);
+    free(arena);
+}
+
+/**
+ * take a fresh slab of nodes, or of locs if "locs" is set, from the arena
+ * that owns the slab tables and make it the current one of "arena".
+ */
+void _take_slab( node_arena_t *arena, int locs ) {
+    node_arena_t *owner = arena->owner != NULL ? arena->owner : arena;
+
+    pthread_mutex_lock(&owner->lock);
+    unsigned int slab;
+    if (locs) {
+        if (owner->n_loc_slabs == LOC_ARENA_MAX_SLABS) {
+            printf("ERROR: node arena ran out of loc ids\n");
+            exit(EXIT_FAILURE);
+        }
+        slab = owner->n_loc_slabs;
+        owner->loc_slabs[slab] = malloc(sizeof(loc_t) * LOC_ARENA_SLAB_SIZE);
+        owner->n_loc_slabs++;
+    }
+    else {
+        if (owner->n_slabs == NODE_ARENA_MAX_SLABS) {
+            printf("ERROR: node arena ran out of node ids\n");
+            exit(EXIT_FAILURE);
+        }
+        slab = owner->n_slabs;
+        owner->slabs[slab] = malloc(sizeof(gtree_t) * NODE_ARENA_SLAB_SIZE);
+        owner->n_slabs++;
+    }
+    pthread_mutex_unlock(&owner->lock);
+
+    // slot 0 of the first slab is reserved for NULL_NODE and NULL_LOC
+    if (locs) {
+        arena->cur_loc_slab = slab;
+        arena->loc_slab_used = slab == 0 ? 1 : 0;
+    }
+    else {
+        arena->cur_slab = slab;
+        arena->slab_used = slab == 0 ? 1 : 0;
+    }
+}
+
+node_id_t init_gtree_block( node_arena_t *arena, int n_nodes ) {
+    node_id_t id;
+
+    arena->n_bytes += sizeof(gtree_t) * n_nodes;
+    if (arena->slab_used + n_nodes > NODE_ARENA_SLAB_SIZE) {
+        _release_slab_tail(arena);
+        _take_slab(arena, 0);
+    }
+    id = (arena->cur_slab << NODE_ARENA_SLAB_BITS) | arena->slab_used;
+    arena->slab_used += n_nodes;
+
+    return id;
+}
+
+void _clear_gtree_node( gtree_t *node ) {
+    node->info = 0;
+    node->locs = NULL_LOC;
     
     int i;
     for (i = 0; i < 4; i++) {
-        node->next[i] = NULL;
+        node->next[i] = NULL_NODE;
+    }
+}
+
+node_id_t init_gtree_node( node_arena_t *arena ) { 
+    node_id_t id;
+
+    if (arena->free_nodes != NULL_NODE) {
+        id = arena->free_nodes;
+        arena->free_nodes = GTREE_NODE(arena, id)->next[0];
+        arena->n_bytes += sizeof(gtree_t);
+    }
+    else {
+        id = init_gtree_block(arena, 1);
     }
 
-    return node;
+    _clear_gtree_node(GTREE_NODE(arena, id));
+    return id;
 }
 
-void destroy_gtree( gtree_t *node ) { 
-    gtree_t *prev[MAX_WINDOW_SIZE + 1];
-    int depth = 0;
+int _loc_run_class( int n_locs ) {
+    int cls = 0;
+    while ((1 << cls) < n_locs) {
+        cls++;
+    }
+    return cls;
+}
 
-    prev[0] = node;
+loc_id_t _init_loc_run_class( node_arena_t *arena, int cls ) {
+    loc_id_t id;
+    int size = 1 << cls;
 
-    while (depth >= 0) {
-        // check all children of the node.
-        int i;
-        int dirty = 0;
-        for (i = 0; i < 4; i++) {
-            if (prev[depth]->next[i] != NULL) {
-                prev[depth + 1] = prev[depth]->next[i];
-                prev[depth]->next[i] = NULL;
-                depth++;
-                dirty = 1;
-                break; 
+    arena->n_bytes += sizeof(loc_t) * size;
+    if (arena->free_locs[cls] != NULL_LOC) {
+        id = arena->free_locs[cls];
+        arena->free_locs[cls] = GTREE_LOC(arena, id)->desc;
+        return id;
+    }
+
+    // runs never straddle two slabs
+    if (arena->loc_slab_used + size > LOC_ARENA_SLAB_SIZE) {
+        _take_slab(arena, 1);
+    }
+    id = (arena->cur_loc_slab << LOC_ARENA_SLAB_BITS) | arena->loc_slab_used;
+    arena->loc_slab_used += size;
+
+    return id;
+}
+
+void _destroy_loc_run( node_arena_t *arena, loc_id_t id, int n_locs ) {
+    int cls = _loc_run_class(n_locs);
+    GTREE_LOC(arena, id)->desc = arena->free_locs[cls];
+    arena->free_locs[cls] = id;
+    arena->n_bytes -= sizeof(loc_t) << cls;
+}
+
+loc_id_t init_loc_run( node_arena_t *arena, int n_locs ) {
+    return _init_loc_run_class(arena, _loc_run_class(n_locs));
+}
+
+void visit_gtree_node( node_arena_t *arena, gtree_t *node,
+                       uint32_t desc, long pos ) {
+    int n_matches = GTREE_N_MATCHES(node);
+
+    if (n_matches < MAX_LOCS_PER_NODE) {
+        // grow the loc run whenever it is full, i.e. n_matches is 0 or a
+        // power of two
+        if ((n_matches & (n_matches - 1)) == 0) {
+            loc_id_t run = init_loc_run(arena, n_matches + 1);
+            if (n_matches > 0) {
+                memcpy(GTREE_LOC(arena, run), GTREE_LOC(arena, node->locs),
+                       sizeof(loc_t) * n_matches);
+                _destroy_loc_run(arena, node->locs, n_matches);
             }
+            node->locs = run;
         }
-        if (!dirty) {
-            // no children were found, so we may safely free this node
-            free(prev[depth]);
-            depth--;
+
+        loc_t *loc = GTREE_LOC(arena, node->locs + n_matches);
+        loc->desc = desc;
+        loc->pos = pos;
+        node->info++;
+    }
+    else if (! GTREE_TOO_FULL(node) && n_matches == MAX_LOCS_PER_NODE) {
+        node->info |= GTREE_TOO_FULL_FLAG;
+    } 
+}
+
+loc_id_t _dup_loc_run( node_arena_t *arena, loc_id_t run, int n_locs ) {
+    if (n_locs == 0) {
+        return NULL_LOC;
+    }
+    loc_id_t dup = init_loc_run(arena, n_locs);
+    memcpy(GTREE_LOC(arena, dup), GTREE_LOC(arena, run),
+           sizeof(loc_t) * n_locs);
+    return dup;
+}
+
+int _same_match_data( node_arena_t *arena, gtree_t *a, gtree_t *b ) {
+    if ((a->info & GTREE_DATA_MASK) != (b->info & GTREE_DATA_MASK)) {
+        return 0;
+    }
+    int n_matches = GTREE_N_MATCHES(a);
+    return n_matches == 0
+        || memcmp(GTREE_LOC(arena, a->locs), GTREE_LOC(arena, b->locs),
+                  sizeof(loc_t) * n_matches) == 0;
+}
+
+/**
+ * lay out "node" as a chain of "len" nodes with the given packed bases,
+ * followed by "child". A chain of one is stored as a plain node.
+ */
+void _set_path( gtree_t *node, int len, uint64_t bases, node_id_t child ) {
+    node->info &= GTREE_DATA_MASK | GTREE_SHARD_FLAG;
+    node->next[0] = node->next[1] = node->next[2] = node->next[3] = NULL_NODE;
+
+    if (len == 1) {
+        node->info |= GTREE_KIND_NODE4 << GTREE_KIND_SHIFT;
+        if (child != NULL_NODE) {
+            node->next[bases & 0x3] = child;
         }
+        return;
     }
+
+    node->info |= (GTREE_KIND_PATH << GTREE_KIND_SHIFT)
+                | (len << GTREE_PATH_LEN_SHIFT);
+    node->next[0] = child;
+    node->next[2] = bases & 0xFFFFFFFF;
+    node->next[3] = bases >> 32;
 }
 
-int _fewest_matches_in_subtree( gtree_t *node ) {
+node_id_t init_gtree_path( node_arena_t *arena, int len, uint64_t bases ) {
+    node_id_t id = init_gtree_node(arena);
+    _set_path(GTREE_NODE(arena, id), len, bases, NULL_NODE);
+    return id;
+}
 
-    int lowest = node->too_full ? INT_MAX : node->n_matches;
+/**
+ * replace the base leading out of the last node of a path of "len" bases
+ */
+uint64_t _with_last_base( uint64_t bases, int len, bp_t base ) {
+    int shift = 2 * (len - 1);
+    return (bases & ((1ULL << shift) - 1)) | ((uint64_t) base << shift);
+}
 
-    int i, candidate;
-    for (i = 0; i < 4; i++) {
-        if (node->next[i] != NULL) {
-            candidate = _fewest_matches_in_subtree(node->next[i]);
-            if (candidate < lowest) {
-                lowest = candidate;
-            }
+/**
+ * split path node "id" after its first "at" bases. The head keeps the id,
+ * so links into the path stay valid; the tail is returned.
+ */
+node_id_t _split_path( node_arena_t *arena, node_id_t id, int at ) {
+    gtree_t *path = GTREE_NODE(arena, id);
+    int len = GTREE_PATH_LEN(path);
+    uint64_t bases = GTREE_PATH_BASES(path);
+    node_id_t child = path->next[0];
+
+    node_id_t tail_id = init_gtree_node(arena);
+    gtree_t *tail = GTREE_NODE(arena, tail_id);
+    tail->info = path->info & GTREE_DATA_MASK;
+    tail->locs = _dup_loc_run(arena, path->locs, GTREE_N_MATCHES(path));
+
+    _set_path(tail, len - at, bases >> (2 * at), child);
+    _set_path(path, at, bases & ((1ULL << (2 * at)) - 1), tail_id);
+
+    return tail_id;
+}
+
+/**
+ * record the match pending on the path node under "cursor", splitting off
+ * the part of the path beyond the cursor which was not matched.
+ */
+void _settle_gtree_cursor( node_arena_t *arena, gtree_cursor_t *cursor,
+                           uint32_t desc, long pos ) {
+    if (!cursor->pending) {
+        return;
+    }
+    gtree_t *path = GTREE_NODE(arena, cursor->node);
+    if (cursor->off + 1 < GTREE_PATH_LEN(path)) {
+        _split_path(arena, cursor->node, cursor->off + 1);
+    }
+    visit_gtree_node(arena, path, desc, pos);
+    cursor->pending = 0;
+}
+
+void _enter_gtree_node( node_arena_t *arena, gtree_cursor_t *cursor,
+                        node_id_t id, uint32_t desc, long pos ) {
+    gtree_t *node = GTREE_NODE(arena, id);
+    if (GTREE_LAZY(node) || GTREE_SHARD(node)) {
+        // walk into a shard of a lazy index, read it in place if it is not
+        // yet
+        arena->fault(arena->fault_ctx, id);
+    }
+    cursor->node = id;
+    cursor->off = 0;
+    cursor->fresh = 0;
+    if (GTREE_KIND(node) == GTREE_KIND_PATH) {
+        cursor->pending = 1;
+    }
+    else {
+        visit_gtree_node(arena, node, desc, pos);
+    }
+}
+
+root_table_t *init_root_table( int k ) {
+    root_table_t *table = malloc(sizeof(root_table_t));
+    table->k = k;
+    table->nodes = NULL;
+    table->saturated = NULL;
+    if (k > 0) {
+        table->nodes = malloc(sizeof(node_id_t) * ROOT_TABLE_SIZE(k));
+        table->saturated = malloc((ROOT_TABLE_SIZE(k) + 7) / 8);
+    }
+    reset_root_table(table);
+    return table;
+}
+
+void reset_root_table( root_table_t *table ) {
+    if (table->k == 0) {
+        return;
+    }
+    memset(table->nodes, 0, sizeof(node_id_t) * ROOT_TABLE_SIZE(table->k));
+    memset(table->saturated, 0, (ROOT_TABLE_SIZE(table->k) + 7) / 8);
+}
+
+void reset_root_table_prefix( root_table_t *table, uint32_t prefix,
+                              int depth ) {
+    if (table->k == 0 || depth > table->k) {
+        return;
+    }
+    uint32_t kmer = prefix << (2 * (table->k - depth));
+    uint32_t end = kmer + (1U << (2 * (table->k - depth)));
+    for (; kmer < end; kmer++) {
+        table->nodes[kmer] = NULL_NODE;
+        table->saturated[kmer >> 3] &= ~(1 << (kmer & 0x7));
+    }
+}
+
+void destroy_root_table( root_table_t *table ) {
+    free(table->nodes);
+    free(table->saturated);
+    free(table);
+}
+
+void init_gtree_cursor( gtree_cursor_t *cursor, node_id_t node,
+                        root_table_t *table ) {
+    cursor->node = node;
+    cursor->off = 0;
+    cursor->pending = 0;
+    cursor->fresh = 0;
+    cursor->depth = 0;
+    cursor->prefix = 0;
+    cursor->root = node;
+    cursor->table = table != NULL && table->k > 0 ? table : NULL;
+    cursor->plain_depth = cursor->table != NULL ? table->k : 0;
+}
+
+int _step_gtree_cursor( node_arena_t *arena, gtree_cursor_t *cursor,
+                        bp_t base, uint32_t desc, long pos, int create ) {
+    gtree_t *node = GTREE_NODE(arena, cursor->node);
+
+    if (GTREE_KIND(node) == GTREE_KIND_PATH
+            && cursor->off + 1 < GTREE_PATH_LEN(node)) {
+        if (GTREE_PATH_BASE(node, cursor->off) == base) {
+            // still following the path
+            cursor->off++;
+            return 0;
+        }
+        // window branches off part way along the path, which leaves the
+        // cursor on the last base of what remains of it
+        _settle_gtree_cursor(arena, cursor, desc, pos);
+    }
+
+    if (GTREE_KIND(node) == GTREE_KIND_PATH) {
+        int len = GTREE_PATH_LEN(node);
+
+        if (cursor->fresh && create && len < MAX_PATH_LEN) {
+            // nothing but this window has been here, extend the path
+            _set_path(node, len + 1,
+                      _with_last_base(GTREE_PATH_BASES(node), len, base),
+                      NULL_NODE);
+            cursor->off++;
+            return 0;
+        }
+
+        node_id_t child = node->next[0];
+        bp_t child_base = GTREE_PATH_BASE(node, len - 1);
+
+        _settle_gtree_cursor(arena, cursor, desc, pos);
+
+        if (child != NULL_NODE && child_base == base) {
+            _enter_gtree_node(arena, cursor, child, desc, pos);
+            return 0;
+        }
+        if (!create) {
+            return 1;
+        }
+        if (child == NULL_NODE) {
+            node_id_t fresh = init_gtree_node(arena);
+            _set_path(node, len,
+                      _with_last_base(GTREE_PATH_BASES(node), len, base),
+                      fresh);
+            _enter_gtree_node(arena, cursor, fresh, desc, pos);
+            cursor->fresh = 1;
+            return 0;
         }
+
+        // the last node of the path needs a second child
+        cursor->node = _split_path(arena, cursor->node, len - 1);
+        cursor->off = 0;
+        node = GTREE_NODE(arena, cursor->node);
+    }
+    else if (cursor->fresh && create && cursor->depth > cursor->plain_depth) {
+        // turn the fresh node into a path of two, unless it is one of the
+        // plain nodes the root table points into
+        _set_path(node, 2, base, NULL_NODE);
+        cursor->off++;
+        return 0;
+    }
+
+    if (node->next[base] == NULL_NODE) {
+        if (!create) {
+            // should signal that no next base available in the tree.
+            return 1;
+        }
+        node->next[base] = init_gtree_node(arena);
+        _enter_gtree_node(arena, cursor, node->next[base], desc, pos);
+        cursor->fresh = 1;
+        return 0;
     }
 
-    return lowest;
+    _enter_gtree_node(arena, cursor, node->next[base], desc, pos);
+    return 0;
 }
 
-void prune_gtree( gtree_t *node ) {
+/**
+ * walk the "cursor->depth" bases held back in "cursor->prefix" down from the
+ * root. Nodes this close to the root are never path nodes, so every match is
+ * recorded as it is walked. A walk of the full k bases is entered into the
+ * root table.
+ */
+int _replay_gtree_cursor( node_arena_t *arena, gtree_cursor_t *cursor,
+                          uint32_t desc, long pos, int create ) {
+    root_table_t *table = cursor->table;
+    int i, n_bases = cursor->depth;
+    int saturated = 1;
 
-    int i, n_children = 0;
-    gtree_t *children[4];
-    int nextpos[4];
+    cursor->node = cursor->root;
+    cursor->depth = 0;
+    for (i = n_bases - 1; i >= 0; i--) {
+        bp_t base = (cursor->prefix >> (2 * i)) & 0x3;
+        if (_step_gtree_cursor(arena, cursor, base, desc, pos, create)) {
+            return 1;
+        }
+        cursor->depth++;
+        saturated = saturated && GTREE_TOO_FULL(GTREE_NODE(arena, cursor->node));
+    }
 
+    if (n_bases == table->k) {
+        table->nodes[cursor->prefix] = cursor->node;
+        if (saturated) {
+            ROOT_TABLE_SET_SATURATED(table, cursor->prefix);
+        }
+    }
+    return 0;
+}
+
+int step_gtree_cursor( node_arena_t *arena, gtree_cursor_t *cursor,
+                       bp_t base, uint32_t desc, long pos, int create ) {
+    root_table_t *table = cursor->table;
+
+    if (table != NULL && cursor->depth < table->k) {
+        // hold back the first k bases of the window until they can be
+        // looked up together
+        cursor->prefix = (cursor->prefix << 2) | base;
+        cursor->depth++;
+        if (cursor->depth < table->k) {
+            return 0;
+        }
+        if (ROOT_TABLE_SATURATED(table, cursor->prefix)
+                && arena->fault == NULL) {
+            // matches on too_full nodes are no-ops, skip straight past them.
+            // Walks of a lazy index do not, so that the shard they lead
+            // into is seen to be in use.
+            cursor->node = table->nodes[cursor->prefix];
+            return 0;
+        }
+        return _replay_gtree_cursor(arena, cursor, desc, pos, create);
+    }
+
+    if (_step_gtree_cursor(arena, cursor, base, desc, pos, create)) {
+        return 1;
+    }
+    cursor->depth++;
+    return 0;
+}
+
+int finish_gtree_cursor( node_arena_t *arena, gtree_cursor_t *cursor,
+                         uint32_t desc, long pos, int create ) {
+    if (cursor->table != NULL && cursor->depth < cursor->table->k
+            && cursor->depth > 0) {
+        if (_replay_gtree_cursor(arena, cursor, desc, pos, create)) {
+            return 1;
+        }
+    }
+    _settle_gtree_cursor(arena, cursor, desc, pos);
+    cursor->fresh = 0;
+    return 0;
+}
+
+void _destroy_gtree_node( node_arena_t *arena, node_id_t id ) {
+    gtree_t *node = GTREE_NODE(arena, id);
+    if (GTREE_N_MATCHES(node) > 0) {
+        _destroy_loc_run(arena, node->locs, GTREE_N_MATCHES(node));
+    }
+    _release_gtree_slot(arena, id);
+}
+
+void compress_gtree_node( node_arena_t *arena, node_id_t id ) {
+    gtree_t *node = GTREE_NODE(arena, id);
+    if (GTREE_KIND(node) != GTREE_KIND_NODE4) {
+        return;
+    }
+
+    int i, n_children = 0;
+    bp_t base = A;
     for (i = 0; i < 4; i++) {
-        if (node->next[i] != NULL) {
-            children[n_children] = node->next[i];
-            nextpos[n_children] = i;
+        if (node->next[i] != NULL_NODE) {
+            base = i;
             n_children++;
         }
     }
+    if (n_children != 1) {
+        return;
+    }
+
+    node_id_t child_id = node->next[base];
+    gtree_t *child = GTREE_NODE(arena, child_id);
+    if (!_same_match_data(arena, node, child)) {
+        return;
+    }
+
+    int len;
+    uint64_t bases;
+    node_id_t grandchild = NULL_NODE;
+    if (GTREE_KIND(child) == GTREE_KIND_PATH) {
+        len = GTREE_PATH_LEN(child);
+        if (len + 1 > MAX_PATH_LEN) {
+            return;
+        }
+        bases = GTREE_PATH_BASES(child);
+        grandchild = child->next[0];
+    }
+    else {
+        len = 1;
+        bases = A;
+        for (i = 0; i < 4; i++) {
+            if (child->next[i] != NULL_NODE) {
+                if (grandchild != NULL_NODE) {
+                    return;     // child branches, nothing to fold
+                }
+                grandchild = child->next[i];
+                bases = i;
+            }
+        }
+    }
+
+    _set_path(node, len + 1, base | (bases << 2), grandchild);
+    _destroy_gtree_node(arena, child_id);
+}
+
+void destroy_gtree( node_arena_t *arena, node_id_t id ) {
+    // the stack grows as needed, an index read from a file may be deeper
+    // than any window
+    int cap = MAX_WINDOW_SIZE + 1;
+    gtree_frame_t *stack = malloc(sizeof(gtree_frame_t) * cap);
+    int top = 0;
+
+    stack[0].id = id;
+    stack[0].next = 0;
+
+    while (top >= 0) {
+        // check all children of the node, a path node only has next[0]
+        gtree_frame_t *frame = &stack[top];
+        gtree_t *node = GTREE_NODE(arena, frame->id);
+        int n_next = GTREE_KIND(node) == GTREE_KIND_PATH ? 1 : 4;
+        while (frame->next < n_next && node->next[frame->next] == NULL_NODE) {
+            frame->next++;
+        }
+        if (frame->next < n_next) {
+            node_id_t child = node->next[frame->next++];
+            if (++top == cap) {
+                cap *= 2;
+                stack = realloc(stack, sizeof(gtree_frame_t) * cap);
+            }
+            stack[top].id = child;
+            stack[top].next = 0;
+            continue;
+        }
+
+        // no children are left, so we may hand this node back
+        _destroy_gtree_node(arena, frame->id);
+        top--;
+    }
+    free(stack);
+}
 
-    if (n_children == 0) {
-        // nothing to be done
+/**
+ * prune the children of "id", whose own subtrees are already pruned. "below"
+ * is the fewest matches of any node that is not too_full below "id", as it
+ * was before pruning, INT_MAX if there is none.
+ */
+void _prune_gtree_node( node_arena_t *arena, node_id_t id, int below ) {
+    gtree_t *node = GTREE_NODE(arena, id);
+
+    if (GTREE_TOO_FULL(node)) {
         return;
     }
-    else if (n_children > 1) {
-        // recursively prune
-        for (i = 0; i < n_children; i++) {
-            prune_gtree(children[i]);
+
+    if (GTREE_KIND(node) == GTREE_KIND_PATH) {
+        // every node along the path has one child with matching n_matches, so
+        // the whole tail goes as soon as nothing below has fewer matches.
+        if (below >= GTREE_N_MATCHES(node)) {
+            node_id_t child = node->next[0];
+            node->next[0] = NULL_NODE;
+            _set_path(node, 1, A, NULL_NODE);
+            if (child != NULL_NODE) {
+                destroy_gtree(arena, child);
+            }
         }
         return;
     }
-    // else 1 child
-    if (node->too_full) {
-        prune_gtree(children[0]);
+
+    int i, n_children = 0;
+    int nextpos = 0;
+    for (i = 0; i < 4; i++) {
+        if (node->next[i] != NULL_NODE) {
+            nextpos = i;
+            n_children++;
+        }
+    }
+    if (n_children != 1) {
         return;
     }
 
-    // check if number of matches equal
-    if (node->n_matches == children[0]->n_matches) {
-        if (children[0]->n_matches == _fewest_matches_in_subtree(children[0])) {
-            // then we may prune the child
-            node->next[nextpos[0]] = NULL;
-            destroy_gtree(children[0]);
-            return;
+    // a single child with as many matches as the node, and no fewer below,
+    // carries no additional information
+    node_id_t child = node->next[nextpos];
+    int child_matches = GTREE_N_MATCHES(GTREE_NODE(arena, child));
+    if (GTREE_N_MATCHES(node) == child_matches && child_matches == below) {
+        node->next[nextpos] = NULL_NODE;
+        destroy_gtree(arena, child);
+    }
+}
+
+int prune_gtree_above( node_arena_t *arena, node_id_t id, int depth,
+                       const int *fewest ) {
+    // a single post-order pass, pruning below each node once its subtrees
+    // are done. Pruning never changes the fewest matches below a node that
+    // survives it, so deciding bottom-up prunes the same nodes as deciding
+    // from the top. The stack grows as needed, an index read from a file may
+    // be deeper than any window.
+    int cap = MAX_WINDOW_SIZE + 1;
+    gtree_frame_t *stack = malloc(sizeof(gtree_frame_t) * cap);
+    int top = 0;
+    int result = INT_MAX;
+
+    stack[0].id = id;
+    stack[0].next = 0;
+    stack[0].below = INT_MAX;
+
+    while (top >= 0) {
+        gtree_frame_t *frame = &stack[top];
+        gtree_t *node = GTREE_NODE(arena, frame->id);
+        int n_next = GTREE_KIND(node) == GTREE_KIND_PATH ? 1 : 4;
+        int lowest;
+
+        if (top == depth) {
+            // pruned already, take the fewest matches it had
+            lowest = *fewest++;
         }
+        else {
+            while (frame->next < n_next
+                    && node->next[frame->next] == NULL_NODE) {
+                frame->next++;
+            }
+            if (frame->next < n_next) {
+                node_id_t child = node->next[frame->next++];
+                if (++top == cap) {
+                    cap *= 2;
+                    stack = realloc(stack, sizeof(gtree_frame_t) * cap);
+                }
+                stack[top].id = child;
+                stack[top].next = 0;
+                stack[top].below = INT_MAX;
+                continue;
+            }
+
+            lowest = GTREE_TOO_FULL(node) ? INT_MAX : GTREE_N_MATCHES(node);
+            if (frame->below < lowest) {
+                lowest = frame->below;
+            }
+            _prune_gtree_node(arena, frame->id, frame->below);
+        }
+
+        top--;
+        if (top < 0) {
+            result = lowest;
+        }
+        else if (lowest < stack[top].below) {
+            stack[top].below = lowest;
+        }
+    }
+    free(stack);
+    return result;
+}
+
+void prune_gtree( node_arena_t *arena, node_id_t id ) {
+    prune_gtree_above(arena, id, -1, NULL);
+}
+
+void count_gtree_kinds( node_arena_t *arena, node_id_t id, long *counts ) {
+    if (id == NULL_NODE) {
+        return;
     }
 
-    prune_gtree(children[0]);
+    gtree_t *node = GTREE_NODE(arena, id);
+    counts[GTREE_KIND(node)]++;
 
-    return;
+    int i;
+    int n_next = GTREE_KIND(node) == GTREE_KIND_PATH ? 1 : 4;
+    for (i = 0; i < n_next; i++) {
+        count_gtree_kinds(arena, node->next[i], counts);
+    }
 }
 
-long count_gtree_nodes( gtree_t *node ) {
-    if (node == NULL) {
+long count_gtree_nodes( node_arena_t *arena, node_id_t id ) {
+    if (id == NULL_NODE) {
         return 0;
     }
 
+    gtree_t *node = GTREE_NODE(arena, id);
+    if (GTREE_KIND(node) == GTREE_KIND_PATH) {
+        return GTREE_PATH_LEN(node) + count_gtree_nodes(arena, node->next[0]);
+    }
+
     long sum = 1;
     int i;
     for (i = 0; i < 4; i++) {
-        sum += count_gtree_nodes(node->next[i]);
+        sum += count_gtree_nodes(arena, node->next[i]);
     }
     return sum;
 }
@@ -9,28 +9,309 @@
 #include "types.h"
 #include "consts.h"
 
+// layout of the packed "info" word of a gtree node
+#define GTREE_N_MATCHES_MASK 0x7F     // number of matches (is_match if >0)
+#define GTREE_TOO_FULL_FLAG  0x80     // flag to ignore intermediate matching
+#define GTREE_DATA_MASK      0xFF     // all match data of a node
+#define GTREE_KIND_SHIFT     8        // kind of node, see below
+#define GTREE_KIND_MASK      (0x3 << GTREE_KIND_SHIFT)
+#define GTREE_PATH_LEN_SHIFT 10       // number of bases in a path node
+#define GTREE_PATH_LEN_MASK  (0x3F << GTREE_PATH_LEN_SHIFT)
+#define GTREE_SATURATED_FLAG (1 << 16) // whole subtree is too_full, see below
+#define GTREE_LAZY_FLAG      (1 << 17) // subtree not read in yet, see below
+#define GTREE_SHARD_FLAG     (1 << 18) // root of a subtree read in lazily
+
+#define GTREE_N_MATCHES(node) ((node)->info & GTREE_N_MATCHES_MASK)
+#define GTREE_TOO_FULL(node)  (((node)->info & GTREE_TOO_FULL_FLAG) != 0)
+
+/**
+ * a node is marked saturated once it and every node below it are too_full,
+ * so that no window can record a match anywhere in its subtree. The mark is
+ * only set while masking, which never adds nodes, and is not serialized.
+ */
+#define GTREE_SATURATED(node) (((node)->info & GTREE_SATURATED_FLAG) != 0)
+
+/**
+ * a lazy node stands in for a subtree of a sharded index that is still on
+ * disk, and carries nothing but the number of its shard in "locs". The
+ * cursor hands it to the "fault" of its arena as soon as it enters it,
+ * which reads the subtree in its place.
+ *
+ * The root of a subtree once read in is marked as a shard, and handed to
+ * the "fault" on every walk into it, so that the subtrees walked least
+ * recently can be told apart. Neither mark is serialized.
+ */
+#define GTREE_LAZY(node) (((node)->info & GTREE_LAZY_FLAG) != 0)
+#define GTREE_SHARD(node) (((node)->info & GTREE_SHARD_FLAG) != 0)
+#define GTREE_KIND(node) \
+    (((node)->info & GTREE_KIND_MASK) >> GTREE_KIND_SHIFT)
+
+/**
+ * node kinds:
+ *
+ * GTREE_KIND_NODE4 - a single trie node, next[] holds one child per base.
+ *
+ * GTREE_KIND_PATH  - a chain of GTREE_PATH_LEN single-child trie nodes that
+ *                    all carry identical match data, stored as one node.
+ *                    The base leading from the i'th node of the chain to the
+ *                    next is packed 2 bits per base into next[2..3], the
+ *                    last of which leads to the single child in next[0].
+ */
+#define GTREE_KIND_NODE4  0
+#define GTREE_KIND_PATH   1
+#define GTREE_N_KINDS     2
+
+#define GTREE_PATH_LEN(node) \
+    (((node)->info & GTREE_PATH_LEN_MASK) >> GTREE_PATH_LEN_SHIFT)
+#define GTREE_PATH_BASES(node) \
+    (((uint64_t) (node)->next[3] << 32) | (node)->next[2])
+#define GTREE_PATH_BASE(node, i) \
+    ((bp_t) ((GTREE_PATH_BASES(node) >> (2 * (i))) & 0x3))
+
+/**
+ * resolve a node id handed out by "arena" to the node itself. Node pointers
+ * stay valid for the life of the arena, as slabs are never moved.
+ */
+#define GTREE_NODE(arena, id) \
+    ((arena)->slabs[(id) >> NODE_ARENA_SLAB_BITS] \
+        + ((id) & (NODE_ARENA_SLAB_SIZE - 1)))
+
+/**
+ * resolve a loc id handed out by "arena" to the loc itself. The locs of a
+ * node are the "n_matches" consecutive entries starting at node->locs.
+ */
+#define GTREE_LOC(arena, id) \
+    ((arena)->loc_slabs[(id) >> LOC_ARENA_SLAB_BITS] \
+        + ((id) & (LOC_ARENA_SLAB_SIZE - 1)))
+
+/**
+ * number of entries in a root table covering "k" bases, and access to the
+ * bit marking an entry as saturated.
+ */
+#define ROOT_TABLE_SIZE(k) (1UL << (2 * (k)))
+#define ROOT_TABLE_SATURATED(table, kmer) \
+    (((table)->saturated[(kmer) >> 3] >> ((kmer) & 0x7)) & 0x1)
+#define ROOT_TABLE_SET_SATURATED(table, kmer) \
+    ((table)->saturated[(kmer) >> 3] |= 1 << ((kmer) & 0x7))
+
+/**
+ * malloc's a new, empty node arena. Nodes are carved out of fixed-size slabs
+ * in allocation order, so a tree built front to back is laid out roughly in
+ * the order it will be walked. Locs live out-of-line in a separate set of
+ * slabs, in runs sized to the number of matches at each node.
+ *
+ * @return:
+ *      a pointer to a newly initialized node arena
+ */
+node_arena_t *init_node_arena();
+
+/**
+ * malloc's an arena that hands out nodes and locs from slabs it takes from
+ * "owner", so that one thread per arena may grow the same gtree. Ids from
+ * either arena resolve through both, and the slabs stay with "owner".
+ *
+ * @args:
+ *      owner - the arena to share slabs with, made by init_node_arena
+ * @return:
+ *      a pointer to a newly initialized node arena
+ */
+node_arena_t *share_node_arena( node_arena_t *owner );
+
+/**
+ * release every slab held by "arena" in one pass. All nodes handed out by
+ * the arena are invalid afterwards; no per-node tree walk is needed. Slabs
+ * that lie in a mapped index file are left to its owner to unmap. An arena
+ * made by share_node_arena only releases itself, and hands the nodes and
+ * locs it freed back to its owner. No other thread may use the owner then.
+ *
+ * @args:
+ *      arena - the node arena to be free'd
+ */
+void destroy_node_arena( node_arena_t *arena );
+
+/**
+ * takes a new gtree node from "arena" and initializes its "next" array to
+ * all NULL_NODE, with no matches and no locs. Released nodes are reused
+ * before the current slab is advanced.
+ *
+ * @args:
+ *      arena - the node arena to allocate from
+ * @return:
+ *      the id of a newly initialized gtree node
+ */
+node_id_t init_gtree_node( node_arena_t *arena );
 
 /**
- * malloc's a new gtree node and initializes its "next" array to all null
- * pointers. the "locs" array is left as garbage uninitialized values.
+ * takes a new gtree node from "arena" laid out as a path of "len" nodes
+ * without a child, in the manner of init_gtree_node.
  *
+ * @args:
+ *      arena - the node arena to allocate from
+ *      len - number of nodes in the path, at most MAX_PATH_LEN
+ *      bases - bases leading from each node of the path to the next, 2 bits
+ *              per base, first lowest
+ * @return:
+ *      the id of a newly initialized gtree node
+ */
+node_id_t init_gtree_path( node_arena_t *arena, int len, uint64_t bases );
+
+/**
+ * takes "n_nodes" consecutive node ids from "arena", left uninitialized,
+ * always from fresh slab space.
+ *
+ * @args:
+ *      arena - the node arena to allocate from
+ *      n_nodes - number of nodes in the block, at most NODE_ARENA_SLAB_SIZE
  * @return:
- *      a pointer to a newly initialized gtree node
+ *      the id of the first node in the block
  */
-gtree_t *init_gtree_node();
+node_id_t init_gtree_block( node_arena_t *arena, int n_nodes );
 
 /**
- * destroy the gtree rooted at "node" by free'ing all nodes. Note this will
- * not free any memory allocated for strings in "locs". These strings must
- * be managed separately.
+ * takes a run of locs from "arena" with room for at least "n_locs" entries.
+ * Runs come in power-of-two sizes so that a node can grow its run in place
+ * of a fixed MAX_LOCS_PER_NODE reservation.
  *
  * @args:
- *      node - a pointer to the root node of the gtree to be free'd
+ *      arena - the node arena to allocate from
+ *      n_locs - number of locs the run must hold, at least 1
+ * @return:
+ *      the loc id of the first entry in the run
+ */
+loc_id_t init_loc_run( node_arena_t *arena, int n_locs );
+
+/**
+ * record a match at "node" for the sequence "desc" at "pos". The first
+ * MAX_LOCS_PER_NODE matches are stored as locs; the match after that marks
+ * the node as too_full, and any later match is a no-op.
+ *
+ * @args:
+ *      arena - the node arena that "node" was allocated from
+ *      node - the node that was matched
+ *      desc - descriptor id of the matching sequence, or LOC_NO_DESC
+ *      pos - the position of the match in sequence "desc", at most
+ *            LOC_MAX_POS, which "read_fasta" holds sequences indexed to
+ */
+void visit_gtree_node( node_arena_t *arena, gtree_t *node,
+                       uint32_t desc, long pos );
+
+/**
+ * malloc's an empty root table indexing the nodes "k" bases below the root
+ * of a gtree by the k-mer leading to them, 2 bits per base. Entries are
+ * filled in by cursors as windows walk past depth k. An entry is marked
+ * saturated once every node on the way down to it is too_full, at which
+ * point a window may skip straight to it. Nodes within k bases of the root
+ * are always kept as plain nodes so that entries stay valid.
+ *
+ * @args:
+ *      k - number of leading bases to index, 0 for an unused table
+ * @return:
+ *      a pointer to a newly initialized root table
+ */
+root_table_t *init_root_table( int k );
+
+/**
+ * forget every entry of "table". Must be called whenever nodes within k bases
+ * of the root may have been released, e.g. by prune_gtree.
+ *
+ * @args:
+ *      table - the root table to clear
+ */
+void reset_root_table( root_table_t *table );
+
+/**
+ * forget the entries of "table" for every k-mer that starts with the
+ * "depth" bases of "prefix", as when the subtree they lead into is
+ * released. Entries less than k bases down are not affected.
+ *
+ * @args:
+ *      table - the root table to clear entries of
+ *      prefix - leading bases of the k-mers to forget, 2 bits per base
+ *      depth - number of bases in "prefix"
+ */
+void reset_root_table_prefix( root_table_t *table, uint32_t prefix,
+                              int depth );
+
+/**
+ * free "table" and its entries. The nodes it points to are left alone.
+ *
+ * @args:
+ *      table - the root table to be free'd
+ */
+void destroy_root_table( root_table_t *table );
+
+/**
+ * place "cursor" at "node", ready to walk a new window down from it.
+ *
+ * @args:
+ *      cursor - the cursor to reset
+ *      node - the id of the node to start from, usually the root
+ *      table - root table for the gtree rooted at "node", or NULL
+ */
+void init_gtree_cursor( gtree_cursor_t *cursor, node_id_t node,
+                        root_table_t *table );
+
+/**
+ * advance "cursor" by one base and record a match at the node it moves to,
+ * in the manner of visit_gtree_node. Matches along path nodes are recorded
+ * once the cursor leaves the path or the window is finished, splitting the
+ * path wherever the window stops or branches off part way along it.
+ *
+ * With a root table, the first k bases of a window are held back and walked
+ * together once the k'th arrives, so a dead end among them is only reported
+ * then, or by finish_gtree_cursor for shorter windows.
+ *
+ * @args:
+ *      arena - the node arena that the gtree was allocated from
+ *      cursor - the position of the current window in the gtree
+ *      base - the next base of the window
+ *      desc - descriptor id of the sequence being walked, or LOC_NO_DESC
+ *      pos - the position of the window in sequence "desc"
+ *      create - if non-zero, grow the gtree when "base" leads nowhere
  * @return:
  *      0        on success
- *      errcode  otherwise
+ *      1        if "base" leads nowhere and "create" was not set
  */
-void destroy_gtree( gtree_t *node );
+int step_gtree_cursor( node_arena_t *arena, gtree_cursor_t *cursor,
+                       bp_t base, uint32_t desc, long pos, int create );
+
+/**
+ * record any match still pending for the window walked by "cursor". Must be
+ * called whenever a window is finished, before the cursor is reused.
+ *
+ * @args:
+ *      arena - the node arena that the gtree was allocated from
+ *      cursor - the position of the finished window in the gtree
+ *      desc - descriptor id of the sequence being walked, or LOC_NO_DESC
+ *      pos - the position of the window in sequence "desc"
+ *      create - if non-zero, grow the gtree for bases still held back
+ * @return:
+ *      0        on success
+ *      1        if a base held back leads nowhere and "create" was not set
+ */
+int finish_gtree_cursor( node_arena_t *arena, gtree_cursor_t *cursor,
+                         uint32_t desc, long pos, int create );
+
+/**
+ * fold the single child of "node" into it as a path node, if the child
+ * carries exactly the same match data. Used to compress chains when a gtree
+ * is assembled bottom up, e.g. on deserialization.
+ *
+ * @args:
+ *      arena - the node arena that "node" was allocated from
+ *      node - the id of the node to compress, with its subtree complete
+ */
+void compress_gtree_node( node_arena_t *arena, node_id_t node );
+
+/**
+ * destroy the gtree rooted at "node" by returning all nodes and their loc
+ * runs to the free lists of "arena".
+ *
+ * @args:
+ *      arena - the node arena that "node" was allocated from
+ *      node - the id of the root node of the gtree to be free'd
+ */
+void destroy_gtree( node_arena_t *arena, node_id_t node );
 
 /**
  * prunes the gtree of extraneous nodes. That is:
@@ -39,17 +320,50 @@ void destroy_gtree( gtree_t *node );
  * as the parent, then no additional information is carried in that child
  * node and it can be pruned from the gtree.
  *
+ * Runs in a single pass over the nodes, without recursion.
+ *
+ * @args:
+ *      arena - the node arena that pruned nodes are released to
+ *      node - the id of a node from which to prune all subtrees.
+ */
+void prune_gtree ( node_arena_t *arena, node_id_t node );
+
+/**
+ * prunes the gtree of "node" as prune_gtree does, except for the subtrees of
+ * the nodes "depth" levels down, which must already have been pruned. This
+ * lets disjoint subtrees be pruned by separate threads first.
+ *
+ * @args:
+ *      arena - the node arena that pruned nodes are released to
+ *      node - the id of a node from which to prune all subtrees
+ *      depth - number of levels down to the pruned subtrees, -1 for none
+ *      fewest - for each pruned subtree in pre-order, the value returned
+ *               when it was pruned
+ * @return:
+ *      the fewest matches of any node that is not too_full in the gtree of
+ *      "node", as before it was pruned, or INT_MAX if there is none
+ */
+int prune_gtree_above( node_arena_t *arena, node_id_t node, int depth,
+                       const int *fewest );
+
+/**
+ * recursively count the nodes of each kind in a gtree, as stored.
+ *
  * @args:
- *      node - a pointer to a node from which to prune all subtrees.
+ *      arena - the node arena that "node" was allocated from
+ *      node - the id of a node from which to count
+ *      counts - GTREE_N_KINDS counters, indexed by kind, to add to
  */
-void prune_gtree ( gtree_t *node );
+void count_gtree_kinds( node_arena_t *arena, node_id_t node, long *counts );
 
 /**
- * recursively count the numer of nodes in a gtree
+ * recursively count the numer of nodes in a gtree. Each base of a path node
+ * counts as a node of its own.
  *
  * @args:
- *      node - a pointer to a node from which to count
+ *      arena - the node arena that "node" was allocated from
+ *      node - the id of a node from which to count
  */
-long count_gtree_nodes( gtree_t *node );
+long count_gtree_nodes( node_arena_t *arena, node_id_t node );
 
 #endif
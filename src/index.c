@@ -8,18 +8,50 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
 
-ix_t *init_ix() {
+ix_t *init_ix( int root_k ) {
     ix_t *ix = malloc(sizeof(ix_t));
-    ix->root = init_gtree_node();
-    ix->root->too_full = 1;
+    ix->arena = init_node_arena();
+    ix->root = init_gtree_node(ix->arena);
+    GTREE_NODE(ix->arena, ix->root)->info |= GTREE_TOO_FULL_FLAG;
+    ix->table = init_root_table(root_k);
     ix->n_descs = 0;
     ix->descs = malloc( sizeof(char *) );
+    ix->map = NULL;
+    ix->map_len = 0;
+    ix->lazy = NULL;
     return ix;
 }
 
 int destroy_ix( ix_t *ix ) {
-    destroy_gtree(ix->root);
+    // nodes are released slab by slab, no need to walk the tree
+    destroy_node_arena(ix->arena);
+    destroy_root_table(ix->table);
+    if (ix->map != NULL) {
+        munmap(ix->map, ix->map_len);
+    }
+    if (ix->lazy != NULL) {
+        ix_lazy_t *lazy = ix->lazy;
+        fclose(lazy->file);
+        if (lazy->spill != NULL) {
+            fclose(lazy->spill);
+        }
+        free(lazy->in.buf);
+        free(lazy->shards);
+        free(lazy->spilled);
+        free(lazy->spill_room);
+        free(lazy->spill_free);
+        free(lazy->kmers);
+        free(lazy->newer);
+        free(lazy->older);
+        free(lazy);
+    }
     
     int i;
     for (i = 0; i < ix->n_descs; i++) {
@@ -32,164 +64,2225 @@ int destroy_ix( ix_t *ix ) {
     return 0;
 }
 
-int _serialize_gtree( gtree_t *node, FILE *out, ix_t *ix ) {
+/**
+ * start buffering what is written to "out" from its current offset on, in
+ * chunks of "cap" bytes, each compressed into a block of its own at zlib
+ * "level" unless that is -1.
+ */
+void _ix_out_open( ix_out_t *out, FILE *file, long cap, int level ) {
+    out->out = file;
+    out->buf = malloc(cap);
+    out->cap = cap;
+    out->len = 0;
+    out->flushed = ftell(file);
+    out->level = level;
+    out->zbuf = level < 0 ? NULL : malloc(compressBound(cap));
+}
+
+/**
+ * write out what "out" holds. A block is kept as it is when it would not
+ * shrink, which its STORED_LEN being its RAW_LEN tells the reader.
+ */
+void _ix_out_flush( ix_out_t *out ) {
+    if (out->level < 0) {
+        fwrite(out->buf, sizeof(char), out->len, out->out);
+        out->flushed += out->len;
+        out->len = 0;
+        return;
+    }
+    if (out->len == 0) {
+        return;
+    }
+
+    uint32_t lens[2];
+    lens[0] = out->len;
+    lens[1] = out->len;
+    const char *block = out->buf;
+    uLongf z_len = compressBound(out->len);
+    if (out->level > 0
+            && compress2((Bytef *) out->zbuf, &z_len, (const Bytef *) out->buf,
+                         out->len, out->level) == Z_OK
+            && z_len < out->len) {
+        lens[1] = z_len;
+        block = out->zbuf;
+    }
+    fwrite(lens, sizeof(uint32_t), 2, out->out);
+    fwrite(block, sizeof(char), lens[1], out->out);
+    out->flushed += out->len;
+    out->len = 0;
+}
 
-    char has_data;
+/**
+ * write out whatever "out" still holds, and release its buffers.
+ */
+void _ix_out_close( ix_out_t *out ) {
+    _ix_out_flush(out);
+    if (out->level >= 0) {
+        // an empty block ends the gtree
+        uint32_t lens[2] = { 0, 0 };
+        fwrite(lens, sizeof(uint32_t), 2, out->out);
+    }
+    free(out->buf);
+    free(out->zbuf);
+}
 
-    if (node == NULL) {
-        has_data = 0;
-        fwrite(&has_data, sizeof(char), 1, out);
-        return 0;
+/**
+ * append "n" bytes to the index, spilling what is held back to the file
+ * once the buffer is full.
+ */
+void _ix_out_write( ix_out_t *out, const void *bytes, long n ) {
+    if (out->len + n > out->cap) {
+        _ix_out_flush(out);
     }
+    memcpy(out->buf + out->len, bytes, n);
+    out->len += n;
+}
 
-    has_data = 1;
-    fwrite(&has_data, sizeof(char), 1, out);
+/**
+ * take back everything written to the index from offset "off" on. Only
+ * for indexes not written in blocks.
+ */
+void _ix_out_rewind( ix_out_t *out, long off ) {
+    if (off >= out->flushed) {
+        out->len = off - out->flushed;
+        return;
+    }
+    // already in the file, overwrite it from there
+    fseek(out->out, off, SEEK_SET);
+    out->flushed = off;
+    out->len = 0;
+}
 
-    char too_full = node->too_full ? 1 : 0;
-    fwrite(&too_full, sizeof(char), 1, out);
+/**
+ * start reading "file" from its current offset on, IX_IO_BUF_SIZE bytes
+ * or a block at a time.
+ */
+void _ix_in_open( ix_in_t *in, FILE *file, int blocks ) {
+    in->in = file;
+    // room for one more block behind what is left of the last one
+    in->buf = malloc(2 * IX_IO_BUF_SIZE);
+    in->len = 0;
+    in->pos = 0;
+    in->blocks = blocks;
+    in->zbuf = blocks ? malloc(compressBound(IX_IO_BUF_SIZE)) : NULL;
+    in->limit = -1;
+}
 
-    char n_matches = node->n_matches;
-    fwrite(&n_matches, sizeof(char), 1, out);
+void _ix_in_close( ix_in_t *in ) {
+    free(in->buf);
+    free(in->zbuf);
+}
 
-    // write gtree nodes
-    int i;
-    for (i = 0; i < 4; i++) {
-        _serialize_gtree(node->next[i], out, ix);
+/**
+ * read the next chunk or block of the index in behind what is left of the
+ * buffer.
+ *
+ * @return:
+ *      the number of bytes added, 0 at the end of the index
+ */
+long _ix_in_fill( ix_in_t *in ) {
+    long left = in->len - in->pos;
+    memmove(in->buf, in->buf + in->pos, left);
+    in->len = left;
+    in->pos = 0;
+    if (!in->blocks) {
+        long n = IX_IO_BUF_SIZE;
+        if (in->limit >= 0 && in->limit < n) {
+            n = in->limit;
+        }
+        n = fread(in->buf + left, sizeof(char), n, in->in);
+        if (in->limit >= 0) {
+            in->limit -= n;
+        }
+        in->len += n;
+        return n;
     }
-    
-    // write locs matches
-    for (i = 0; i < node->n_matches; i++) {
-        // write loc structure
-        int j, matchpos = -1;
-        for (j = 0; j < ix->n_descs; j++) {
-            if (ix->descs[j] == node->locs[i].desc) {
-                matchpos = j;
-                break;
-            }
+
+    uint32_t lens[2];
+    if (fread(lens, sizeof(uint32_t), 2, in->in) != 2 || lens[0] == 0
+            || lens[0] > IX_IO_BUF_SIZE || lens[1] > lens[0]) {
+        return 0;
+    }
+    if (lens[1] == lens[0]) {
+        if (fread(in->buf + left, sizeof(char), lens[0], in->in) != lens[0]) {
+            return 0;
+        }
+    }
+    else {
+        uLongf raw_len = lens[0];
+        if (fread(in->zbuf, sizeof(char), lens[1], in->in) != lens[1]
+                || uncompress((Bytef *) in->buf + left, &raw_len,
+                              (const Bytef *) in->zbuf, lens[1]) != Z_OK
+                || raw_len != lens[0]) {
+            return 0;
+        }
+    }
+    in->len += lens[0];
+    return lens[0];
+}
+
+/**
+ * take the next "n" bytes of the index into "bytes".
+ *
+ * @return:
+ *      0 on success, 1 if the index ends early
+ */
+int _ix_in_read( ix_in_t *in, void *bytes, long n ) {
+    while (in->len - in->pos < n) {
+        if (_ix_in_fill(in) == 0) {
+            return 1;
+        }
+    }
+    memcpy(bytes, in->buf + in->pos, n);
+    in->pos += n;
+    return 0;
+}
+
+/**
+ * take the next LEB128 varint of the index into "value".
+ *
+ * @return:
+ *      0 on success, 1 if the index ends early or the varint is too long
+ */
+int _ix_in_varint( ix_in_t *in, uint64_t *value ) {
+    *value = 0;
+    int shift;
+    for (shift = 0; shift < 64; shift += 7) {
+        if (in->pos == in->len && _ix_in_fill(in) == 0) {
+            return 1;
         }
+        unsigned char byte = in->buf[in->pos++];
+        *value |= (uint64_t) (byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * append "value" to the index as a LEB128 varint.
+ */
+void _ix_out_varint( ix_out_t *out, uint64_t value ) {
+    unsigned char bytes[10];
+    int n = 0;
+    while (value >= 0x80) {
+        bytes[n++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    bytes[n++] = value;
+    _ix_out_write(out, bytes, n);
+}
+
+/**
+ * write the HAS_DATA, INT_TOO_FULL and INT_N_MATCHES fields of "node".
+ */
+void _serialize_node_head( gtree_t *node, ix_out_t *out ) {
+    char head[3];
+    head[0] = 1;
+    head[1] = GTREE_TOO_FULL(node) ? 1 : 0;
+    head[2] = GTREE_N_MATCHES(node);
+    _ix_out_write(out, head, 3);
+}
 
-        if (matchpos == -1 && node->locs[i].desc != NULL) {
+/**
+ * write the LOC_STRUCTs of "node", which come after its children.
+ */
+void _serialize_node_locs( node_arena_t *arena, gtree_t *node,
+                           unsigned int n_descs, ix_out_t *out ) {
+    int i;
+    for (i = 0; i < GTREE_N_MATCHES(node); i++) {
+        loc_t *loc = GTREE_LOC(arena, node->locs + i);
+
+        int matchpos = loc->desc == LOC_NO_DESC ? -1 : (int) loc->desc;
+        if (loc->desc != LOC_NO_DESC && loc->desc >= n_descs) {
             //assert() somehow
             printf("ERROR: attempting to serialize corrupted gtree\n");
         }
 
         // write loc structure
-        fwrite(&matchpos, sizeof(int), 1, out);
-        fwrite(&(node->locs[i].pos), sizeof(long), 1, out);
+        long pos = loc->pos;
+        char bytes[sizeof(int) + sizeof(long)];
+        memcpy(bytes, &matchpos, sizeof(int));
+        memcpy(bytes + sizeof(int), &pos, sizeof(long));
+        _ix_out_write(out, bytes, sizeof(bytes));
+    }
+}
+
+/**
+ * the node written out as child "i" of the "off"'th base of node "id", and
+ * the base of it that child stands for in "child_off".
+ */
+node_id_t _serialized_child( node_arena_t *arena, node_id_t id, int off,
+                             int i, int *child_off ) {
+    gtree_t *node = GTREE_NODE(arena, id);
+    *child_off = 0;
+    if (GTREE_KIND(node) != GTREE_KIND_PATH) {
+        return node->next[i];
+    }
+    if (i != GTREE_PATH_BASE(node, off)) {
+        return NULL_NODE;
     }
+    if (off + 1 < GTREE_PATH_LEN(node)) {
+        *child_off = off + 1;
+        return id;
+    }
+    return node->next[0];
+}
 
-    return 0;
+/**
+ * write shard "i" of a lazy index, which has not been read in, as its
+ * GTREE_NODE is found in the index file or the spill file.
+ */
+void _copy_lazy_shard( ix_lazy_t *lazy, int i, ix_out_t *out ) {
+    ix_shard_t *shard = &lazy->shards[i];
+    FILE *file = lazy->spilled[i] ? lazy->spill : lazy->file;
+    char bytes[1 << 16];
+    int64_t left = shard->size;
+
+    fseek(file, shard->offset, SEEK_SET);
+    while (left > 0) {
+        long n = left < sizeof(bytes) ? left : sizeof(bytes);
+        if (fread(bytes, sizeof(char), n, file) != n) {
+            printf("ERROR: shard %d of the lazy index is truncated\n", i);
+            lazy->err = 1;
+            return;
+        }
+        _ix_out_write(out, bytes, n);
+        left -= n;
+    }
 }
 
-int serialize_ix( ix_t *ix, char *outfile ) {
-    // needs to be done iteratively to avoid stackoverflow
+/**
+ * serialize the gtree under the "off"'th base of node "id", in pre-order
+ * with the locs of each node after its children. Each base of a path node
+ * is written out as a node of its own, and the shards of a lazy index that
+ * were never read in are copied over as they are.
+ */
+void _serialize_gtree( node_arena_t *arena, node_id_t id, int off,
+                       ix_out_t *out, unsigned int n_descs ) {
+    char no_data = 0;
+    if (id == NULL_NODE) {
+        _ix_out_write(out, &no_data, 1);
+        return;
+    }
+    if (GTREE_LAZY(GTREE_NODE(arena, id))) {
+        _copy_lazy_shard(arena->fault_ctx, GTREE_NODE(arena, id)->locs, out);
+        return;
+    }
 
-    FILE *out = fopen(outfile, "w+");
-    
+    // the nodes whose children are being written, grown as deep as needed
+    int cap = MAX_WINDOW_SIZE + 1;
+    ix_write_frame_t *stack = malloc(sizeof(ix_write_frame_t) * cap);
+    int top = 0;
+    stack[0].id = id;
+    stack[0].off = off;
+    stack[0].next = 0;
+    _serialize_node_head(GTREE_NODE(arena, id), out);
+
+    while (top >= 0) {
+        ix_write_frame_t *frame = &stack[top];
+        gtree_t *node = GTREE_NODE(arena, frame->id);
+        if (frame->next == 4) {
+            _serialize_node_locs(arena, node, n_descs, out);
+            top--;
+            continue;
+        }
+
+        int child_off;
+        node_id_t child = _serialized_child(arena, frame->id, frame->off,
+                                            frame->next++, &child_off);
+        if (child == NULL_NODE) {
+            _ix_out_write(out, &no_data, 1);
+            continue;
+        }
+        if (GTREE_LAZY(GTREE_NODE(arena, child))) {
+            _copy_lazy_shard(arena->fault_ctx, GTREE_NODE(arena, child)->locs,
+                             out);
+            continue;
+        }
+
+        _serialize_node_head(GTREE_NODE(arena, child), out);
+        if (++top == cap) {
+            cap *= 2;
+            stack = realloc(stack, sizeof(ix_write_frame_t) * cap);
+        }
+        stack[top].id = child;
+        stack[top].off = child_off;
+        stack[top].next = 0;
+    }
+    free(stack);
+}
+
+/**
+ * write the HEADER and DESC_STRINGs of an index.
+ */
+void _serialize_ix_head( int version, int root_k, unsigned int n_descs,
+                         char **descs, FILE *out ) {
     // write header
-    // EMPTY right now
+    fwrite(IX_FORMAT_MAGIC, sizeof(char), 4, out);
+    fwrite(&version, sizeof(int), 1, out);
+    fwrite(&root_k, sizeof(int), 1, out);
 
     // write n_desc_strings
-    fwrite(&(ix->n_descs), sizeof(unsigned int), 1, out);
+    fwrite(&n_descs, sizeof(unsigned int), 1, out);
 
     // write strings
     int i;
-    for (i = 0; i < ix->n_descs; i++) {
+    for (i = 0; i < n_descs; i++) {
         // INT_N_LEN
-        size_t desclen = strlen(ix->descs[i]);
+        size_t desclen = strlen(descs[i]);
         fwrite(&desclen, sizeof(size_t), 1, out);
         // DESC_STRING
-        fwrite(ix->descs[i], sizeof(char), strlen(ix->descs[i]) + 1, out);
+        fwrite(descs[i], sizeof(char), strlen(descs[i]) + 1, out);
+    }
+}
+
+/**
+ * close "file", the index being written to "outfile", reporting whether any
+ * write to it failed on the way, or the final flush did.
+ */
+int _close_ix_file( FILE *file, char *outfile ) {
+    int err = ferror(file);
+    if (fclose(file) != 0 || err) {
+        printf("ERROR: could not write index file %s\n", outfile);
+        return 1;
+    }
+    return 0;
+}
+
+int serialize_ix( ix_t *ix, char *outfile ) {
+    FILE *file = fopen(outfile, "w+");
+    if (file == NULL) {
+        printf("ERROR: could not open index file %s for writing\n", outfile);
+        return 1;
     }
+    _serialize_ix_head(IX_FORMAT_VERSION, ix->table->k, ix->n_descs,
+                       ix->descs, file);
 
     // write gtree
-    _serialize_gtree(ix->root, out, ix);
+    ix_out_t out;
+    _ix_out_open(&out, file, IX_IO_BUF_SIZE, -1);
+    _serialize_gtree(ix->arena, ix->root, 0, &out, ix->n_descs);
+    _ix_out_close(&out);
+
+    int err = _close_ix_file(file, outfile);
+    return err || (ix->lazy != NULL && ix->lazy->err);
+}
 
-    fclose(out);
+/**
+ * serialize the plain node "id" of "ix", "depth" bases down and reached by
+ * "kmer", replacing each node "bucket_depth" bases down by the subtree that
+ * "loader" hands over for it.
+ */
+void _serialize_top( ix_t *ix, node_id_t id, int depth, uint32_t kmer,
+                     int bucket_depth, bucket_loader_t loader, void *ctx,
+                     ix_out_t *out ) {
+    if (id != NULL_NODE && depth == bucket_depth) {
+        node_arena_t *arena;
+        node_id_t sub = loader(ctx, kmer, &arena);
+        _serialize_gtree(arena, sub, 0, out, ix->n_descs);
+        destroy_node_arena(arena);
+        return;
+    }
+    if (id == NULL_NODE) {
+        _serialize_gtree(ix->arena, NULL_NODE, 0, out, ix->n_descs);
+        return;
+    }
 
-    return 0;
+    gtree_t *node = GTREE_NODE(ix->arena, id);
+    _serialize_node_head(node, out);
+    int i;
+    for (i = 0; i < 4; i++) {
+        _serialize_top(ix, node->next[i], depth + 1, (kmer << 2) | i,
+                       bucket_depth, loader, ctx, out);
+    }
+    _serialize_node_locs(ix->arena, node, ix->n_descs, out);
 }
 
-gtree_t *_deserialize_gtree( FILE *in, ix_t *ix ) {
+int serialize_ix_by_bucket( ix_t *ix, char *outfile, int bucket_depth,
+                            bucket_loader_t loader, void *ctx ) {
+    FILE *file = fopen(outfile, "w+");
+    if (file == NULL) {
+        printf("ERROR: could not open index file %s for writing\n", outfile);
+        return 1;
+    }
+    _serialize_ix_head(IX_FORMAT_VERSION, ix->table->k, ix->n_descs,
+                       ix->descs, file);
+    ix_out_t out;
+    _ix_out_open(&out, file, IX_IO_BUF_SIZE, -1);
+    _serialize_top(ix, ix->root, 0, 0, bucket_depth, loader, ctx, &out);
+    _ix_out_close(&out);
 
-    char has_data;
-    fread(&has_data, sizeof(char), 1, in);
-    
-    if ( !has_data ) {
-        return NULL;
+    return _close_ix_file(file, outfile);
+}
+
+/**
+ * whether nodes "a" and "b" carry the same INT_TOO_FULL, INT_N_MATCHES and
+ * locs, as the bases of a path node all do.
+ */
+int _same_node_data( node_arena_t *arena, node_id_t a, node_id_t b ) {
+    if (a == b) {
+        return 1;
+    }
+    gtree_t *node_a = GTREE_NODE(arena, a);
+    gtree_t *node_b = GTREE_NODE(arena, b);
+    if ((node_a->info & (GTREE_TOO_FULL_FLAG | GTREE_N_MATCHES_MASK))
+            != (node_b->info & (GTREE_TOO_FULL_FLAG | GTREE_N_MATCHES_MASK))) {
+        return 0;
+    }
+    int i;
+    for (i = 0; i < GTREE_N_MATCHES(node_a); i++) {
+        loc_t *loc_a = GTREE_LOC(arena, node_a->locs + i);
+        loc_t *loc_b = GTREE_LOC(arena, node_b->locs + i);
+        if (loc_a->desc != loc_b->desc || loc_a->pos != loc_b->pos) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * write the COMPACT_NODE head of the "off"'th base of node "id", and its
+ * locs unless they are those of "parent".
+ */
+void _serialize_compact_node( node_arena_t *arena, node_id_t id, int off,
+                              node_id_t parent, unsigned int n_descs,
+                              ix_out_t *out ) {
+    gtree_t *node = GTREE_NODE(arena, id);
+    unsigned char head = 0;
+    int i;
+    for (i = 0; i < 4; i++) {
+        int child_off;
+        if (_serialized_child(arena, id, off, i, &child_off) != NULL_NODE) {
+            head |= 1 << i;
+        }
+    }
+    if (parent != NULL_NODE && _same_node_data(arena, parent, id)) {
+        head |= IX_COMPACT_SAME;
+        _ix_out_write(out, &head, 1);
+        return;
     }
-    
-    gtree_t *node = init_gtree_node();
 
-    char too_full;
-    fread(&too_full, sizeof(char), 1, in);
-    if (too_full) {
-        node->too_full = 1;
+    int n_matches = GTREE_N_MATCHES(node);
+    if (GTREE_TOO_FULL(node)) {
+        head |= IX_COMPACT_TOO_FULL;
     }
-    else {
-        node->too_full = 0;
+    head |= (n_matches < IX_COMPACT_N_MATCHES_MAX ? n_matches
+                : IX_COMPACT_N_MATCHES_MAX) << IX_COMPACT_N_MATCHES_SHIFT;
+    _ix_out_write(out, &head, 1);
+    if (n_matches >= IX_COMPACT_N_MATCHES_MAX) {
+        _ix_out_varint(out, n_matches - IX_COMPACT_N_MATCHES_MAX);
+    }
+
+    // locs on the same sequence as the one before are kept as a delta
+    for (i = 0; i < n_matches; i++) {
+        loc_t *loc = GTREE_LOC(arena, node->locs + i);
+        if (loc->desc != LOC_NO_DESC && loc->desc >= n_descs) {
+            printf("ERROR: attempting to serialize corrupted gtree\n");
+        }
+        loc_t *prev = i > 0 ? GTREE_LOC(arena, node->locs + i - 1) : NULL;
+        long pos = loc->pos;
+        if (prev != NULL && prev->desc == loc->desc) {
+            _ix_out_varint(out, 0);
+            pos -= prev->pos;
+        }
+        else {
+            _ix_out_varint(out, loc->desc == LOC_NO_DESC ? 1
+                                    : (uint64_t) loc->desc + 2);
+        }
+        _ix_out_varint(out, ((uint64_t) pos << 1) ^ (uint64_t) (pos >> 63));
+    }
+}
+
+int serialize_ix_compact( ix_t *ix, char *outfile, int level ) {
+    FILE *file = fopen(outfile, "w+");
+    if (file == NULL) {
+        printf("ERROR: could not open index file %s for writing\n", outfile);
+        return 1;
+    }
+    _serialize_ix_head(IX_COMPACT_FORMAT_VERSION, ix->table->k, ix->n_descs,
+                       ix->descs, file);
+
+    ix_out_t out;
+    _ix_out_open(&out, file, IX_IO_BUF_SIZE, level);
+    node_arena_t *arena = ix->arena;
+    char has_root = ix->root != NULL_NODE;
+    _ix_out_write(&out, &has_root, 1);
+
+    // the nodes whose children are being written, as in _serialize_gtree
+    int cap = MAX_WINDOW_SIZE + 1;
+    ix_write_frame_t *stack = malloc(sizeof(ix_write_frame_t) * cap);
+    int top = -1;
+    if (has_root) {
+        _serialize_compact_node(arena, ix->root, 0, NULL_NODE, ix->n_descs,
+                                &out);
+        top = 0;
+        stack[0].id = ix->root;
+        stack[0].off = 0;
+        stack[0].next = 0;
+    }
+    while (top >= 0) {
+        ix_write_frame_t *frame = &stack[top];
+        if (frame->next == 4) {
+            top--;
+            continue;
+        }
+        int off;
+        node_id_t child = _serialized_child(arena, frame->id, frame->off,
+                                            frame->next++, &off);
+        if (child == NULL_NODE) {
+            continue;
+        }
+
+        _serialize_compact_node(arena, child, off, frame->id, ix->n_descs,
+                                &out);
+        if (++top == cap) {
+            cap *= 2;
+            stack = realloc(stack, sizeof(ix_write_frame_t) * cap);
+        }
+        stack[top].id = child;
+        stack[top].off = off;
+        stack[top].next = 0;
     }
+    free(stack);
+
+    _ix_out_close(&out);
+    return _close_ix_file(file, outfile);
+}
 
-    char n_matches;
-    fread(&n_matches, sizeof(char), 1, in);
-    node->n_matches = n_matches;
+/**
+ * write the gtree above "shard_depth" bases as "_serialize_gtree" would,
+ * with an IX_SHARD_MARK in place of each node that deep, and collect those
+ * nodes into "shards". Either of "out" and "shards" may be NULL, to only
+ * count the shards.
+ */
+void _serialize_shard_top( node_arena_t *arena, node_id_t id, int off,
+                           int depth, int shard_depth, unsigned int n_descs,
+                           ix_out_t *out, ix_shard_t *shards,
+                           int *n_shards ) {
+    if (id == NULL_NODE) {
+        char no_data = 0;
+        if (out != NULL) {
+            _ix_out_write(out, &no_data, 1);
+        }
+        return;
+    }
+    if (depth == shard_depth) {
+        char mark = IX_SHARD_MARK;
+        if (out != NULL) {
+            _ix_out_write(out, &mark, 1);
+        }
+        if (shards != NULL) {
+            shards[*n_shards].root = id;
+            shards[*n_shards].off = off;
+        }
+        (*n_shards)++;
+        return;
+    }
 
+    gtree_t *node = GTREE_NODE(arena, id);
+    if (out != NULL) {
+        _serialize_node_head(node, out);
+    }
     int i;
     for (i = 0; i < 4; i++) {
-        node->next[i] = _deserialize_gtree( in, ix );
+        int child_off;
+        node_id_t child = _serialized_child(arena, id, off, i, &child_off);
+        _serialize_shard_top(arena, child, child_off, depth + 1, shard_depth,
+                             n_descs, out, shards, n_shards);
+    }
+    if (out != NULL) {
+        _serialize_node_locs(arena, node, n_descs, out);
     }
+}
+
+int serialize_ix_sharded( ix_t *ix, char *outfile, int shard_depth ) {
+    FILE *file = fopen(outfile, "w+");
+    if (file == NULL) {
+        printf("ERROR: could not open index file %s for writing\n", outfile);
+        return 1;
+    }
+    _serialize_ix_head(IX_SHARDED_FORMAT_VERSION, ix->table->k, ix->n_descs,
+                       ix->descs, file);
+
+    int n_shards = 0;
+    _serialize_shard_top(ix->arena, ix->root, 0, 0, shard_depth, ix->n_descs,
+                         NULL, NULL, &n_shards);
+    ix_shard_t *shards = calloc(n_shards > 0 ? n_shards : 1,
+                                sizeof(ix_shard_t));
+    unsigned int n = n_shards;
+    fwrite(&shard_depth, sizeof(int), 1, file);
+    fwrite(&n, sizeof(unsigned int), 1, file);
+    // the offset table is filled in once the shards are written
+    long table = ftell(file);
+    int i;
+    for (i = 0; i < n_shards; i++) {
+        fwrite(&shards[i].offset, sizeof(int64_t), 1, file);
+        fwrite(&shards[i].size, sizeof(int64_t), 1, file);
+    }
+
+    ix_out_t out;
+    _ix_out_open(&out, file, IX_IO_BUF_SIZE, -1);
+    n_shards = 0;
+    _serialize_shard_top(ix->arena, ix->root, 0, 0, shard_depth, ix->n_descs,
+                         &out, shards, &n_shards);
+    for (i = 0; i < n_shards; i++) {
+        shards[i].offset = out.flushed + out.len;
+        _serialize_gtree(ix->arena, shards[i].root, shards[i].off, &out,
+                         ix->n_descs);
+        shards[i].size = out.flushed + out.len - shards[i].offset;
+    }
+    _ix_out_close(&out);
 
-    for (i = 0; i < node->n_matches; i++) {
+    fseek(file, table, SEEK_SET);
+    for (i = 0; i < n_shards; i++) {
+        fwrite(&shards[i].offset, sizeof(int64_t), 1, file);
+        fwrite(&shards[i].size, sizeof(int64_t), 1, file);
+    }
+    free(shards);
+    return _close_ix_file(file, outfile);
+}
+
+/**
+ * read the LOC_STRUCTs of node "id", which has "n_matches" of them.
+ *
+ * @return:
+ *      0 on success, 1 if the index ends early
+ */
+int _deserialize_node_locs( ix_in_t *in, node_arena_t *arena, node_id_t id,
+                            int n_matches ) {
+    gtree_t *node = GTREE_NODE(arena, id);
+    if (n_matches > 0) {
+        node->locs = init_loc_run(arena, n_matches);
+    }
+    int i;
+    for (i = 0; i < n_matches; i++) {
         // read loc structure
+        loc_t *loc = GTREE_LOC(arena, node->locs + i);
+        char bytes[sizeof(int) + sizeof(long)];
+        if (_ix_in_read(in, bytes, sizeof(bytes)) != 0) {
+            return 1;
+        }
+
         int descpos;
-        fread(&descpos, sizeof(int), 1, in);
+        memcpy(&descpos, bytes, sizeof(int));
+        loc->desc = descpos < 0 ? LOC_NO_DESC : descpos;
+
+        long pos;
+        memcpy(&pos, bytes + sizeof(int), sizeof(long));
+        if (pos < 0 || pos > LOC_MAX_POS) {
+            return 1;
+        }
+        loc->pos = pos;
+    }
+    return 0;
+}
+
+/**
+ * read a gtree from "in" into "arena" in the order "_serialize_gtree" writes
+ * it, folding single-child chains back into path nodes as they are
+ * completed, once more than "fold_below" bases below the root read.
+ *
+ * @return:
+ *      0 on success, 1 if the index ends early, leaving "root" unset
+ */
+int _deserialize_gtree( ix_in_t *in, node_arena_t *arena, int fold_below,
+                        node_id_t *root ) {
+    int cap = MAX_WINDOW_SIZE + 1;
+    ix_read_frame_t *stack = malloc(sizeof(ix_read_frame_t) * cap);
+    int top = -1;
+    int err = 0;
+
+    while (1) {
+        char head[3];
+        if (_ix_in_read(in, head, 1) != 0
+                || (head[0] && _ix_in_read(in, head + 1, 2) != 0)) {
+            err = 1;
+            break;
+        }
+
+        if (head[0]) {
+            node_id_t id = init_gtree_node(arena);
+            gtree_t *node = GTREE_NODE(arena, id);
+            if (head[1]) {
+                node->info |= GTREE_TOO_FULL_FLAG;
+            }
+            node->info |= head[2] & GTREE_N_MATCHES_MASK;
+
+            if (++top == cap) {
+                cap *= 2;
+                stack = realloc(stack, sizeof(ix_read_frame_t) * cap);
+            }
+            stack[top].id = id;
+            stack[top].next = 0;
+            stack[top].n_matches = head[2];
+            continue;
+        }
+
+        // hand the subtree just read to its parent, finishing every node
+        // whose children are all through
+        node_id_t id = NULL_NODE;
+        while (top >= 0) {
+            ix_read_frame_t *frame = &stack[top];
+            gtree_t *node = GTREE_NODE(arena, frame->id);
+            node->next[frame->next++] = id;
+            if (frame->next < 4) {
+                break;
+            }
 
-        node->locs[i].desc = descpos < 0 ? NULL
-                                         : ix->descs[descpos];
+            if (_deserialize_node_locs(in, arena, frame->id,
+                                       frame->n_matches) != 0) {
+                err = 1;
+                break;
+            }
 
-        fread(&(node->locs[i].pos), sizeof(long), 1, in);
+            // fold single-child chains back into path nodes, leaving the
+            // root and the nodes covered by the root table be
+            if (top > fold_below) {
+                compress_gtree_node(arena, frame->id);
+            }
+            id = frame->id;
+            top--;
+        }
+        if (err || top < 0) {
+            *root = id;
+            break;
+        }
     }
 
-    return node;
+    free(stack);
+    return err;
 }
 
-ix_t *deserialize_ix( char *ixfile ) {
+/**
+ * read the COMPACT_NODE head of a node, and its locs, into the new node
+ * "id", copying those of "parent" if it says so.
+ *
+ * @return:
+ *      0 on success, 1 if the index ends early or is corrupt
+ */
+int _deserialize_compact_node( ix_in_t *in, node_arena_t *arena,
+                               node_id_t id, node_id_t parent, int *mask ) {
+    unsigned char head;
+    if (_ix_in_read(in, &head, 1) != 0) {
+        return 1;
+    }
+    *mask = head & 0xF;
+    gtree_t *node = GTREE_NODE(arena, id);
+    int i;
 
-    FILE *in = fopen(ixfile, "r");
+    if (head & IX_COMPACT_SAME) {
+        if (parent == NULL_NODE) {
+            return 1;
+        }
+        gtree_t *from = GTREE_NODE(arena, parent);
+        node->info |= from->info & (GTREE_TOO_FULL_FLAG | GTREE_N_MATCHES_MASK);
+        int n_matches = GTREE_N_MATCHES(from);
+        if (n_matches > 0) {
+            node->locs = init_loc_run(arena, n_matches);
+            for (i = 0; i < n_matches; i++) {
+                *GTREE_LOC(arena, node->locs + i) =
+                    *GTREE_LOC(arena, from->locs + i);
+            }
+        }
+        return 0;
+    }
 
-    ix_t *ix = init_ix();
+    uint64_t n_matches = head >> IX_COMPACT_N_MATCHES_SHIFT;
+    if (n_matches == IX_COMPACT_N_MATCHES_MAX) {
+        uint64_t more;
+        if (_ix_in_varint(in, &more) != 0
+                || more > GTREE_N_MATCHES_MASK - IX_COMPACT_N_MATCHES_MAX) {
+            return 1;
+        }
+        n_matches += more;
+    }
+    if (head & IX_COMPACT_TOO_FULL) {
+        node->info |= GTREE_TOO_FULL_FLAG;
+    }
+    node->info |= n_matches;
+    if (n_matches > 0) {
+        node->locs = init_loc_run(arena, n_matches);
+    }
 
-    // read header
-    // EMPTY right now
+    loc_t *prev = NULL;
+    for (i = 0; i < n_matches; i++) {
+        loc_t *loc = GTREE_LOC(arena, node->locs + i);
+        uint64_t desc, zigzag;
+        if (_ix_in_varint(in, &desc) != 0 || _ix_in_varint(in, &zigzag) != 0
+                || (desc == 0 && prev == NULL)) {
+            return 1;
+        }
+        long pos = (long) (zigzag >> 1) ^ -(long) (zigzag & 1);
+        if (desc == 0) {
+            loc->desc = prev->desc;
+            pos += prev->pos;
+        }
+        else {
+            loc->desc = desc == 1 ? LOC_NO_DESC : desc - 2;
+        }
+        if (pos < 0 || pos > LOC_MAX_POS) {
+            return 1;
+        }
+        loc->pos = pos;
+        prev = loc;
+    }
+    return 0;
+}
 
-    // read n_desc_strings
-    fread(&(ix->n_descs), sizeof(unsigned int), 1, in);
-    ix->descs = realloc(ix->descs, sizeof(char *) * ix->n_descs);
+/**
+ * read the gtree of a compact index into "ix", folding single-child chains
+ * back into path nodes as "_deserialize_gtree" does.
+ *
+ * @return:
+ *      0 on success, 1 if the index ends early or is corrupt, leaving
+ *      "root" unset
+ */
+int _deserialize_gtree_compact( ix_in_t *in, ix_t *ix, node_id_t *root ) {
+    node_arena_t *arena = ix->arena;
+    char has_root;
+    if (_ix_in_read(in, &has_root, 1) != 0) {
+        return 1;
+    }
+    *root = NULL_NODE;
+    if (!has_root) {
+        return 0;
+    }
 
-    // read in desc strings
-    int i;
-    for (i = 0; i < ix->n_descs; i++) {
-        // INT_N_LEN
-        size_t desclen;
-        fread(&desclen, sizeof(size_t), 1, in);
+    int cap = MAX_WINDOW_SIZE + 1;
+    ix_read_frame_t *stack = malloc(sizeof(ix_read_frame_t) * cap);
+    int top = 0;
+    int err = 0;
+    stack[0].id = init_gtree_node(arena);
+    stack[0].next = 0;
+    *root = stack[0].id;
+    err = _deserialize_compact_node(in, arena, stack[0].id, NULL_NODE,
+                                    &stack[0].mask);
 
-        // DESC_STRING
-        ix->descs[i] = malloc(sizeof(char) * (desclen + 1));
-        fread(ix->descs[i], sizeof(char), desclen + 1, in);
+    while (!err && top >= 0) {
+        ix_read_frame_t *frame = &stack[top];
+        while (frame->next < 4 && !(frame->mask & (1 << frame->next))) {
+            frame->next++;
+        }
+        if (frame->next == 4) {
+            // leaving the root and the nodes covered by the root table be
+            if (top > ix->table->k) {
+                compress_gtree_node(arena, frame->id);
+            }
+            top--;
+            continue;
+        }
+
+        node_id_t child = init_gtree_node(arena);
+        GTREE_NODE(arena, frame->id)->next[frame->next++] = child;
+        if (++top == cap) {
+            cap *= 2;
+            stack = realloc(stack, sizeof(ix_read_frame_t) * cap);
+        }
+        stack[top].id = child;
+        stack[top].next = 0;
+        err = _deserialize_compact_node(in, arena, child, stack[top - 1].id,
+                                        &stack[top].mask);
     }
 
-    // read gtree
-    free(ix->root);     // required since init_ix() alloc's a node
-    ix->root = _deserialize_gtree(in, ix);
+    free(stack);
+    return err;
+}
 
-    fclose(in);
+/**
+ * read the gtree above the shards of a sharded index, taking down where
+ * each shard hangs off in "pool" as its IX_SHARD_MARK comes up. Nodes are
+ * left unfolded, as their shards are still missing.
+ *
+ * @return:
+ *      0 on success, 1 if the index ends early or is corrupt
+ */
+int _deserialize_shard_top( ix_in_t *in, node_arena_t *arena, int depth,
+                            node_id_t parent, int slot, shard_pool_t *pool,
+                            node_id_t *id ) {
+    char head[3];
+    *id = NULL_NODE;
+    if (_ix_in_read(in, head, 1) != 0) {
+        return 1;
+    }
+    if (head[0] == 0) {
+        return 0;
+    }
+    if (head[0] == IX_SHARD_MARK && depth == pool->shard_depth) {
+        if (pool->next == pool->n_shards) {
+            return 1;
+        }
+        pool->shards[pool->next].parent = parent;
+        pool->shards[pool->next].slot = slot;
+        pool->next++;
+        return 0;
+    }
+    if (depth == pool->shard_depth || _ix_in_read(in, head + 1, 2) != 0) {
+        return 1;
+    }
 
-    return ix;
+    *id = init_gtree_node(arena);
+    gtree_t *node = GTREE_NODE(arena, *id);
+    if (head[1]) {
+        node->info |= GTREE_TOO_FULL_FLAG;
+    }
+    node->info |= head[2] & GTREE_N_MATCHES_MASK;
+    int i;
+    for (i = 0; i < 4; i++) {
+        node_id_t child;
+        if (_deserialize_shard_top(in, arena, depth + 1, *id, i, pool,
+                                   &child) != 0) {
+            return 1;
+        }
+        node->next[i] = child;
+    }
+    return _deserialize_node_locs(in, arena, *id, head[2]);
 }
 
-void print_ix_info( ix_t *ix ) {
-    printf("printing index info:\n");
-    printf("number of nodes: %ld\n", count_gtree_nodes(ix->root));
+/**
+ * fold the nodes above the shards, once the shards are in place, as
+ * "_deserialize_gtree" would have on the way up.
+ */
+void _fold_shard_top( node_arena_t *arena, node_id_t id, int depth,
+                      int shard_depth, int fold_below ) {
+    if (id == NULL_NODE || depth == shard_depth) {
+        return;
+    }
+    int i;
+    for (i = 0; i < 4; i++) {
+        _fold_shard_top(arena, GTREE_NODE(arena, id)->next[i], depth + 1,
+                        shard_depth, fold_below);
+    }
+    if (depth > fold_below) {
+        compress_gtree_node(arena, id);
+    }
+}
+
+void *_shard_worker_main( void *arg ) {
+    shard_worker_t *worker = arg;
+    shard_pool_t *pool = worker->pool;
+    FILE *file = fopen(pool->ixfile, "r");
+    if (file == NULL) {
+        pthread_mutex_lock(&pool->lock);
+        pool->err = 1;
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+    }
+    ix_in_t in;
+    _ix_in_open(&in, file, 0);
+
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        int task = pool->err ? pool->n_shards : pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (task >= pool->n_shards) {
+            break;
+        }
+
+        ix_shard_t *shard = &pool->shards[task];
+        fseek(file, shard->offset, SEEK_SET);
+        in.len = 0;
+        in.pos = 0;
+        int err = _deserialize_gtree(&in, worker->arena, pool->fold_below,
+                                     &shard->root);
+        // a shard must take up exactly the bytes its table entry says
+        if (err || ftell(file) - (in.len - in.pos)
+                       != shard->offset + shard->size) {
+            pthread_mutex_lock(&pool->lock);
+            pool->err = 1;
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+
+    _ix_in_close(&in);
+    fclose(file);
+    return NULL;
+}
+
+/**
+ * read INT_SHARD_DEPTH, the SHARD_ENTRYs and the TOP_NODE of the sharded
+ * index "ixfile" into "pool" and "ix", from just past the HEADER and
+ * DESC_STRINGs in "in". The shards themselves are left to be read.
+ *
+ * @return:
+ *      0 on success, 1 if the index ends early or is corrupt
+ */
+int _deserialize_shard_table( FILE *in, char *ixfile, ix_t *ix,
+                              shard_pool_t *pool ) {
+    unsigned int n_shards;
+    if (fread(&pool->shard_depth, sizeof(int), 1, in) != 1
+            || fread(&n_shards, sizeof(unsigned int), 1, in) != 1
+            || pool->shard_depth < 0 || pool->shard_depth > MAX_WINDOW_SIZE
+            || n_shards > IX_SHARD_MAX) {
+        return 1;
+    }
+    pool->ixfile = ixfile;
+    pool->n_shards = n_shards;
+    pool->shards = calloc(n_shards > 0 ? n_shards : 1, sizeof(ix_shard_t));
+    pool->fold_below = ix->table->k - pool->shard_depth;
+    pool->next = 0;
+    pool->err = 0;
+    int i;
+    for (i = 0; i < pool->n_shards; i++) {
+        if (fread(&pool->shards[i].offset, sizeof(int64_t), 1, in) != 1
+                || fread(&pool->shards[i].size, sizeof(int64_t), 1, in) != 1) {
+            free(pool->shards);
+            return 1;
+        }
+    }
+
+    ix_in_t buffered;
+    _ix_in_open(&buffered, in, 0);
+    int err = _deserialize_shard_top(&buffered, ix->arena, 0, NULL_NODE, 0,
+                                     pool, &ix->root);
+    _ix_in_close(&buffered);
+    if (err || pool->next != pool->n_shards) {
+        free(pool->shards);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * read the gtree of the sharded index "ixfile" into "ix", from just past
+ * the HEADER and DESC_STRINGs in "in", with the shards read on "n_threads"
+ * threads.
+ *
+ * @return:
+ *      0 on success, 1 if the index ends early or is corrupt
+ */
+int _deserialize_ix_sharded( FILE *in, char *ixfile, ix_t *ix,
+                             int n_threads ) {
+    shard_pool_t pool;
+    if (_deserialize_shard_table(in, ixfile, ix, &pool) != 0) {
+        return 1;
+    }
+    int i;
+
+    pool.next = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+    if (n_threads > pool.n_shards) {
+        n_threads = pool.n_shards;
+    }
+    if (n_threads <= 1) {
+        shard_worker_t worker;
+        worker.pool = &pool;
+        worker.arena = ix->arena;
+        _shard_worker_main(&worker);
+    }
+    else {
+        printf("INFO: loading with %d threads over %d shards\n",
+               n_threads, pool.n_shards);
+        shard_worker_t *workers = malloc(sizeof(shard_worker_t) * n_threads);
+        pthread_t *threads = malloc(sizeof(pthread_t) * n_threads);
+        for (i = 0; i < n_threads; i++) {
+            workers[i].pool = &pool;
+            workers[i].arena = share_node_arena(ix->arena);
+        }
+        for (i = 0; i < n_threads; i++) {
+            pthread_create(&threads[i], NULL, _shard_worker_main,
+                           &workers[i]);
+        }
+        for (i = 0; i < n_threads; i++) {
+            pthread_join(threads[i], NULL);
+            destroy_node_arena(workers[i].arena);
+        }
+        free(threads);
+        free(workers);
+    }
+    pthread_mutex_destroy(&pool.lock);
+
+    // stitch the shards onto the nodes they hang off
+    if (!pool.err) {
+        for (i = 0; i < pool.n_shards; i++) {
+            ix_shard_t *shard = &pool.shards[i];
+            if (shard->parent == NULL_NODE) {
+                ix->root = shard->root;
+            }
+            else {
+                GTREE_NODE(ix->arena, shard->parent)->next[shard->slot] =
+                    shard->root;
+            }
+        }
+        _fold_shard_top(ix->arena, ix->root, 0, pool.shard_depth,
+                        ix->table->k);
+    }
+    free(pool.shards);
+    return pool.err;
+}
+
+/**
+ * read the HEADER and DESC_STRINGs of an index, leaving "in" at its gtree,
+ * which is in the format of "version".
+ *
+ * @return:
+ *      0 on success, 1 if the format is not supported
+ */
+int _deserialize_ix_head( FILE *in, char *ixfile, int *version,
+                          int *root_k, unsigned int *n_descs,
+                          char ***descs ) {
+    // read header, indexes written before it was introduced start straight
+    // with INT_N_DESC_STRINGS
+    char magic[4];
+    *version = IX_FORMAT_VERSION;
+    *root_k = DEFAULT_ROOT_TABLE_K;
+    *n_descs = 0;
+    fread(magic, sizeof(char), 4, in);
+    if (memcmp(magic, IX_FORMAT_MAGIC, 4) == 0) {
+        fread(version, sizeof(int), 1, in);
+        fread(root_k, sizeof(int), 1, in);
+        if (*version == IX_FLAT_FORMAT_VERSION) {
+            printf("ERROR: %s is a flat index, convert it with "
+                   "'gtree ix convert -f stream' first\n", ixfile);
+            return 1;
+        }
+        if ((*version != IX_FORMAT_VERSION
+                    && *version != IX_COMPACT_FORMAT_VERSION
+                    && *version != IX_SHARDED_FORMAT_VERSION)
+                || *root_k < 0 || *root_k > MAX_ROOT_TABLE_K) {
+            printf("ERROR: unsupported index format version %d (k = %d) "
+                   "in %s\n", *version, *root_k, ixfile);
+            return 1;
+        }
+        fread(n_descs, sizeof(unsigned int), 1, in);
+    }
+    else {
+        memcpy(n_descs, magic, sizeof(unsigned int));
+    }
+
+    // read in desc strings
+    *descs = malloc(sizeof(char *) * (*n_descs > 0 ? *n_descs : 1));
+    int i;
+    for (i = 0; i < *n_descs; i++) {
+        // INT_N_LEN
+        size_t desclen;
+        fread(&desclen, sizeof(size_t), 1, in);
+
+        // DESC_STRING
+        (*descs)[i] = malloc(sizeof(char) * (desclen + 1));
+        fread((*descs)[i], sizeof(char), desclen + 1, in);
+    }
+    return 0;
+}
+
+/**
+ * lay out one slot of a flat gtree or loc array, or a block of "n" of them,
+ * the way a node arena hands them out: never straddling two slabs, and
+ * with slot 0 kept free for NULL_NODE and NULL_LOC.
+ */
+uint32_t _flat_alloc( uint32_t *used, int n, int slab_bits ) {
+    uint32_t slab_size = 1U << slab_bits;
+    if ((*used & (slab_size - 1)) + n > slab_size) {
+        *used = (*used + slab_size - 1) & ~(slab_size - 1);
+    }
+    uint32_t id = *used;
+    *used += n;
+    return id;
+}
+
+/**
+ * size of the loc run "init_loc_run" hands out for "n_locs" locs.
+ */
+int _flat_loc_run_size( int n_locs ) {
+    int size = 1;
+    while (size < n_locs) {
+        size <<= 1;
+    }
+    return size;
+}
+
+/**
+ * give every node of the gtree of "ix" a flat id, in pre-order.
+ *
+ * @return:
+ *      the flat ids by node id, which are 0 for ids not in the gtree
+ */
+uint32_t *_flat_node_ids( ix_t *ix, uint32_t *n_flat ) {
+    node_arena_t *arena = ix->arena;
+    size_t n_ids = (size_t) arena->n_slabs << NODE_ARENA_SLAB_BITS;
+    uint32_t *flat = calloc(n_ids, sizeof(uint32_t));
+    // the stack grows as needed, an index read from a file may be deeper
+    // than any window
+    int cap = 4 * (MAX_WINDOW_SIZE + 1) + 1;
+    node_id_t *stack = malloc(sizeof(node_id_t) * cap);
+    int top = 0;
+    *n_flat = 1;
+
+    flat[ix->root] = _flat_alloc(n_flat, 1, NODE_ARENA_SLAB_BITS);
+    stack[0] = ix->root;
+    while (top >= 0) {
+        node_id_t id = stack[top--];
+        gtree_t *node = GTREE_NODE(arena, id);
+        int n_next = GTREE_KIND(node) == GTREE_KIND_PATH ? 1 : 4;
+        int i;
+        for (i = n_next - 1; i >= 0; i--) {
+            node_id_t child = node->next[i];
+            if (child == NULL_NODE) {
+                continue;
+            }
+            flat[child] = _flat_alloc(n_flat, 1, NODE_ARENA_SLAB_BITS);
+            if (++top == cap) {
+                cap *= 2;
+                stack = realloc(stack, sizeof(node_id_t) * cap);
+            }
+            stack[top] = child;
+        }
+    }
+    free(stack);
+    return flat;
+}
+
+int serialize_ix_flat( ix_t *ix, char *outfile ) {
+    FILE *out = fopen(outfile, "w+");
+    if (out == NULL) {
+        printf("ERROR: could not open index file %s for writing\n", outfile);
+        return 1;
+    }
+
+    node_arena_t *arena = ix->arena;
+    uint32_t n_flat;
+    uint32_t *flat = _flat_node_ids(ix, &n_flat);
+
+    // node ids in flat order, NULL_NODE where a slot is left empty
+    uint32_t *by_flat = calloc(n_flat, sizeof(uint32_t));
+    size_t n_ids = (size_t) arena->n_slabs << NODE_ARENA_SLAB_BITS;
+    size_t id;
+    for (id = 1; id < n_ids; id++) {
+        if (flat[id] != 0) {
+            by_flat[flat[id]] = id;
+        }
+    }
+
+    ix_flat_head_t head;
+    ix_section_t sections[IX_FLAT_N_SECTIONS];
+    memset(&head, 0, sizeof(head));
+    memset(sections, 0, sizeof(sections));
+    memcpy(head.magic, IX_FORMAT_MAGIC, 4);
+    head.version = IX_FLAT_FORMAT_VERSION;
+    head.root_k = ix->table->k;
+    head.node_size = sizeof(gtree_t);
+    head.loc_size = sizeof(loc_t);
+    head.slab_bits = NODE_ARENA_SLAB_BITS;
+    head.loc_slab_bits = LOC_ARENA_SLAB_BITS;
+    head.root = flat[ix->root];
+    head.n_descs = ix->n_descs;
+    head.n_sections = IX_FLAT_N_SECTIONS;
+
+    // the section table is filled in once the sections are written
+    fwrite(&head, sizeof(head), 1, out);
+    fwrite(sections, sizeof(sections), 1, out);
+
+    ix_section_t *descs = &sections[0];
+    descs->kind = IX_SECTION_DESCS;
+    descs->offset = ftell(out);
+    descs->count = ix->n_descs;
+    int i;
+    for (i = 0; i < ix->n_descs; i++) {
+        fwrite(ix->descs[i], sizeof(char), strlen(ix->descs[i]) + 1, out);
+    }
+    descs->size = ftell(out) - descs->offset;
+
+    ix_section_t *nodes = &sections[1];
+    nodes->kind = IX_SECTION_NODES;
+    nodes->offset = (ftell(out) + IX_FLAT_ALIGN - 1) & ~(IX_FLAT_ALIGN - 1);
+    nodes->count = n_flat;
+    nodes->size = (uint64_t) n_flat * sizeof(gtree_t);
+    fseek(out, nodes->offset, SEEK_SET);
+
+    // loc runs keep their size class, so that matches may still be added
+    uint32_t n_locs = 1;
+    gtree_t empty;
+    memset(&empty, 0, sizeof(empty));
+    uint32_t f;
+    for (f = 0; f < n_flat; f++) {
+        if (by_flat[f] == NULL_NODE) {
+            fwrite(&empty, sizeof(gtree_t), 1, out);
+            continue;
+        }
+        gtree_t node = *GTREE_NODE(arena, by_flat[f]);
+        node.info &= ~GTREE_SATURATED_FLAG;
+        int n_next = GTREE_KIND(&node) == GTREE_KIND_PATH ? 1 : 4;
+        for (i = 0; i < n_next; i++) {
+            node.next[i] = flat[node.next[i]];
+        }
+        int n_matches = GTREE_N_MATCHES(&node);
+        node.locs = n_matches == 0 ? NULL_LOC
+                        : _flat_alloc(&n_locs, _flat_loc_run_size(n_matches),
+                                      LOC_ARENA_SLAB_BITS);
+        fwrite(&node, sizeof(gtree_t), 1, out);
+    }
+
+    ix_section_t *locs = &sections[2];
+    locs->kind = IX_SECTION_LOCS;
+    locs->offset = (ftell(out) + IX_FLAT_ALIGN - 1) & ~(IX_FLAT_ALIGN - 1);
+    locs->count = n_locs;
+    locs->size = (uint64_t) n_locs * sizeof(loc_t);
+    fseek(out, locs->offset, SEEK_SET);
+
+    // the same walk again, writing out the runs where they were laid out
+    uint32_t n_laid = 1, n_written = 0;
+    loc_t none;
+    none.desc = LOC_NO_DESC;
+    none.pos = 0;
+    for (f = 0; f < n_flat; f++) {
+        if (by_flat[f] == NULL_NODE) {
+            continue;
+        }
+        gtree_t *node = GTREE_NODE(arena, by_flat[f]);
+        int n_matches = GTREE_N_MATCHES(node);
+        if (n_matches == 0) {
+            continue;
+        }
+        int size = _flat_loc_run_size(n_matches);
+        uint32_t run = _flat_alloc(&n_laid, size, LOC_ARENA_SLAB_BITS);
+        for (; n_written < run; n_written++) {
+            fwrite(&none, sizeof(loc_t), 1, out);
+        }
+        for (i = 0; i < size; i++) {
+            fwrite(i < n_matches ? GTREE_LOC(arena, node->locs + i) : &none,
+                   sizeof(loc_t), 1, out);
+        }
+        n_written += size;
+    }
+    for (; n_written < n_locs; n_written++) {
+        fwrite(&none, sizeof(loc_t), 1, out);
+    }
+
+    head.crc = crc32(0L, (const Bytef *) &head, sizeof(head));
+    head.crc = crc32(head.crc, (const Bytef *) sections, sizeof(sections));
+    fseek(out, 0, SEEK_SET);
+    fwrite(&head, sizeof(head), 1, out);
+    fwrite(sections, sizeof(sections), 1, out);
+
+    free(by_flat);
+    free(flat);
+    return _close_ix_file(out, outfile);
+}
+
+/**
+ * check that every one of the "n_nodes" nodes of a flat index only refers
+ * to nodes and locs within it, so that a damaged file cannot send a walk
+ * outside the map.
+ *
+ * @return:
+ *      0 if all ids are in range, 1 otherwise
+ */
+int _check_flat_nodes( const gtree_t *nodes, uint64_t n_nodes,
+                       uint64_t n_locs ) {
+    uint64_t id;
+    int i;
+    for (id = 0; id < n_nodes; id++) {
+        const gtree_t *node = &nodes[id];
+        int kind = GTREE_KIND(node);
+        if (kind >= GTREE_N_KINDS) {
+            return 1;
+        }
+        int n_next = 4;
+        if (kind == GTREE_KIND_PATH) {
+            int len = GTREE_PATH_LEN(node);
+            if (len < 1 || len > MAX_PATH_LEN) {
+                return 1;
+            }
+            n_next = 1;
+        }
+        for (i = 0; i < n_next; i++) {
+            if (node->next[i] >= n_nodes) {
+                return 1;
+            }
+        }
+        int n_matches = GTREE_N_MATCHES(node);
+        if (n_matches > MAX_LOCS_PER_NODE || (n_matches > 0
+                && (node->locs == NULL_LOC
+                    || node->locs + (uint64_t) n_matches > n_locs))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * map the flat index in "ixfile" straight into the arena of a new index.
+ * Pages are copied on write, so the gtree may still be changed in memory.
+ */
+ix_t *_map_ix( char *ixfile ) {
+    int fd = open(ixfile, O_RDONLY);
+    if (fd < 0) {
+        printf("ERROR: could not open index file %s\n", ixfile);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < sizeof(ix_flat_head_t)
+                                + sizeof(ix_section_t) * IX_FLAT_N_SECTIONS) {
+        printf("ERROR: index file %s is truncated\n", ixfile);
+        close(fd);
+        return NULL;
+    }
+    size_t map_len = st.st_size;
+    char *map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                     fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        printf("ERROR: could not map index file %s\n", ixfile);
+        return NULL;
+    }
+
+    ix_flat_head_t head;
+    ix_section_t sections[IX_FLAT_N_SECTIONS];
+    memcpy(&head, map, sizeof(head));
+    memcpy(sections, map + sizeof(head), sizeof(sections));
+    uint32_t crc = head.crc;
+    head.crc = 0;
+    head.crc = crc32(0L, (const Bytef *) &head, sizeof(head));
+    head.crc = crc32(head.crc, (const Bytef *) sections, sizeof(sections));
+    if (head.crc != crc) {
+        printf("ERROR: index file %s is corrupt\n", ixfile);
+        munmap(map, map_len);
+        return NULL;
+    }
+    if (head.node_size != sizeof(gtree_t) || head.loc_size != sizeof(loc_t)
+            || head.slab_bits != NODE_ARENA_SLAB_BITS
+            || head.loc_slab_bits != LOC_ARENA_SLAB_BITS
+            || head.root_k < 0 || head.root_k > MAX_ROOT_TABLE_K
+            || head.n_sections != IX_FLAT_N_SECTIONS) {
+        printf("ERROR: flat index %s was written by an incompatible build\n",
+               ixfile);
+        munmap(map, map_len);
+        return NULL;
+    }
+    int i;
+    for (i = 0; i < IX_FLAT_N_SECTIONS; i++) {
+        ix_section_t *section = &sections[i];
+        if (section->kind != i + 1 || section->offset > map_len
+                || section->size > map_len - section->offset
+                || (section->kind != IX_SECTION_DESCS
+                    && section->offset % IX_FLAT_ALIGN != 0)) {
+            printf("ERROR: index file %s is truncated\n", ixfile);
+            munmap(map, map_len);
+            return NULL;
+        }
+    }
+    ix_section_t *nodes = &sections[IX_SECTION_NODES - 1];
+    ix_section_t *locs = &sections[IX_SECTION_LOCS - 1];
+    if (nodes->count == 0 || head.root >= nodes->count
+            || nodes->size != nodes->count * sizeof(gtree_t)
+            || locs->size != locs->count * sizeof(loc_t)
+            || nodes->count > (uint64_t) NODE_ARENA_MAX_SLABS
+                                * NODE_ARENA_SLAB_SIZE
+            || locs->count > (uint64_t) LOC_ARENA_MAX_SLABS
+                                * LOC_ARENA_SLAB_SIZE) {
+        printf("ERROR: index file %s is corrupt\n", ixfile);
+        munmap(map, map_len);
+        return NULL;
+    }
+
+    ix_t *ix = malloc(sizeof(ix_t));
+    ix->map = map;
+    ix->map_len = map_len;
+    ix->lazy = NULL;
+    ix->root = head.root;
+    ix->table = init_root_table(head.root_k);
+
+    // slabs point into the file, the last one is never allocated from
+    node_arena_t *arena = init_node_arena();
+    arena->n_slabs = (nodes->count + NODE_ARENA_SLAB_SIZE - 1)
+                         >> NODE_ARENA_SLAB_BITS;
+    for (i = 0; i < arena->n_slabs; i++) {
+        arena->slabs[i] = (gtree_t *) (map + nodes->offset)
+                              + ((size_t) i << NODE_ARENA_SLAB_BITS);
+    }
+    arena->n_mapped_slabs = arena->n_slabs;
+    arena->cur_slab = arena->n_slabs - 1;
+    arena->n_loc_slabs = (locs->count + LOC_ARENA_SLAB_SIZE - 1)
+                             >> LOC_ARENA_SLAB_BITS;
+    for (i = 0; i < arena->n_loc_slabs; i++) {
+        arena->loc_slabs[i] = (loc_t *) (map + locs->offset)
+                                  + ((size_t) i << LOC_ARENA_SLAB_BITS);
+    }
+    arena->n_mapped_loc_slabs = arena->n_loc_slabs;
+    arena->cur_loc_slab = arena->n_loc_slabs > 0 ? arena->n_loc_slabs - 1 : 0;
+    ix->arena = arena;
+
+    ix_section_t *descs = &sections[IX_SECTION_DESCS - 1];
+    char *desc = map + descs->offset;
+    char *end = desc + descs->size;
+    ix->n_descs = 0;
+    ix->descs = malloc(sizeof(char *) * (head.n_descs > 0 ? head.n_descs : 1));
+    while (ix->n_descs < head.n_descs && desc < end) {
+        size_t len = strnlen(desc, end - desc);
+        ix->descs[ix->n_descs] = strndup(desc, len);
+        ix->n_descs++;
+        desc += len + 1;
+    }
+    if (ix->n_descs < head.n_descs) {
+        printf("ERROR: index file %s is corrupt\n", ixfile);
+        destroy_ix(ix);
+        return NULL;
+    }
+    return ix;
+}
+
+int verify_ix( ix_t *ix ) {
+    if (ix->map == NULL) {
+        return 0;
+    }
+    // the section table was checked against the file when it was mapped
+    char *map = ix->map;
+    ix_section_t sections[IX_FLAT_N_SECTIONS];
+    memcpy(sections, map + sizeof(ix_flat_head_t), sizeof(sections));
+    ix_section_t *nodes = &sections[IX_SECTION_NODES - 1];
+    ix_section_t *locs = &sections[IX_SECTION_LOCS - 1];
+    return _check_flat_nodes((gtree_t *) (map + nodes->offset),
+                             nodes->count, locs->count);
+}
+
+ix_t *deserialize_ix( char *ixfile ) {
+    return deserialize_ix_threaded(ixfile, 1);
+}
+
+ix_t *deserialize_ix_threaded( char *ixfile, int n_threads ) {
+
+    FILE *in = fopen(ixfile, "r");
+    if (in == NULL) {
+        printf("ERROR: could not open index file %s\n", ixfile);
+        return NULL;
+    }
+
+    // flat indexes are mapped rather than read
+    char magic[4];
+    int version = 0;
+    if (fread(magic, sizeof(char), 4, in) == 4
+            && memcmp(magic, IX_FORMAT_MAGIC, 4) == 0
+            && fread(&version, sizeof(int), 1, in) == 1
+            && version == IX_FLAT_FORMAT_VERSION) {
+        fclose(in);
+        return _map_ix(ixfile);
+    }
+    rewind(in);
+
+    int root_k;
+    unsigned int n_descs;
+    char **descs;
+    if (_deserialize_ix_head(in, ixfile, &version, &root_k, &n_descs,
+                             &descs) != 0) {
+        fclose(in);
+        return NULL;
+    }
+
+    ix_t *ix = init_ix(root_k);
+    free(ix->descs);
+    ix->n_descs = n_descs;
+    ix->descs = descs;
+
+    // read gtree
+    // required since init_ix() alloc's a node, hand it back for reuse
+    destroy_gtree(ix->arena, ix->root);
+    ix_in_t buffered;
+    int err;
+    if (version == IX_SHARDED_FORMAT_VERSION) {
+        err = _deserialize_ix_sharded(in, ixfile, ix, n_threads);
+    }
+    else {
+        int compact = version == IX_COMPACT_FORMAT_VERSION;
+        _ix_in_open(&buffered, in, compact);
+        err = compact ? _deserialize_gtree_compact(&buffered, ix, &ix->root)
+                      : _deserialize_gtree(&buffered, ix->arena,
+                                           ix->table->k, &ix->root);
+        _ix_in_close(&buffered);
+    }
+    fclose(in);
+    if (err) {
+        printf("ERROR: index file %s is truncated or corrupt\n", ixfile);
+        ix->root = NULL_NODE;
+        destroy_ix(ix);
+        return NULL;
+    }
+
+    return ix;
+}
+
+/**
+ * bytes of the arena of a lazy index held by the shards read in, along with
+ * any matches masking has added above them since it was opened.
+ */
+long _lazy_resident( ix_lazy_t *lazy ) {
+    return lazy->arena->n_bytes - lazy->top_bytes;
+}
+
+/**
+ * read shard "i" of a lazy index into the node standing in for it, from
+ * the index file or, once evicted, the spill file.
+ *
+ * @return:
+ *      0 on success, 1 if the shard ends early or is corrupt
+ */
+int _read_lazy_shard( ix_lazy_t *lazy, int i ) {
+    node_arena_t *arena = lazy->arena;
+    ix_shard_t *shard = &lazy->shards[i];
+    ix_in_t *in = &lazy->in;
+
+    in->in = lazy->spilled[i] ? lazy->spill : lazy->file;
+    in->len = 0;
+    in->pos = 0;
+    in->limit = shard->size;
+    fseek(in->in, shard->offset, SEEK_SET);
+    node_id_t root;
+    // a shard must take up exactly the bytes its table entry says
+    if (_deserialize_gtree(in, arena, lazy->fold_below, &root) != 0
+            || root == NULL_NODE || in->limit != 0 || in->pos != in->len) {
+        return 1;
+    }
+
+    // move the root of the shard into the stand-in, which its parent links
+    // to, and hand back the slot it was read into
+    gtree_t *node = GTREE_NODE(arena, shard->root);
+    gtree_t *read = GTREE_NODE(arena, root);
+    *node = *read;
+    read->info = 0;
+    read->next[0] = read->next[1] = read->next[2] = read->next[3] = NULL_NODE;
+    destroy_gtree(arena, root);
+
+    node->info |= GTREE_SHARD_FLAG;
+
+    lazy->n_reads++;
+    return 0;
+}
+
+/**
+ * set aside "n_bytes" of the spill file of a lazy index, in the first
+ * stretch no shard holds that is long enough, or else at its end.
+ *
+ * @return:
+ *      the offset of the bytes set aside
+ */
+int64_t _take_spill_room( ix_lazy_t *lazy, int64_t n_bytes ) {
+    int64_t *free_room = lazy->spill_free;
+    int k;
+    for (k = 0; k < lazy->n_spill_free; k++) {
+        if (free_room[2 * k + 1] < n_bytes) {
+            continue;
+        }
+        int64_t offset = free_room[2 * k];
+        free_room[2 * k] += n_bytes;
+        free_room[2 * k + 1] -= n_bytes;
+        if (free_room[2 * k + 1] == 0) {
+            lazy->n_spill_free--;
+            memmove(free_room + 2 * k, free_room + 2 * k + 2,
+                    sizeof(int64_t) * 2 * (lazy->n_spill_free - k));
+        }
+        return offset;
+    }
+
+    int64_t offset = lazy->spill_end;
+    lazy->spill_end += n_bytes;
+    return offset;
+}
+
+/**
+ * hand back the "n_bytes" at "offset" of the spill file of a lazy index,
+ * merged with the free stretches either side of them.
+ */
+void _give_spill_room( ix_lazy_t *lazy, int64_t offset, int64_t n_bytes ) {
+    int64_t *free_room = lazy->spill_free;
+    int k = 0;
+    while (k < lazy->n_spill_free && free_room[2 * k] < offset) {
+        k++;
+    }
+
+    if (k > 0 && free_room[2 * k - 2] + free_room[2 * k - 1] == offset) {
+        // grow the stretch before
+        k--;
+        free_room[2 * k + 1] += n_bytes;
+    }
+    else {
+        memmove(free_room + 2 * k + 2, free_room + 2 * k,
+                sizeof(int64_t) * 2 * (lazy->n_spill_free - k));
+        free_room[2 * k] = offset;
+        free_room[2 * k + 1] = n_bytes;
+        lazy->n_spill_free++;
+    }
+    if (k + 1 < lazy->n_spill_free
+            && free_room[2 * k] + free_room[2 * k + 1]
+                == free_room[2 * k + 2]) {
+        // and take in the stretch after
+        free_room[2 * k + 1] += free_room[2 * k + 3];
+        lazy->n_spill_free--;
+        memmove(free_room + 2 * k + 2, free_room + 2 * k + 4,
+                sizeof(int64_t) * 2 * (lazy->n_spill_free - k - 1));
+    }
+
+    // a free stretch at the end is written over like any new one
+    k = lazy->n_spill_free - 1;
+    if (k >= 0 && free_room[2 * k] + free_room[2 * k + 1] == lazy->spill_end) {
+        lazy->spill_end = free_room[2 * k];
+        lazy->n_spill_free--;
+    }
+}
+
+/**
+ * chain shard "i" of a lazy index in as the one walked into latest, or take
+ * it out of the chain again.
+ */
+void _chain_lazy_shard( ix_lazy_t *lazy, int i ) {
+    lazy->older[i] = lazy->newest;
+    lazy->newer[i] = -1;
+    if (lazy->newest >= 0) {
+        lazy->newer[lazy->newest] = i;
+    }
+    else {
+        lazy->oldest = i;
+    }
+    lazy->newest = i;
+    lazy->n_read_in++;
+}
+
+void _unchain_lazy_shard( ix_lazy_t *lazy, int i ) {
+    if (lazy->older[i] >= 0) {
+        lazy->newer[lazy->older[i]] = lazy->newer[i];
+    }
+    else {
+        lazy->oldest = lazy->newer[i];
+    }
+    if (lazy->newer[i] >= 0) {
+        lazy->older[lazy->newer[i]] = lazy->older[i];
+    }
+    else {
+        lazy->newest = lazy->older[i];
+    }
+    lazy->n_read_in--;
+}
+
+/**
+ * write the shard of a lazy index walked into least recently to the spill
+ * file, and put a stand-in back in its place.
+ *
+ * @return:
+ *      0 on success, 1 if the spill file cannot be written
+ */
+int _evict_lazy_shard( ix_lazy_t *lazy ) {
+    node_arena_t *arena = lazy->arena;
+    if (lazy->spill == NULL && (lazy->spill = tmpfile()) == NULL) {
+        printf("ERROR: could not open a spill file for the lazy index\n");
+        return 1;
+    }
+
+    int i = lazy->oldest;
+    ix_shard_t *shard = &lazy->shards[i];
+
+    // masking changes the shards it reads, so they are written back as they
+    // are now, over their last copy in the spill file if they still fit
+    char *bytes;
+    size_t n_bytes;
+    FILE *mem = open_memstream(&bytes, &n_bytes);
+    if (mem == NULL) {
+        printf("ERROR: could not write back a shard of the lazy index\n");
+        return 1;
+    }
+    ix_out_t out;
+    _ix_out_open(&out, mem, 1 << 16, -1);
+    _serialize_gtree(arena, shard->root, 0, &out, lazy->n_descs);
+    _ix_out_close(&out);
+    fclose(mem);
+
+    int64_t offset = shard->offset;
+    if (!lazy->spilled[i] || n_bytes > lazy->spill_room[i]) {
+        if (lazy->spilled[i]) {
+            _give_spill_room(lazy, shard->offset, lazy->spill_room[i]);
+        }
+        offset = _take_spill_room(lazy, n_bytes);
+        lazy->spill_room[i] = n_bytes;
+    }
+    fseek(lazy->spill, offset, SEEK_SET);
+    int err = fwrite(bytes, sizeof(char), n_bytes, lazy->spill) != n_bytes;
+    free(bytes);
+    if (err) {
+        printf("ERROR: could not write back a shard of the lazy index\n");
+        return 1;
+    }
+    shard->offset = offset;
+    shard->size = n_bytes;
+    lazy->spilled[i] = 1;
+    _unchain_lazy_shard(lazy, i);
+
+    // release the subtree through a copy of its root, as the stand-in keeps
+    // the slot its parent links to
+    node_id_t copy = init_gtree_node(arena);
+    gtree_t *node = GTREE_NODE(arena, shard->root);
+    *GTREE_NODE(arena, copy) = *node;
+    destroy_gtree(arena, copy);
+    node->info = GTREE_LAZY_FLAG;
+    node->locs = i;
+    node->next[0] = node->next[1] = node->next[2] = node->next[3] = NULL_NODE;
+
+    // the root table may point into the shard, and fills up again as it is
+    // walked
+    reset_root_table_prefix(lazy->table, lazy->kmers[i], lazy->shard_depth);
+
+    lazy->n_evictions++;
+    return 0;
+}
+
+/**
+ * the shard of a lazy index whose root is node "id". Stand-ins are handed
+ * out in order of their shards, so that their ids are too.
+ */
+int _find_lazy_shard( ix_lazy_t *lazy, node_id_t id ) {
+    int lo = 0, hi = lazy->n_shards - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (lazy->shards[mid].root < id) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * fault of the arena of a lazy index: read in the shard that node "id"
+ * stands in for, or note a walk into the shard "id" is the root of, then
+ * evict the shards walked into least recently for as long as those held
+ * exceed the memory limit.
+ */
+void _fault_lazy_shard( void *ctx, node_id_t id ) {
+    ix_lazy_t *lazy = ctx;
+    gtree_t *node = GTREE_NODE(lazy->arena, id);
+    int i;
+
+    if (GTREE_LAZY(node)) {
+        i = node->locs;
+        if (_read_lazy_shard(lazy, i) != 0) {
+            printf("ERROR: shard %d of the lazy index is truncated or "
+                   "corrupt\n", i);
+            lazy->err = 1;
+            // walk on as if the shard were empty, the index is not written
+            // out
+            node->info = 0;
+            node->locs = NULL_LOC;
+            return;
+        }
+    }
+    else {
+        i = _find_lazy_shard(lazy, id);
+        _unchain_lazy_shard(lazy, i);
+    }
+    _chain_lazy_shard(lazy, i);
+
+    // the shard just walked into stays, even on its own over the limit. As
+    // masking adds matches to the shards held, the limit is checked again
+    // on every walk.
+    while (lazy->mem_limit > 0 && _lazy_resident(lazy) > lazy->mem_limit
+            && lazy->n_read_in > 1) {
+        if (_evict_lazy_shard(lazy) != 0) {
+            lazy->mem_limit = 0;
+        }
+    }
+    if (_lazy_resident(lazy) > lazy->peak_resident) {
+        lazy->peak_resident = _lazy_resident(lazy);
+    }
+}
+
+/**
+ * take down the leading bases of each shard under the plain node "id" of a
+ * lazy index, which is reached by "kmer".
+ */
+void _find_lazy_kmers( ix_lazy_t *lazy, node_id_t id, uint32_t kmer ) {
+    if (id == NULL_NODE) {
+        return;
+    }
+    gtree_t *node = GTREE_NODE(lazy->arena, id);
+    if (GTREE_LAZY(node)) {
+        lazy->kmers[node->locs] = kmer;
+        return;
+    }
+    int i;
+    for (i = 0; i < 4; i++) {
+        _find_lazy_kmers(lazy, node->next[i], (kmer << 2) | i);
+    }
+}
+
+ix_t *open_ix_lazy( char *ixfile, long mem_limit ) {
+    FILE *in = fopen(ixfile, "r");
+    if (in == NULL) {
+        printf("ERROR: could not open index file %s\n", ixfile);
+        return NULL;
+    }
+
+    int version, root_k;
+    unsigned int n_descs;
+    char **descs;
+    if (_deserialize_ix_head(in, ixfile, &version, &root_k, &n_descs,
+                             &descs) != 0) {
+        fclose(in);
+        return NULL;
+    }
+
+    ix_t *ix = init_ix(root_k);
+    free(ix->descs);
+    ix->n_descs = n_descs;
+    ix->descs = descs;
+    if (version != IX_SHARDED_FORMAT_VERSION) {
+        printf("ERROR: %s is not a sharded index, convert it with "
+               "'gtree ix convert -f sharded' first\n", ixfile);
+        fclose(in);
+        destroy_ix(ix);
+        return NULL;
+    }
+
+    // read no more than the gtree above the shards
+    destroy_gtree(ix->arena, ix->root);
+    shard_pool_t pool;
+    if (_deserialize_shard_table(in, ixfile, ix, &pool) != 0) {
+        printf("ERROR: index file %s is truncated or corrupt\n", ixfile);
+        fclose(in);
+        ix->root = NULL_NODE;
+        destroy_ix(ix);
+        return NULL;
+    }
+
+    ix_lazy_t *lazy = malloc(sizeof(ix_lazy_t));
+    int n = pool.n_shards > 0 ? pool.n_shards : 1;
+    lazy->file = in;
+    lazy->spill = NULL;
+    _ix_in_open(&lazy->in, in, 0);
+    lazy->shards = pool.shards;
+    lazy->spilled = calloc(n, sizeof(char));
+    lazy->spill_room = calloc(n, sizeof(int64_t));
+    // shards held apart by free stretches take up all but one of them
+    lazy->spill_free = malloc(sizeof(int64_t) * 2 * (n + 1));
+    lazy->n_spill_free = 0;
+    lazy->spill_end = 0;
+    lazy->kmers = calloc(n, sizeof(uint32_t));
+    lazy->n_shards = pool.n_shards;
+    lazy->shard_depth = pool.shard_depth;
+    lazy->fold_below = pool.fold_below;
+    lazy->newer = malloc(sizeof(int) * n);
+    lazy->older = malloc(sizeof(int) * n);
+    lazy->oldest = -1;
+    lazy->newest = -1;
+    lazy->n_read_in = 0;
+    lazy->mem_limit = mem_limit;
+    lazy->peak_resident = 0;
+    lazy->n_reads = 0;
+    lazy->n_evictions = 0;
+    lazy->arena = ix->arena;
+    lazy->table = ix->table;
+    lazy->n_descs = n_descs;
+    lazy->err = 0;
+    ix->lazy = lazy;
+    ix->arena->fault = _fault_lazy_shard;
+    ix->arena->fault_ctx = lazy;
+
+    // hang a stand-in off where each shard goes. The nodes above are left
+    // plain, so that the stand-ins keep their ids. They are taken straight
+    // off the slabs, so that their ids go up with their shards.
+    int i;
+    for (i = 0; i < lazy->n_shards; i++) {
+        ix_shard_t *shard = &lazy->shards[i];
+        shard->root = init_gtree_block(ix->arena, 1);
+        gtree_t *node = GTREE_NODE(ix->arena, shard->root);
+        node->info = GTREE_LAZY_FLAG;
+        node->locs = i;
+        node->next[0] = node->next[1] = node->next[2] = node->next[3] =
+            NULL_NODE;
+        if (shard->parent == NULL_NODE) {
+            ix->root = shard->root;
+        }
+        else {
+            GTREE_NODE(ix->arena, shard->parent)->next[shard->slot] =
+                shard->root;
+        }
+    }
+    _find_lazy_kmers(lazy, ix->root, 0);
+    lazy->top_bytes = ix->arena->n_bytes;
+
+    // an index that is a single shard has to be read in whole, and is
+    // never evicted
+    if (ix->root != NULL_NODE && GTREE_LAZY(GTREE_NODE(ix->arena, ix->root))
+            && _read_lazy_shard(lazy, 0) != 0) {
+        printf("ERROR: index file %s is truncated or corrupt\n", ixfile);
+        destroy_ix(ix);
+        return NULL;
+    }
+    return ix;
+}
+
+long prune_ix_stream( char *ixfile, char *outfile ) {
+    FILE *in = fopen(ixfile, "r");
+    if (in == NULL) {
+        printf("ERROR: could not open index file %s\n", ixfile);
+        return -1;
+    }
+
+    int version, root_k;
+    unsigned int n_descs;
+    char **descs;
+    if (_deserialize_ix_head(in, ixfile, &version, &root_k, &n_descs,
+                             &descs) != 0) {
+        fclose(in);
+        return -1;
+    }
+    int i;
+    if (version != IX_FORMAT_VERSION) {
+        printf("ERROR: %s is not a stream index, convert it with "
+               "'gtree ix convert -f stream' first\n", ixfile);
+        for (i = 0; i < n_descs; i++) {
+            free(descs[i]);
+        }
+        free(descs);
+        fclose(in);
+        return -1;
+    }
+
+    FILE *file = fopen(outfile, "w+");
+    if (file == NULL) {
+        printf("ERROR: could not open index file %s for writing\n", outfile);
+        fclose(in);
+        return -1;
+    }
+    _serialize_ix_head(IX_FORMAT_VERSION, root_k, n_descs, descs,
+                       file);
+    for (i = 0; i < n_descs; i++) {
+        free(descs[i]);
+    }
+    free(descs);
+    ix_out_t out;
+    _ix_out_open(&out, file, PRUNE_STREAM_BUF_SIZE, -1);
+
+    // the nodes whose children are being streamed, root first. Each is
+    // pruned as in prune_gtree once its four children are through, before
+    // its locs, by taking back its only child if that adds nothing.
+    prune_frame_t stack[MAX_WINDOW_SIZE + 1];
+    int top = -1;
+    long n_nodes = -1;
+    char zeros[4] = { 0 };
+
+    while (n_nodes < 0) {
+        long off = out.flushed + out.len;
+        // nodes are mostly a byte or three, read without locking the stream
+        char head[3];
+        int c = getc_unlocked(in);
+        head[0] = c;
+        if (c != EOF && head[0]) {
+            head[1] = getc_unlocked(in);
+            c = getc_unlocked(in);
+            head[2] = c;
+        }
+        if (c == EOF) {
+            printf("ERROR: index file %s ends early\n", ixfile);
+            break;
+        }
+
+        if (head[0]) {
+            if (top == MAX_WINDOW_SIZE) {
+                printf("ERROR: gtree in index file %s is too deep\n",
+                       ixfile);
+                break;
+            }
+            _ix_out_write(&out, head, 3);
+            prune_frame_t *frame = &stack[++top];
+            frame->too_full = head[1];
+            frame->n_matches = head[2];
+            frame->next = 0;
+            frame->n_children = 0;
+            frame->below = INT_MAX;
+            frame->n_nodes = 1;
+            frame->off = off;
+            continue;
+        }
+        _ix_out_write(&out, head, 1);
+        if (top < 0) {
+            n_nodes = 0;
+            break;
+        }
+        stack[top].next++;
+
+        // finish every node whose children are all through
+        while (top >= 0 && stack[top].next == 4) {
+            prune_frame_t *frame = &stack[top];
+            if (!frame->too_full && frame->n_children == 1
+                    && frame->n_matches == frame->child_matches
+                    && frame->child_matches == frame->below) {
+                _ix_out_rewind(&out, frame->child_off);
+                _ix_out_write(&out, zeros, 4 - frame->first_child);
+                frame->n_nodes -= frame->child_nodes;
+            }
+
+            for (i = 0; i < frame->n_matches; i++) {
+                char loc[sizeof(int) + sizeof(long)];
+                if (fread(loc, sizeof(loc), 1, in) != 1) {
+                    break;
+                }
+                _ix_out_write(&out, loc, sizeof(loc));
+            }
+            if (i < frame->n_matches) {
+                top = -2;
+                break;
+            }
+
+            int fewest = frame->too_full ? INT_MAX : frame->n_matches;
+            if (frame->below < fewest) {
+                fewest = frame->below;
+            }
+            top--;
+            if (top < 0) {
+                n_nodes = frame->n_nodes;
+                break;
+            }
+
+            prune_frame_t *parent = &stack[top];
+            if (parent->n_children == 0) {
+                parent->first_child = parent->next;
+                parent->child_off = frame->off;
+                parent->child_matches = frame->n_matches;
+                parent->child_nodes = frame->n_nodes;
+            }
+            parent->n_children++;
+            parent->next++;
+            parent->n_nodes += frame->n_nodes;
+            if (fewest < parent->below) {
+                parent->below = fewest;
+            }
+        }
+        if (top == -2) {
+            printf("ERROR: index file %s ends early\n", ixfile);
+            break;
+        }
+    }
+
+    long end = out.flushed + out.len;
+    _ix_out_close(&out);
+    if (n_nodes >= 0) {
+        // whatever was taken back past the end is cut off
+        if (fflush(file) != 0 || ferror(file)
+                || ftruncate(fileno(file), end) != 0) {
+            printf("ERROR: could not write index file %s\n", outfile);
+            n_nodes = -1;
+        }
+    }
+
+    fclose(file);
+    fclose(in);
+    return n_nodes;
+}
+
+void print_ix_info( ix_t *ix ) {
+    printf("printing index info:\n");
+    printf("number of nodes: %ld\n", count_gtree_nodes(ix->arena, ix->root));
+    long kinds[GTREE_N_KINDS] = { 0 };
+    count_gtree_kinds(ix->arena, ix->root, kinds);
+    printf("node kinds: node4 %ld, path %ld\n",
+           kinds[GTREE_KIND_NODE4], kinds[GTREE_KIND_PATH]);
+    if (ix->lazy != NULL) {
+        // stand-ins for the shards not read in count as a node each
+        printf("lazy shards: %d, %ld reads, %ld evictions, "
+               "%ld bytes resident, %ld at most\n", ix->lazy->n_shards,
+               ix->lazy->n_reads, ix->lazy->n_evictions,
+               _lazy_resident(ix->lazy), ix->lazy->peak_resident);
+    }
+    printf("root table k: %d\n", ix->table->k);
     printf("n_descs: %u\n", ix->n_descs);
 
     int i;
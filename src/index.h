@@ -13,13 +13,16 @@
  * malloc all structures to be used by the gtree index. Specifically, any
  * additional descriptions will require a realloc() of the descs pointer
  *
+ * @args:
+ *      root_k - number of leading bases covered by the root table, 0 for none
  * @return:
  *      pointer to an allocated an initialized ix_t structure.
  */
-ix_t *init_ix();
+ix_t *init_ix( int root_k );
 
 /**
- * free all structures used by "ix"
+ * free all structures used by "ix". gtree nodes are released in bulk with
+ * the node arena that owns them.
  *
  * @args:
  *      ix - the gtree index to be free'd
@@ -40,6 +43,10 @@ int destroy_ix( ix_t *ix );
  *           DESC_STRING (x INT_N_DESC_STRINGS)
  *           GTREE_NODE
  *
+ * HEADER := CHAR (x 4)           # IX_FORMAT_MAGIC
+ *           INT_VERSION          # IX_FORMAT_VERSION
+ *           INT_ROOT_K           # bases covered by the root table
+ *
  * DESC_STRING := INT_N_LEN
  *                CHAR (x INT_N_LEN)
  *
@@ -53,6 +60,9 @@ int destroy_ix( ix_t *ix );
  *               GTREE_NODE       # G
  *               LOC_STRUCT (x INT_N_MATCHES)
  *
+ * LOC_STRUCT := INT_DESC_ID      # index into DESC_STRINGs, -1 if none
+ *               LONG_POS
+ *
  * @args:
  *      ix - a pointer to the index to be serialized
  *      outfile - the name of the file to serialize the tree to
@@ -62,9 +72,151 @@ int destroy_ix( ix_t *ix );
  */
 int serialize_ix( ix_t *ix, char *outfile );
 
+/**
+ * serialize "ix" compactly: the gtree of "serialize_ix" with bit-packed node
+ * heads and varint locs, cut into blocks of IX_IO_BUF_SIZE bytes that are
+ * each compressed with zlib.
+ *
+ * on-disk format:
+ *
+ * IX_COMPACT := HEADER           # INT_VERSION IX_COMPACT_FORMAT_VERSION
+ *               INT_N_DESC_STRINGS
+ *               DESC_STRING (x INT_N_DESC_STRINGS)
+ *               BLOCK (...)      # together holding HAS_ROOT and the
+ *                                # COMPACT_NODEs
+ *               UINT_RAW_LEN     # 0, ends the gtree
+ *               UINT_STORED_LEN  # 0
+ *
+ * BLOCK := UINT_RAW_LEN
+ *          UINT_STORED_LEN       # RAW_LEN if the block is stored as it is
+ *          CHAR (x UINT_STORED_LEN)
+ *
+ * HAS_ROOT := CHAR               # non-zero if COMPACT_NODEs follow
+ *
+ * COMPACT_NODE := CHAR_HEAD      # child mask in bits 0-3, then
+ *                                # IX_COMPACT_TOO_FULL, IX_COMPACT_SAME and
+ *                                # N_MATCHES up to IX_COMPACT_N_MATCHES_MAX
+ *                 VARINT         # N_MATCHES - IX_COMPACT_N_MATCHES_MAX,
+ *                                # only if N_MATCHES is at the max
+ *                 COMPACT_LOC (x N_MATCHES)
+ *                 COMPACT_NODE (x children in the mask)
+ *
+ *                 # a node with IX_COMPACT_SAME set has the TOO_FULL flag,
+ *                 # N_MATCHES and locs of its parent, and none of its own
+ *
+ * COMPACT_LOC := VARINT_DESC     # 0 if on the sequence of the loc before,
+ *                                # 1 if none, else index into DESC_STRINGs
+ *                                # + 2
+ *                VARINT_POS      # zigzag encoded, less the position of the
+ *                                # loc before if VARINT_DESC is 0
+ *
+ * @args:
+ *      ix - a pointer to the index to be serialized
+ *      outfile - the name of the file to serialize the tree to
+ *      level - zlib level to compress blocks at, 0 to store them as they are
+ * @return:
+ *      0        on succcess
+ *      errcode  otherwise
+ */
+int serialize_ix_compact( ix_t *ix, char *outfile, int level );
+
+/**
+ * serialize "ix" as "serialize_ix" does, but with the gtree cut
+ * "shard_depth" bases down into shards, subtrees with an entry each in an
+ * offset table, so that "deserialize_ix_threaded" reads them in parallel.
+ *
+ * on-disk format:
+ *
+ * IX_SHARDED := HEADER           # INT_VERSION IX_SHARDED_FORMAT_VERSION
+ *               INT_N_DESC_STRINGS
+ *               DESC_STRING (x INT_N_DESC_STRINGS)
+ *               INT_SHARD_DEPTH
+ *               INT_N_SHARDS
+ *               SHARD_ENTRY (x INT_N_SHARDS)
+ *               TOP_NODE         # the gtree down to INT_SHARD_DEPTH bases
+ *               GTREE_NODE (x INT_N_SHARDS)
+ *
+ * SHARD_ENTRY := LONG_OFFSET     # of the shard's GTREE_NODE in the file
+ *                LONG_SIZE       # in bytes
+ *
+ * TOP_NODE := GTREE_NODE         # above INT_SHARD_DEPTH bases, with
+ *                                # TOP_NODE children
+ *           | IX_SHARD_MARK      # INT_SHARD_DEPTH bases down, the next
+ *                                # shard hangs off here
+ *           | NULL
+ *
+ * @args:
+ *      ix - a pointer to the index to be serialized
+ *      outfile - the name of the file to serialize the tree to
+ *      shard_depth - number of leading bases the shards are split by
+ * @return:
+ *      0        on succcess
+ *      errcode  otherwise
+ */
+int serialize_ix_sharded( ix_t *ix, char *outfile, int shard_depth );
+
+/**
+ * serialize "ix" into a flat file whose gtree is laid out exactly as node
+ * arena slabs are held in memory, so that "deserialize_ix" maps it in place
+ * instead of reading it node by node. Such files are only portable between
+ * builds with the same gtree_t and loc_t layouts and slab sizes.
+ *
+ * on-disk format:
+ *
+ * IX_FLAT := IX_FLAT_HEAD        # ix_flat_head_t, version
+ *                                # IX_FLAT_FORMAT_VERSION
+ *            IX_SECTION (x IX_FLAT_N_SECTIONS)
+ *            DESCS               # NUL terminated desc strings
+ *            NODES               # gtree_t (x count), node ids as in memory,
+ *                                # slot 0 and slots past the end of a slab
+ *                                # left empty
+ *            LOCS                # loc_t (x count), loc runs keep their size
+ *                                # class, slot 0 left empty
+ *
+ * IX_SECTION := ix_section_t     # kind, offset and size of a section, the
+ *                                # NODES and LOCS ones IX_FLAT_ALIGN aligned
+ *
+ * The crc of the head covers the head and section table only. The NODES
+ * section is instead scanned once as it is mapped, and rejected as corrupt
+ * if any node refers to a node or loc past the end of its section.
+ *
+ * @args:
+ *      ix - a pointer to the index to be serialized
+ *      outfile - the name of the file to serialize the tree to
+ * @return:
+ *      0        on succcess
+ *      errcode  otherwise
+ */
+int serialize_ix_flat( ix_t *ix, char *outfile );
+
+/**
+ * serialize "ix" in the format of "serialize_ix", without ever holding the
+ * whole gtree in memory. The gtree of "ix" only reaches "bucket_depth" bases
+ * down; the full subtree under each node at that depth is handed over by
+ * "loader" as it comes up in the file, written out, and released.
+ *
+ * @args:
+ *      ix - the index to be serialized, with plain nodes down to
+ *           "bucket_depth" bases
+ *      outfile - the name of the file to serialize the tree to
+ *      bucket_depth - number of leading bases the buckets are split by
+ *      loader - hands over the subtree of each bucket in k-mer order
+ *      ctx - passed on to "loader"
+ * @return:
+ *      0        on succcess
+ *      errcode  otherwise
+ */
+int serialize_ix_by_bucket( ix_t *ix, char *outfile, int bucket_depth,
+                            bucket_loader_t loader, void *ctx );
+
 /**
  * deserialize a gtree index stored with "serialize_gtree" into an in-memory
- * representation.
+ * representation. Indexes written without a HEADER are still accepted, and
+ * get a root table of DEFAULT_ROOT_TABLE_K bases, and compact ones written
+ * with "serialize_ix_compact" are decoded as they are read. Flat indexes
+ * written with "serialize_ix_flat" are mapped privately, pages are only read
+ * as the gtree is walked and only copied once changed. Their nodes are left
+ * to "verify_ix" to check, which reads every page.
  * 
  * @args:
  *      ixfile - the name of the file to read an index from.
@@ -76,6 +228,76 @@ int serialize_ix( ix_t *ix, char *outfile );
  */
 ix_t *deserialize_ix( char *ixfile );
 
+/**
+ * check every node of an index just mapped from a flat file, which is only
+ * checked as far as its header and section table when it is loaded: each
+ * node must only refer to nodes and locs within the file, so that no walk
+ * can leave the map. Indexes read in any other format are checked as they
+ * are read, and always pass.
+ *
+ * @args:
+ *      ix - an index returned by "deserialize_ix", before it is changed
+ *
+ * @return:
+ *      0 if the gtree is sound, 1 if the file is corrupt
+ */
+int verify_ix( ix_t *ix );
+
+/**
+ * deserialize a gtree index as "deserialize_ix" does, reading the shards of
+ * an index written with "serialize_ix_sharded" on "n_threads" threads, each
+ * into an arena shared with that of the index. Other formats are read on
+ * the calling thread.
+ *
+ * @args:
+ *      ixfile - the name of the file to read an index from.
+ *      n_threads - number of threads to read shards on
+ *
+ * @return:
+ *      a pointer to the deserialized index, to be freed with "destroy_ix"
+ *      NULL if there is an error during index deserialization
+ */
+ix_t *deserialize_ix_threaded( char *ixfile, int n_threads );
+
+/**
+ * open the sharded index "ixfile" lazily: only the gtree above the shards is
+ * read, with a stand-in node where each shard hangs off. A shard is read in
+ * the first time a gtree cursor enters its stand-in, and once the shards
+ * held take up more than "mem_limit" bytes of the arena, those walked into
+ * least recently are written to a spill file and put back behind a
+ * stand-in. Space in the spill file is reused as shards move.
+ *
+ * Only walks by gtree cursor, as "mask_gtree" makes on one thread, read
+ * shards in. "serialize_ix" copies the shards never read over as they are,
+ * and the other writers must not be handed a lazy index.
+ *
+ * @args:
+ *      ixfile - the name of the file to read an index from.
+ *      mem_limit - bytes of shards to keep in memory, 0 for no limit
+ *
+ * @return:
+ *      a pointer to the index, to be freed with "destroy_ix", which keeps
+ *          "ixfile" open until then
+ *      NULL if "ixfile" is not a sharded index or cannot be read
+ */
+ix_t *open_ix_lazy( char *ixfile, long mem_limit );
+
+/**
+ * prune the index in "ixfile" as "prune_gtree" would, writing the result to
+ * "outfile" in a single pass over the serialized gtree. Only the nodes on
+ * the way down to the current one are held in memory, along with the last
+ * PRUNE_STREAM_BUF_SIZE bytes written, which may still be taken back when
+ * a subtree turns out to add nothing.
+ *
+ * @args:
+ *      ixfile - the name of the file to read an index from
+ *      outfile - the name of the file to write the pruned index to
+ * @return:
+ *      the number of nodes in the pruned gtree
+ *      -1 if the index could not be read or written
+ */
+long prune_ix_stream( char *ixfile, char *outfile );
+
 /**
  * prints some information about the gtree index supplied to STDOUT
  *
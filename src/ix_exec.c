@@ -22,34 +22,229 @@
 "\n"\
 "# INDEX BUILD \n"\
 "    Usage: gtree ix build\n"\
-"        -r [path]                 reference sequence FASTA filename\n"\
+"        -r [path]                 reference sequence FASTA filename, plain\n"\
+"                                  or gzip/BGZF compressed\n"\
 "        -o [path]                 prebuilt index path for alignment\n"\
+"        -k [int]                  number of leading bases to look up in a\n"\
+"                                  4^k root table, 0 to disable (default 10)\n"\
+"        -t [int]                  number of threads to build with (default 1)\n"\
+"        --bulk                    build by sorting all windows at once, faster\n"\
+"                                  but needs 32 bytes of memory per base\n"\
+"        --mem-limit [size]        build out of core, through spill files next\n"\
+"                                  to the output, keeping the gtree within\n"\
+"                                  about [size] bytes (suffix K, M or G)\n"\
+"        --prune                   prune the index while building it, as\n"\
+"                                  'gtree ix prune' would afterwards\n"\
 "\n"\
 "# INDEX MASK \n"\
 "    Usage: gtree ix mask\n"\
 "        -ix [path]                pre-built index to be masked for\n"\
 "                                  selectivity\n"\
-"        -r [path]                 reference sequence FASTA filename\n"\
+"        -r [path]                 reference sequence FASTA filename, plain\n"\
+"                                  or gzip/BGZF compressed, may be repeated\n"\
+"        -rl [path]                file listing reference FASTA filenames to\n"\
+"                                  mask against, one per line\n"\
 "        -o [path]                 prebuilt index path for alignment\n"\
+"        -t [int]                  number of threads to mask with (default 1)\n"\
+"        --lazy                    read each shard of a sharded index only\n"\
+"                                  once masking reaches it, holding no more\n"\
+"                                  than --mem-limit [size] of them if given\n"\
 "\n"\
+"# INDEX APPEND \n"\
+"    Usage: gtree ix append\n"\
+"        -ix [path]                pre-built, unpruned index to add to\n"\
+"        -r [path]                 FASTA file of the sequences to add, plain\n"\
+"                                  or gzip/BGZF compressed\n"\
+"        -o [path]                 prebuilt index path for alignment\n"\
+"        -t [int]                  number of threads to build with (default 1)\n"\
+"\n"
+
+// split in two, each part short enough for a C99 string literal
+#define GTREE_IX_HELP_MESSAGE_2 \
 "# INDEX PRUNE \n"\
 "    Usage: gtree ix prune\n"\
 "        -ix [path]                pre-built index to be masked for\n"\
 "                                  selectivity\n"\
 "        -o [path]                 prebuilt index path for alignment\n"\
+"        -t [int]                  number of threads to prune with (default 1)\n"\
+"        --stream                  prune straight from the index file to the\n"\
+"                                  output, without loading the index, on\n"\
+"                                  one thread\n"\
+"\n"\
+"# INDEX CONVERT \n"\
+"    Usage: gtree ix convert\n"\
+"        -ix [path]                pre-built index to be converted\n"\
+"        -o [path]                 converted index path\n"\
+"        -f [format]               'stream', 'flat' indexes mapped into\n"\
+"                                  memory when loaded, 'compact' ones that\n"\
+"                                  are smallest or 'sharded' ones loaded in\n"\
+"                                  parallel with -t (default flat; build,\n"\
+"                                  mask, append and prune take it too and\n"\
+"                                  default to stream)\n"\
+"        -z [int]                  zlib level of compact blocks, 0 to store\n"\
+"                                  them as they are (default 6)\n"\
+"        -d [int]                  leading bases to split sharded indexes\n"\
+"                                  by, deeper for smaller lazy reads\n"\
+"                                  (default 4, 0 to 12)\n"\
+"        -t [int]                  number of threads to load with (default 1)\n"\
 "\n"\
 "# INDEX STATS \n"\
 "    Usage: gtree ix stat\n"\
 "        -ix [path]                pre-built index to be masked printed\n"\
 "        -n                        print # of nodes in gtree to report on\n"\
+"        --lazy                    read only the top of a sharded index\n"\
+"        -t [int]                  number of threads to load with (default 1)\n"\
+"        --verify                  check that every node of a flat index\n"\
+"                                  stays within the file before using it\n"\
+"                                  (mask, append, prune and convert take it\n"\
+"                                  too)\n"\
 "\n"\
 "\n"
 
+void print_ix_help() {
+    printf(GTREE_IX_HELP_MESSAGE);
+    printf(GTREE_IX_HELP_MESSAGE_2);
+}
+
+void add_ref_fn(args_t *args, char *fn) {
+    args->ref_fns = realloc(args->ref_fns,
+                            (args->n_ref_fns + 1) * sizeof(char *));
+    args->ref_fns[args->n_ref_fns++] = strdup(fn);
+    args->ref_fasta_fn = args->ref_fns[args->n_ref_fns - 1];
+}
+
+/**
+ * Add every filename listed in `list_fn`, one per line, to the references
+ * in `args`. Blank lines and lines starting with '#' are skipped.
+ */
+void read_ref_list(args_t *args, char *list_fn) {
+    FILE *list = fopen(list_fn, "r");
+    if (list == NULL) {
+        printf("ERROR: could not open reference list %s\n", list_fn);
+        exit(EXIT_FAILURE);
+    }
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, list)) >= 0) {
+        while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'
+                           || line[len-1] == ' ' || line[len-1] == '\t')) {
+            line[--len] = '\0';
+        }
+        if (len == 0 || line[0] == '#') {
+            continue;
+        }
+        add_ref_fn(args, line);
+    }
+    free(line);
+    fclose(list);
+}
+
+/**
+ * write "ix" to the output file of `args` in the index format asked for.
+ */
+int serialize_ix_as(args_t *args, ix_t *ix) {
+    if (args->ix_format == IX_ENCODING_FLAT) {
+        return serialize_ix_flat(ix, args->out_fn);
+    }
+    if (args->ix_format == IX_ENCODING_COMPACT) {
+        return serialize_ix_compact(ix, args->out_fn, args->ix_level);
+    }
+    if (args->ix_format == IX_ENCODING_SHARDED) {
+        return serialize_ix_sharded(ix, args->out_fn, args->shard_depth);
+    }
+    return serialize_ix(ix, args->out_fn);
+}
+
+/**
+ * read the index of `args`, lazily and verified if asked to.
+ */
+ix_t *deserialize_ix_as(args_t *args) {
+    ix_t *ix;
+    if (args->lazy) {
+        ix = open_ix_lazy(args->ix_fn, args->mem_limit);
+    }
+    else {
+        ix = deserialize_ix_threaded(args->ix_fn, args->n_threads);
+    }
+    if (ix != NULL && args->verify && verify_ix(ix) != 0) {
+        printf("ERROR: index file %s is corrupt\n", args->ix_fn);
+        destroy_ix(ix);
+        return NULL;
+    }
+    return ix;
+}
+
 int validate_args(args_t *args) {
     if (args->exec_mode < 0) {
         printf("ERROR: no execution mode chosen, use build or align\n");
         exit(EXIT_FAILURE);
     }
+    if (args->n_ref_fns == 0 && args->exec_mode == EXEC_MODE_IX_MASK) {
+        printf("ERROR: no reference to mask against, use '-r' or '-rl'\n");
+        exit(EXIT_FAILURE);
+    }
+    if (args->n_ref_fns > 1 && args->exec_mode != EXEC_MODE_IX_MASK) {
+        printf("ERROR: only 'ix mask' takes more than one reference\n");
+        exit(EXIT_FAILURE);
+    }
+    if (args->ix_format != IX_ENCODING_STREAM
+            && (args->mem_limit > 0 || args->stream || args->lazy)) {
+        printf("ERROR: '--mem-limit', '--stream' and '--lazy' only write "
+               "stream indexes\n");
+        exit(EXIT_FAILURE);
+    }
+    if (args->lazy && args->exec_mode != EXEC_MODE_IX_MASK
+            && args->exec_mode != EXEC_MODE_IX_STAT) {
+        printf("ERROR: only 'ix mask' and 'ix stat' take '--lazy'\n");
+        exit(EXIT_FAILURE);
+    }
+    if (args->mem_limit > 0 && args->exec_mode != EXEC_MODE_IX_BUILD
+            && !args->lazy) {
+        printf("ERROR: '--mem-limit' only bounds 'ix build' and '--lazy' "
+               "indexes\n");
+        exit(EXIT_FAILURE);
+    }
+    if (args->lazy && args->out_fn != NULL && args->ix_fn != NULL
+            && strcmp(args->out_fn, args->ix_fn) == 0) {
+        // shards never read in are copied over from the index at the end
+        printf("ERROR: a lazy index cannot be written over itself\n");
+        exit(EXIT_FAILURE);
+    }
+    if (args->stream && args->n_threads > 1) {
+        printf("ERROR: '--stream' prunes on one thread, drop '-t'\n");
+        exit(EXIT_FAILURE);
+    }
+    if (args->bulk && args->mem_limit > 0) {
+        printf("ERROR: '--bulk' and '--mem-limit' cannot be combined\n");
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
+
+int ix_prune_stream(args_t *args) {
+    // use POSIX functions for timing harness
+    struct timeval tval_before, tval_after, tval_result;
+
+    /////////////////////////////////////////////////////////////////////////
+    //  PRUNE INDEX FILE
+    /////////////////////////////////////////////////////////////////////////
+    printf("Pruning index file...\n");
+    gettimeofday(&tval_before, NULL);
+    // call to time
+    long n_nodes = prune_ix_stream(args->ix_fn, args->out_fn);
+    if (n_nodes < 0) {
+        exit(EXIT_FAILURE);
+    }
+    printf("number of nodes: %ld\n", n_nodes);
+    //
+    gettimeofday(&tval_after, NULL);
+    timersub(&tval_after, &tval_before, &tval_result);
+    printf("INFO: Pruning done in %ld.%06ld secs\n\n",
+                                        (long int)tval_result.tv_sec, 
+                                        (long int)tval_result.tv_usec);
+
     return 0;
 }
 
@@ -58,13 +253,20 @@ int ix_prune(args_t *args) {
     struct timeval tval_before, tval_after, tval_result;
     ix_t *ix;
 
+    if (args->stream) {
+        return ix_prune_stream(args);
+    }
+
     /////////////////////////////////////////////////////////////////////////
     //  LOAD INDEX
     /////////////////////////////////////////////////////////////////////////
     printf("Loading index...\n");
     gettimeofday(&tval_before, NULL);
     // call to time
-    ix = deserialize_ix(args->ix_fn);
+    ix = deserialize_ix_as(args);
+    if (ix == NULL) {
+        exit(EXIT_FAILURE);
+    }
     print_ix_info(ix);
     //
     gettimeofday(&tval_after, NULL);
@@ -78,7 +280,8 @@ int ix_prune(args_t *args) {
     printf("Pruning index...\n");
     gettimeofday(&tval_before, NULL);
     // call to time
-    prune_gtree(ix->root);
+    prune_gtree_threaded(ix->arena, ix->root, args->n_threads);
+    reset_root_table(ix->table);
     print_ix_info(ix);
     //
     gettimeofday(&tval_after, NULL);
@@ -93,7 +296,10 @@ int ix_prune(args_t *args) {
     gettimeofday(&tval_before, NULL);
 
     // call to time
-    serialize_ix(ix, args->out_fn);
+    if (serialize_ix_as(args, ix) != 0) {
+        destroy_ix(ix);
+        exit(EXIT_FAILURE);
+    }
     //
     gettimeofday(&tval_after, NULL);
     timersub(&tval_after, &tval_before, &tval_result);
@@ -118,6 +324,48 @@ int ix_prune(args_t *args) {
     return 0;
 }
 
+int ix_build_out_of_core(args_t *args) {
+
+    // use POSIX functions for timing harness
+    struct timeval tval_before, tval_after, tval_result;
+    ix_t *ix;
+
+    /////////////////////////////////////////////////////////////////////////
+    //  BUILD AND SERIALIZE INDEX
+    /////////////////////////////////////////////////////////////////////////
+    printf("Building and serializing...\n");
+    gettimeofday(&tval_before, NULL);
+    // call to time
+    ix = init_ix(args->root_k);
+    if (build_gtree_out_of_core(args->ref_fasta_fn, ix, args->n_threads,
+                                args->mem_limit, args->prune,
+                                args->out_fn) != 0) {
+        destroy_ix(ix);
+        exit(EXIT_FAILURE);
+    }
+    //
+    gettimeofday(&tval_after, NULL);
+    timersub(&tval_after, &tval_before, &tval_result);
+    printf("INFO: Building done in %ld.%06ld secs\n\n", (long int)tval_result.tv_sec, 
+                                        (long int)tval_result.tv_usec);
+
+    /////////////////////////////////////////////////////////////////////////
+    //  DESTROY INDEX
+    /////////////////////////////////////////////////////////////////////////
+    printf("Destroying built index...\n");
+    gettimeofday(&tval_before, NULL);
+    // call to time
+    destroy_ix(ix);
+    // 
+    gettimeofday(&tval_after, NULL);
+    timersub(&tval_after, &tval_before, &tval_result);
+    printf("INFO: Destroying done in %ld.%06ld secs\n\n", 
+                                        (long int)tval_result.tv_sec, 
+                                        (long int)tval_result.tv_usec);
+
+    return 0;
+}
+
 int ix_build(args_t *args) {
 
     // use POSIX functions for timing harness
@@ -127,10 +375,18 @@ int ix_build(args_t *args) {
     /////////////////////////////////////////////////////////////////////////
     //  BUILD INDEX
     /////////////////////////////////////////////////////////////////////////
+    if (args->mem_limit > 0) {
+        return ix_build_out_of_core(args);
+    }
+
     printf("Building...\n");
     gettimeofday(&tval_before, NULL);
     // call to time
-    ix = build_ix_from_ref_seq(args->ref_fasta_fn);
+    ix = build_ix_from_ref_seq(args->ref_fasta_fn, args->root_k,
+                               args->n_threads, args->bulk, args->prune);
+    if (ix == NULL) {
+        exit(EXIT_FAILURE);
+    }
     print_ix_info(ix);
     //
     gettimeofday(&tval_after, NULL);
@@ -145,7 +401,10 @@ int ix_build(args_t *args) {
     gettimeofday(&tval_before, NULL);
 
     // call to time
-    serialize_ix(ix, args->out_fn);
+    if (serialize_ix_as(args, ix) != 0) {
+        destroy_ix(ix);
+        exit(EXIT_FAILURE);
+    }
     //
     gettimeofday(&tval_after, NULL);
     timersub(&tval_after, &tval_before, &tval_result);
@@ -175,6 +434,7 @@ int ix_mask(args_t *args) {
     // use POSIX functions for timing harness
     struct timeval tval_before, tval_after, tval_result;
     ix_t *ix;
+    int i;
 
     /////////////////////////////////////////////////////////////////////////
     //  LOAD INDEX
@@ -182,7 +442,10 @@ int ix_mask(args_t *args) {
     printf("Loading index...\n");
     gettimeofday(&tval_before, NULL);
     // call to time
-    ix = deserialize_ix(args->ix_fn);
+    ix = deserialize_ix_as(args);
+    if (ix == NULL) {
+        exit(EXIT_FAILURE);
+    }
     print_ix_info(ix);
     //
     gettimeofday(&tval_after, NULL);
@@ -193,10 +456,77 @@ int ix_mask(args_t *args) {
     /////////////////////////////////////////////////////////////////////////
     //  MASK INDEX
     /////////////////////////////////////////////////////////////////////////
-    printf("Pruning index...\n");
+    // every reference is streamed through the one loaded index, which is
+    // only serialized once all of them are masked
+    for (i = 0; i < args->n_ref_fns; i++) {
+        printf("Masking index (%d of %d)...\n", i + 1, args->n_ref_fns);
+        gettimeofday(&tval_before, NULL);
+        // call to time
+        if (mask_gtree(args->ref_fns[i], ix, args->n_threads) != 0) {
+            destroy_ix(ix);
+            exit(EXIT_FAILURE);
+        }
+        print_ix_info(ix);
+        //
+        gettimeofday(&tval_after, NULL);
+        timersub(&tval_after, &tval_before, &tval_result);
+        printf("INFO: Masking %s done in %ld.%06ld secs\n\n",
+                                        args->ref_fns[i],
+                                        (long int)tval_result.tv_sec, 
+                                        (long int)tval_result.tv_usec);
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    //  SERIALIZE INDEX
+    /////////////////////////////////////////////////////////////////////////
+    printf("Serializing...\n");
+    gettimeofday(&tval_before, NULL);
+
+    // call to time
+    if (serialize_ix_as(args, ix) != 0) {
+        destroy_ix(ix);
+        exit(EXIT_FAILURE);
+    }
+    //
+    gettimeofday(&tval_after, NULL);
+    timersub(&tval_after, &tval_before, &tval_result);
+    printf("INFO: Serializing done in %ld.%06ld secs\n\n", 
+                                        (long int)tval_result.tv_sec, 
+                                        (long int)tval_result.tv_usec);
+
+    /////////////////////////////////////////////////////////////////////////
+    //  DESTROY INDEX
+    /////////////////////////////////////////////////////////////////////////
+    printf("Destroying built index...\n");
+    gettimeofday(&tval_before, NULL);
+    // call to time
+    destroy_ix(ix);
+    // 
+    gettimeofday(&tval_after, NULL);
+    timersub(&tval_after, &tval_before, &tval_result);
+    printf("INFO: Destroying done in %ld.%06ld secs\n\n", 
+                                        (long int)tval_result.tv_sec, 
+                                        (long int)tval_result.tv_usec);
+
+    return 0;
+}
+
+int ix_append(args_t *args) {
+
+    // use POSIX functions for timing harness
+    struct timeval tval_before, tval_after, tval_result;
+    ix_t *ix;
+
+    /////////////////////////////////////////////////////////////////////////
+    //  LOAD INDEX
+    /////////////////////////////////////////////////////////////////////////
+    printf("Loading index...\n");
     gettimeofday(&tval_before, NULL);
     // call to time
-    mask_gtree(args->ref_fasta_fn, ix);
+    ix = deserialize_ix_as(args);
+    if (ix == NULL) {
+        exit(EXIT_FAILURE);
+    }
     print_ix_info(ix);
     //
     gettimeofday(&tval_after, NULL);
@@ -204,6 +534,23 @@ int ix_mask(args_t *args) {
     printf("INFO: Loading done in %ld.%06ld secs\n\n", (long int)tval_result.tv_sec, 
                                         (long int)tval_result.tv_usec);
 
+    /////////////////////////////////////////////////////////////////////////
+    //  APPEND TO INDEX
+    /////////////////////////////////////////////////////////////////////////
+    printf("Appending...\n");
+    gettimeofday(&tval_before, NULL);
+    // call to time
+    if (build_gtree(args->ref_fasta_fn, ix, args->n_threads, 0) != 0) {
+        destroy_ix(ix);
+        exit(EXIT_FAILURE);
+    }
+    print_ix_info(ix);
+    //
+    gettimeofday(&tval_after, NULL);
+    timersub(&tval_after, &tval_before, &tval_result);
+    printf("INFO: Appending done in %ld.%06ld secs\n\n", (long int)tval_result.tv_sec, 
+                                        (long int)tval_result.tv_usec);
+
     /////////////////////////////////////////////////////////////////////////
     //  SERIALIZE INDEX
     /////////////////////////////////////////////////////////////////////////
@@ -211,7 +558,10 @@ int ix_mask(args_t *args) {
     gettimeofday(&tval_before, NULL);
 
     // call to time
-    serialize_ix(ix, args->out_fn);
+    if (serialize_ix_as(args, ix) != 0) {
+        destroy_ix(ix);
+        exit(EXIT_FAILURE);
+    }
     //
     gettimeofday(&tval_after, NULL);
     timersub(&tval_after, &tval_before, &tval_result);
@@ -236,6 +586,48 @@ int ix_mask(args_t *args) {
     return 0;
 }
 
+int ix_convert(args_t *args) {
+    // use POSIX functions for timing harness
+    struct timeval tval_before, tval_after, tval_result;
+    ix_t *ix;
+
+    /////////////////////////////////////////////////////////////////////////
+    //  LOAD INDEX
+    /////////////////////////////////////////////////////////////////////////
+    printf("Loading index...\n");
+    gettimeofday(&tval_before, NULL);
+    // call to time
+    ix = deserialize_ix_as(args);
+    if (ix == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    print_ix_info(ix);
+    //
+    gettimeofday(&tval_after, NULL);
+    timersub(&tval_after, &tval_before, &tval_result);
+    printf("INFO: Loading done in %ld.%06ld secs\n\n", (long int)tval_result.tv_sec, 
+                                        (long int)tval_result.tv_usec);
+
+    /////////////////////////////////////////////////////////////////////////
+    //  SERIALIZE INDEX
+    /////////////////////////////////////////////////////////////////////////
+    printf("Serializing...\n");
+    gettimeofday(&tval_before, NULL);
+    // call to time
+    if (serialize_ix_as(args, ix) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    //
+    gettimeofday(&tval_after, NULL);
+    timersub(&tval_after, &tval_before, &tval_result);
+    printf("INFO: Serializing done in %ld.%06ld secs\n\n", 
+                                        (long int)tval_result.tv_sec, 
+                                        (long int)tval_result.tv_usec);
+
+    destroy_ix(ix);
+    return 0;
+}
+
 int ix_stat(args_t *args) {
 
     // use POSIX functions for timing harness
@@ -248,7 +640,10 @@ int ix_stat(args_t *args) {
     printf("Loading index...\n");
     gettimeofday(&tval_before, NULL);
     // call to time
-    ix = deserialize_ix(args->ix_fn);
+    ix = deserialize_ix_as(args);
+    if (ix == NULL) {
+        exit(EXIT_FAILURE);
+    }
     print_ix_info(ix);
     //
     gettimeofday(&tval_after, NULL);
@@ -285,8 +680,21 @@ int gtree_ix(int argc, char *argv[]) {
         args.in_fn = 
         args.in_fn2 = NULL;
     args.out_format = OUTPUT_FORMAT_SAM;
+    args.root_k = DEFAULT_ROOT_TABLE_K;
+    args.n_threads = 1;
+    args.bulk = 0;
+    args.mem_limit = 0;
+    args.prune = 0;
+    args.stream = 0;
+    args.lazy = 0;
+    args.verify = 0;
+    args.ix_format = -1;
+    args.ix_level = IX_COMPACT_DEFAULT_LEVEL;
+    args.shard_depth = IX_SHARD_DEPTH;
+    args.ref_fns = NULL;
+    args.n_ref_fns = 0;
     if (argc <= 2) {
-        printf(GTREE_IX_HELP_MESSAGE);
+        print_ix_help();
         exit(EXIT_SUCCESS);
     }
 
@@ -298,12 +706,16 @@ int gtree_ix(int argc, char *argv[]) {
         args.exec_mode = EXEC_MODE_IX_PRUNE;
     } else if (strcmp(argv[2], "stat") == 0) {
         args.exec_mode = EXEC_MODE_IX_STAT;
+    } else if (strcmp(argv[2], "append") == 0) {
+        args.exec_mode = EXEC_MODE_IX_APPEND;
+    } else if (strcmp(argv[2], "convert") == 0) {
+        args.exec_mode = EXEC_MODE_IX_CONVERT;
     }
 
     int i = 3;
     while (i < argc) {
         if (strcmp("-h", argv[i]) == 0) {
-            printf(GTREE_IX_HELP_MESSAGE);
+            print_ix_help();
             exit(EXIT_SUCCESS);
         } else if (strcmp("-v", argv[i]) == 0) {
             args.verbosity = VERBOSITY_LEVEL_DEBUG;
@@ -313,7 +725,15 @@ int gtree_ix(int argc, char *argv[]) {
                 exit(EXIT_FAILURE);
             }
 
-            args.ref_fasta_fn = argv[i+1]; 
+            add_ref_fn(&args, argv[i+1]);
+            i++;
+        } else if (strcmp("-rl", argv[i]) == 0) {
+            if ( i + 1 >= argc ) {
+                printf("ERROR: no reference list passed with '-rl'\n");
+                exit(EXIT_FAILURE);
+            }
+
+            read_ref_list(&args, argv[i+1]);
             i++;
         } else if (strcmp("-ix", argv[i]) == 0) {
             if ( i + 1 >= argc ) {
@@ -331,6 +751,114 @@ int gtree_ix(int argc, char *argv[]) {
 
             args.out_fn = argv[i+1]; 
             i++;
+        } else if (strcmp("-k", argv[i]) == 0) {
+            if ( i + 1 >= argc ) {
+                printf("ERROR: no root table size passed with '-k'\n");
+                exit(EXIT_FAILURE);
+            }
+
+            args.root_k = atoi(argv[i+1]);
+            if (args.root_k < 0 || args.root_k > MAX_ROOT_TABLE_K) {
+                printf("ERROR: invalid root table size %s passed, "
+                       "choose 0 to %d\n", argv[i+1], MAX_ROOT_TABLE_K);
+                exit(EXIT_FAILURE);
+            }
+            i++;
+        } else if (strcmp("--bulk", argv[i]) == 0) {
+            args.bulk = 1;
+        } else if (strcmp("--prune", argv[i]) == 0) {
+            args.prune = 1;
+        } else if (strcmp("--stream", argv[i]) == 0) {
+            args.stream = 1;
+        } else if (strcmp("--lazy", argv[i]) == 0) {
+            args.lazy = 1;
+        } else if (strcmp("--verify", argv[i]) == 0) {
+            args.verify = 1;
+        } else if (strcmp("-f", argv[i]) == 0) {
+            if ( i + 1 >= argc ) {
+                printf("ERROR: no index format passed with '-f'\n");
+                exit(EXIT_FAILURE);
+            }
+
+            if (strcmp(argv[i+1], "flat") == 0) {
+                args.ix_format = IX_ENCODING_FLAT;
+            } else if (strcmp(argv[i+1], "stream") == 0) {
+                args.ix_format = IX_ENCODING_STREAM;
+            } else if (strcmp(argv[i+1], "compact") == 0) {
+                args.ix_format = IX_ENCODING_COMPACT;
+            } else if (strcmp(argv[i+1], "sharded") == 0) {
+                args.ix_format = IX_ENCODING_SHARDED;
+            } else {
+                printf("ERROR: invalid index format %s passed, " 
+                       "choose 'stream', 'flat', 'compact' or 'sharded'\n",
+                       argv[i+1]);
+                exit(EXIT_FAILURE);
+            }
+            i++;
+        } else if (strcmp("-z", argv[i]) == 0) {
+            if ( i + 1 >= argc ) {
+                printf("ERROR: no compression level passed with '-z'\n");
+                exit(EXIT_FAILURE);
+            }
+
+            char *end;
+            args.ix_level = strtol(argv[i+1], &end, 10);
+            if (*end != '\0' || args.ix_level < 0 || args.ix_level > 9) {
+                printf("ERROR: invalid compression level %s passed, "
+                       "choose 0 to 9\n", argv[i+1]);
+                exit(EXIT_FAILURE);
+            }
+            i++;
+        } else if (strcmp("-d", argv[i]) == 0) {
+            if ( i + 1 >= argc ) {
+                printf("ERROR: no shard depth passed with '-d'\n");
+                exit(EXIT_FAILURE);
+            }
+
+            char *end;
+            args.shard_depth = strtol(argv[i+1], &end, 10);
+            if (*end != '\0' || args.shard_depth < 0
+                    || args.shard_depth > IX_SHARD_MAX_DEPTH) {
+                printf("ERROR: invalid shard depth %s passed, "
+                       "choose 0 to %d\n", argv[i+1], IX_SHARD_MAX_DEPTH);
+                exit(EXIT_FAILURE);
+            }
+            i++;
+        } else if (strcmp("--mem-limit", argv[i]) == 0) {
+            if ( i + 1 >= argc ) {
+                printf("ERROR: no memory limit passed with '--mem-limit'\n");
+                exit(EXIT_FAILURE);
+            }
+
+            char *unit;
+            args.mem_limit = strtol(argv[i+1], &unit, 10);
+            if (*unit == 'K' || *unit == 'k') {
+                args.mem_limit <<= 10;
+            } else if (*unit == 'M' || *unit == 'm') {
+                args.mem_limit <<= 20;
+            } else if (*unit == 'G' || *unit == 'g') {
+                args.mem_limit <<= 30;
+            } else if (*unit != '\0') {
+                args.mem_limit = 0;
+            }
+            if (args.mem_limit <= 0) {
+                printf("ERROR: invalid memory limit %s passed\n", argv[i+1]);
+                exit(EXIT_FAILURE);
+            }
+            i++;
+        } else if (strcmp("-t", argv[i]) == 0) {
+            if ( i + 1 >= argc ) {
+                printf("ERROR: no number of threads passed with '-t'\n");
+                exit(EXIT_FAILURE);
+            }
+
+            args.n_threads = atoi(argv[i+1]);
+            if (args.n_threads < 1) {
+                printf("ERROR: invalid number of threads %s passed\n",
+                       argv[i+1]);
+                exit(EXIT_FAILURE);
+            }
+            i++;
         } else if (strcmp("-of", argv[i]) == 0) {
             if ( i + 1 >= argc ) {
                 printf("ERROR: no output format passed with '-of'\n");
@@ -352,6 +880,11 @@ int gtree_ix(int argc, char *argv[]) {
         i++;
     }
 
+    // indexes are converted to the flat format unless told otherwise
+    if (args.ix_format < 0) {
+        args.ix_format = args.exec_mode == EXEC_MODE_IX_CONVERT
+                             ? IX_ENCODING_FLAT : IX_ENCODING_STREAM;
+    }
     validate_args(&args);
 
     if (args.exec_mode == EXEC_MODE_IX_BUILD) {
@@ -362,11 +895,20 @@ int gtree_ix(int argc, char *argv[]) {
         ix_prune(&args); 
     } else if (args.exec_mode == EXEC_MODE_IX_STAT) {
         ix_stat(&args);
+    } else if (args.exec_mode == EXEC_MODE_IX_APPEND) {
+        ix_append(&args);
+    } else if (args.exec_mode == EXEC_MODE_IX_CONVERT) {
+        ix_convert(&args);
     } else {
         printf("ERROR: unknown exec_mode option '%d', passed\n", args.exec_mode);
         exit(EXIT_FAILURE);
     }
 
+    for (i = 0; i < args.n_ref_fns; i++) {
+        free(args.ref_fns[i]);
+    }
+    free(args.ref_fns);
+
     printf("finished running!\n");
     return 0;
 }
@@ -7,6 +7,10 @@
 
  #include "consts.h"
 
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
 typedef struct args {
     int exec_mode;
     int verbosity;
@@ -17,6 +21,21 @@ typedef struct args {
     char *in_fn;        // reads input file for first pair or unpaired
     char *in_fn2;       // reads input file for second pair
     char print_num;     // print num flag for `gtree ix stat`
+    int root_k;         // leading bases covered by the index root table
+    int n_threads;      // number of worker threads to use
+    char bulk;          // sort-based build flag for `gtree ix build`
+    long mem_limit;     // out-of-core build memory budget in bytes, 0 if
+                        // the gtree is built in memory, or the cap on the
+                        // shards of a lazy index held in memory
+    char prune;         // prune while building flag for `gtree ix build`
+    char stream;        // prune the serialized index without loading it
+    char lazy;          // read the shards of a sharded index on demand
+    char verify;        // check every node of a flat index once mapped
+    int ix_format;      // IX_ENCODING_* an index is written in
+    int ix_level;       // zlib level of compact index blocks
+    int shard_depth;    // leading bases sharded indexes are split by
+    char **ref_fns;     // every reference passed, in order, for masking
+    int n_ref_fns;
 } args_t;
 
 typedef enum bp {
@@ -27,23 +46,396 @@ typedef enum bp {
 } bp_t;
 
 typedef struct loc {
-    char *desc;
-    long pos;
+    uint32_t desc;           // index into ix->descs, LOC_NO_DESC if unknown
+    uint32_t pos;            // offset of match within sequence "desc"
 } loc_t;
 
+// index of a gtree node within its node arena, NULL_NODE if absent
+typedef uint32_t node_id_t;
+
+// index of the first loc of a run within its node arena, NULL_LOC if absent
+typedef uint32_t loc_id_t;
+
 typedef struct gtree {
-    unsigned int too_full : 1;        // bit flag to ignore intermediate matching
-    unsigned int n_matches: 7;        // number of matches (is_match if >0)
+    uint32_t info;                    // packed too_full flag and n_matches
+                                      // (is_match if >0), node kind and
+                                      // path length, see gtree.h
 
-    struct gtree *next[4];            // core gtree lookup array
+    loc_id_t locs;                    // run of n_matches locs in node arena
 
-    loc_t locs [MAX_LOCS_PER_NODE];   // get number of locs to match per contig
+    node_id_t next[4];                // core gtree lookup array, or child
+                                      // and packed bases of a path node
 } gtree_t;
 
+typedef struct root_table {
+    int k;                   // number of leading bases indexed, 0 if none
+    node_id_t *nodes;        // node reached by each k-mer, NULL_NODE if none
+    uint8_t *saturated;      // bit set if every node on the way is too_full
+} root_table_t;
+
+typedef struct gtree_cursor {
+    node_id_t node;          // node the cursor currently sits in
+    int off;                 // position along a path node, 0 otherwise
+    char pending;            // path entered, but its match not yet recorded
+    char fresh;              // node was created by the current window
+    int depth;               // number of bases walked by the window so far
+    uint32_t prefix;         // first bases of the window, 2 bits per base
+    node_id_t root;          // node the window started from
+    root_table_t *table;     // shortcut past the top of the gtree, or NULL
+    int plain_depth;         // nodes this many bases down or less are never
+                             // turned into path nodes
+} gtree_cursor_t;
+
+// called when a walk enters node "id", a stand-in for a subtree still to
+// be read, which is read in its place, or the root of one read in already
+typedef void (*node_fault_t)( void *ctx, node_id_t id );
+
+typedef struct node_arena {
+    gtree_t **slabs;         // fixed-size chunks of nodes, bump allocated
+    unsigned int n_slabs;    // number of slabs currently allocated
+    unsigned int cur_slab;   // slab nodes are currently handed out from
+    unsigned int slab_used;  // number of nodes handed out from that slab
+    node_id_t free_nodes;    // released nodes, chained through next[0]
+    long n_bytes;            // bytes of nodes and loc runs handed out and
+                             // not released again
+
+    loc_t **loc_slabs;       // fixed-size chunks of locs, bump allocated
+    unsigned int n_loc_slabs;
+    unsigned int cur_loc_slab;
+    unsigned int loc_slab_used;
+    loc_id_t free_locs[LOC_RUN_CLASSES];  // released runs by size class,
+                                          // chained through locs[0].desc
+
+    struct node_arena *owner;  // arena that hands out slabs, NULL if self
+    pthread_mutex_t lock;      // guards n_slabs and n_loc_slabs of an owner
+
+    unsigned int n_mapped_slabs;      // leading slabs of nodes and locs that
+    unsigned int n_mapped_loc_slabs;  // lie in a mapped index file, and are
+                                      // not the arena's to free
+
+    node_fault_t fault;        // reads in lazy subtrees as they are
+    void *fault_ctx;           // entered, NULL if there are none
+} node_arena_t;
+
 typedef struct gtreeix {
-    gtree_t *root;           // root of gtree index
+    node_id_t root;          // root of gtree index
+    node_arena_t *arena;     // owns every node reachable from root
+    root_table_t *table;     // direct index of the nodes root_k bases down
     unsigned int n_descs;    // number of description strings in gtree
     char **descs;            // access to all description strings in gtree
+    void *map;               // flat index file the gtree was mapped from,
+    size_t map_len;          // NULL if it was built or read in
+    struct ix_lazy *lazy;    // shards still read on demand, NULL if the
+                             // whole gtree is in memory
 } ix_t;
 
+typedef struct ix_flat_head {
+    char magic[4];           // IX_FORMAT_MAGIC
+    int32_t version;         // IX_FLAT_FORMAT_VERSION
+    int32_t root_k;          // bases covered by the root table
+    uint32_t node_size;      // sizeof(gtree_t) and sizeof(loc_t) of the
+    uint32_t loc_size;       // writer, which must match to map the file
+    uint32_t slab_bits;      // NODE_ARENA_SLAB_BITS and LOC_ARENA_SLAB_BITS
+    uint32_t loc_slab_bits;  // of the writer, likewise
+    uint32_t root;           // node id of the root of the gtree
+    uint32_t n_descs;        // number of description strings
+    uint32_t n_sections;     // entries in the section table that follows
+    uint32_t crc;            // crc32 of the head, with this field 0, and of
+                             // the section table
+    uint32_t reserved;
+} ix_flat_head_t;
+
+typedef struct ix_section {
+    uint32_t kind;           // IX_SECTION_*
+    uint32_t reserved;
+    uint64_t offset;         // from the start of the file, IX_FLAT_ALIGN
+                             // aligned
+    uint64_t size;           // in bytes
+    uint64_t count;          // number of entries
+} ix_section_t;
+
+// hands over the subtree under the node reached by "kmer", whose bases are
+// packed 2 bits per base, first highest. The subtree is returned along with
+// the arena holding it, which the caller destroys once done with it.
+typedef node_id_t (*bucket_loader_t)( void *ctx, uint32_t kmer,
+                                      node_arena_t **arena );
+
+typedef struct window_scanner {
+    uint64_t bases;          // last MAX_WINDOW_SIZE slots read, 2 bits per
+                             // base, newest lowest
+    uint32_t illegal;        // slots holding an illegal character, newest
+                             // lowest
+    int n_held;              // number of slots held, the oldest starts the
+                             // next window
+    long pos;                // position of the next slot in sequence "desc"
+    uint32_t desc;           // descriptor id of the sequence being scanned
+} window_scanner_t;
+
+// called with each window found by a window_scanner_t, made of the first
+// "n_slots" slots held. Returns non-zero if the window ran into a dead end.
+typedef int (*window_handler_t)( window_scanner_t *scanner, int n_slots,
+                                 void *ctx );
+
+typedef struct ref_seq {
+    uint8_t *events;         // one REF_EVENT code per slot or boundary
+    long n_events;
+    long cap_events;
+} ref_seq_t;
+
+// called with the events a fasta_reader_t has read since it last was, which
+// are dropped once it returns
+typedef void (*ref_sink_t)( ref_seq_t *ref, void *ctx );
+
+typedef struct fasta_reader {
+    ref_seq_t *ref;          // events read so far
+    ref_sink_t sink;         // takes the events of each chunk as it is
+    void *sink_ctx;          // tokenized, NULL to hold on to all of them
+    ix_t *ix;                // index to add description strings to, or NULL
+    char desc[MAX_DESC_LEN]; // description of the current sequence
+    int desc_len;
+    char in_header;          // the rest of a header line is still to come
+    long cur_pos;            // position of the next slot in the sequence
+    char too_long;           // a sequence indexed ran past LOC_MAX_POS
+} fasta_reader_t;
+
+typedef struct bgzf_slot {
+    char *data;              // inflated contents of a block
+    size_t len;
+    char ready;              // inflated and waiting to be tokenized
+} bgzf_slot_t;
+
+typedef struct bgzf_queue {
+    const uint8_t *map;      // compressed file
+    size_t *offsets;         // start of each block in "map", plus the end
+    long n_blocks;
+    bgzf_slot_t *slots;      // block i is inflated into slot i % n_slots
+    int n_slots;
+    long next;               // next block to be claimed by a helper
+    long consumed;           // blocks tokenized so far
+    char error;              // a block failed to inflate
+    pthread_mutex_t lock;
+    pthread_cond_t filled;   // signalled when a slot becomes ready
+    pthread_cond_t drained;  // signalled when a slot is free again
+} bgzf_queue_t;
+
+typedef struct mask_state {
+    ix_t *ix;                // index being masked
+    char dead_end;           // the last window to walk any base ran into a
+                             // dead end
+    long n_events;           // size of the reference, for progress reports
+    long n_windows;          // windows handled so far
+} mask_state_t;
+
+typedef struct mask_hit {
+    window_scanner_t scanner;  // state the window was handed over in
+    int n_slots;               // number of slots in the window
+    char dead_end;             // dead end of the last window walked before
+                               // it, MASK_DEAD_END_UNKNOWN if that was in
+                               // an earlier chunk
+} mask_hit_t;
+
+typedef struct mask_count {
+    node_id_t id;            // node whose visits the slot counts
+    uint8_t n;               // full visits to it seen by the worker,
+                             // saturating once it must be too_full
+} mask_count_t;
+
+typedef struct mask_worker {
+    ix_t *ix;                // index being masked, left untouched
+    ref_seq_t *ref;          // reference sequence masked against
+    long lo;                 // events of the chunk, windows starting in it
+    long hi;                 // are handled by this worker
+    mask_count_t *counts;    // visits to nodes seen by the worker, in the
+    uint32_t count_mask;     // slot their id masked by count_mask picks
+    char dead_end;           // the last window walked ran into a dead end,
+                             // MASK_DEAD_END_UNKNOWN if none was walked yet
+    long remaining;          // windows started before "hi" still to handle
+    mask_hit_t *hits;        // windows that may still record a match, in
+    long n_hits;             // order
+    long cap_hits;
+    long n_windows;          // windows handled
+    long end_pos;            // scanner position and sequence count
+    uint32_t end_desc;       // on reaching "hi"
+    window_scanner_t tail;   // scanner at the end of the file, last chunk
+} mask_worker_t;
+
+typedef struct build_worker {
+    ix_t *ix;                // index being built
+    node_arena_t *arena;     // arena this worker allocates from
+    int id;                  // worker number, owns the partitions equal to
+                             // it modulo n_threads
+    int n_threads;           // number of workers
+    int part_depth;          // number of leading bases partitioning the
+                             // gtree between workers, 0 if not partitioned
+    ref_seq_t *ref;          // reference sequence being indexed
+    uint32_t first_desc;     // descriptor id in use before the reference
+    long iter;               // windows handled, for progress reports
+    char prune;              // prune the partitions once they are complete
+} build_worker_t;
+
+typedef struct prune_pool {
+    node_id_t *tasks;        // roots of the subtrees to prune, in pre-order
+    int *fewest;             // what prune_gtree_above returned for each
+    long n_tasks;
+    long next;               // next task to hand out
+    pthread_mutex_t lock;    // guards "next"
+} prune_pool_t;
+
+typedef struct prune_worker {
+    prune_pool_t *pool;      // subtrees shared out between the workers
+    node_arena_t *arena;     // arena this worker releases pruned nodes to
+} prune_worker_t;
+
+typedef struct bulk_window {
+    uint64_t bases;          // bases of the window, 2 bits per base, first
+                             // base highest
+    uint32_t pos;            // position of the window in sequence "desc"
+    uint32_t desc_len;       // descriptor id + 1 above BULK_LEN_BITS,
+                             // number of bases below
+} bulk_window_t;
+
+typedef struct bulk_windows {
+    bulk_window_t *windows;  // every window of a reference, in file order
+                             // until sorted
+    long n_windows;
+    long cap_windows;
+} bulk_windows_t;
+
+typedef struct spill_state {
+    build_worker_t top;      // grows the nodes above the buckets
+    int depth;               // number of leading bases picking a bucket
+    FILE **files;            // spill file of each bucket, NULL once built
+    long *n_windows;         // windows spilled to each bucket
+    long mem_limit;          // bytes a bucket is meant to be built within
+    long n_nodes;            // nodes in the gtree as written so far
+    window_scanner_t scanner;  // windows held over from the chunks of the
+                               // reference spilled so far
+    int err;                 // a spill file could not be written or read
+} spill_state_t;
+
+typedef struct prune_frame {
+    char too_full;           // header of a node whose children are being
+    char n_matches;          // streamed
+    int next;                // child slots read so far
+    int n_children;
+    int first_child;         // slot of its first child
+    long child_off;          // output offset of the first child
+    int child_matches;       // n_matches of the first child
+    long child_nodes;        // nodes written for the first child's subtree
+    int below;               // fewest matches below the node so far
+    long n_nodes;            // nodes written for the node's subtree so far
+    long off;                // output offset of the node
+} prune_frame_t;
+
+typedef struct ix_out {
+    FILE *out;               // index being written
+    char *buf;               // bytes after "flushed" not yet written, which
+    long cap;                // a streamed prune may still take back
+    long len;
+    long flushed;            // output offset of buf[0]
+    int level;               // zlib level of the blocks "buf" is written out
+    char *zbuf;              // in, -1 if it is written as it is
+} ix_out_t;
+
+typedef struct ix_in {
+    FILE *in;                // index being read
+    char *buf;               // bytes read ahead, from "pos" on not yet
+    long len;                // taken
+    long pos;
+    int blocks;              // whether the index is read in blocks, as
+    char *zbuf;              // written with a level of 0 or more
+    int64_t limit;           // bytes left to read from "in", -1 if it is
+                             // read to the end
+} ix_in_t;
+
+typedef struct ix_write_frame {
+    node_id_t id;            // node whose children are being written
+    int off;                 // base of "id" it stands for, if a path node
+    int next;                // child slots written so far
+} ix_write_frame_t;
+
+typedef struct gtree_frame {
+    node_id_t id;            // node whose children are being walked
+    int next;                // next child of the node to descend to
+    int below;               // fewest matches below the node so far
+} gtree_frame_t;
+
+typedef struct ix_read_frame {
+    node_id_t id;            // node whose children are being read
+    int next;                // child slots read so far
+    int n_matches;           // locs that follow its children
+    int mask;                // child slots present, in a compact index
+} ix_read_frame_t;
+
+typedef struct ix_shard {
+    int64_t offset;          // of the shard's GTREE_NODE in the index file
+    int64_t size;            // in bytes
+    node_id_t root;          // node the shard starts at once read, or its
+    int off;                 // "off"'th base while being written
+    node_id_t parent;        // node the shard hangs off, NULL_NODE if it is
+    int slot;                // the root of the gtree, and the slot it
+                             // takes in there
+} ix_shard_t;
+
+typedef struct shard_pool {
+    char *ixfile;            // sharded index being read
+    ix_shard_t *shards;
+    int n_shards;
+    int shard_depth;         // bases above the shards
+    int fold_below;          // passed on to _deserialize_gtree
+    int next;                // next shard to hand out
+    int err;                 // set once a shard fails to read
+    pthread_mutex_t lock;    // guards "next" and "err"
+} shard_pool_t;
+
+typedef struct shard_worker {
+    shard_pool_t *pool;      // shards shared out between the workers
+    node_arena_t *arena;     // arena this worker reads its shards into
+} shard_worker_t;
+
+typedef struct ix_lazy {
+    FILE *file;              // sharded index the shards are read from
+    FILE *spill;             // shards written back once evicted, NULL until
+                             // the first eviction
+    ix_in_t in;              // reads one shard at a time
+    ix_shard_t *shards;      // "root" is the node standing in for the shard,
+                             // offset and size where it is read from
+    char *spilled;           // shard is read from "spill" rather than "file"
+    int64_t *spill_room;     // bytes of "spill" set aside for each shard
+    int64_t *spill_free;     // offset and size of each stretch of "spill"
+    int n_spill_free;        // set aside for no shard, in order of offset
+    int64_t spill_end;       // bytes of "spill" set aside or free
+    uint32_t *kmers;         // leading bases of each shard, 2 bits per base
+    int n_shards;
+    int shard_depth;         // bases above the shards
+    int fold_below;          // passed on to _deserialize_gtree
+    int *newer;              // shards read in, chained from the one walked
+    int *older;              // into least recently to the latest, -1 at
+    int oldest;              // either end
+    int newest;
+    int n_read_in;
+    long mem_limit;          // bytes of shards kept in memory, 0 for no cap
+    long top_bytes;          // bytes of the arena held above the shards
+    long peak_resident;      // most bytes of shards held as a walk enters
+                             // one, once evicted down to the limit
+    long n_reads;            // shards read in so far, and evicted again
+    long n_evictions;
+    node_arena_t *arena;     // arena of the index
+    root_table_t *table;     // root table of the index, which may point
+                             // into evicted shards
+    unsigned int n_descs;
+    int err;                 // set once a shard fails to read
+} ix_lazy_t;
+
+typedef struct radix_worker {
+    bulk_window_t *src;      // windows to be sorted by one digit
+    bulk_window_t *dst;      // where the windows go, in digit order
+    long lo;                 // range of "src" handled by this worker
+    long hi;
+    int digit;               // 0 for the number of bases, 1 + i for the i'th
+                             // lowest byte of the bases
+    long counts[256];        // windows per digit value, then where the
+                             // worker's first window of each value goes
+} radix_worker_t;
+
 #endif
@@ -12,15 +12,35 @@
 use strict;
 use warnings;
 
-use Test::Simple tests => 23;
+use Test::Simple tests => 59;
 use POSIX qw(mkfifo);
+use File::Spec;
+use File::Temp qw(tempdir);
+use Cwd;
+
+# scratch files go to a directory of their own, not the checkout
+my $gtree = File::Spec->rel2abs('gtree');
+my $cwd = getcwd();
+my $scratch = tempdir('gtree-test-XXXXXX', TMPDIR => 1, CLEANUP => 1);
+chdir($scratch) or die $!;
 
 my @test_files = qw/.ti0 .ti1 .ti2 \
                     .tm0
                     .to0 .to1 .to2 \
                     .to0.prn .to1.prn .to2.prn \
                     .to0.msk .to1.prn .to2.prn \
-                    .to0.msk.prn .to1.msk.prn .to2.msk.prn /;
+                    .to0.msk.prn .to1.msk.prn .to2.msk.prn \
+                    .to2.thr .to2.blk \
+                    .ti2.gz .to2.gz .to2.ooc \
+                    .ta0 .to0.app .to2.bprn \
+                    .to0.msk.ti0 .to0.msk2 .to2.tprn .to2.sprn \
+                    .to2.flat .to2.unflat .to2.fprn .to2.bflat \
+                    .to2.cmp .to2.uncmp .to2.shd .to2.unshd \
+                    .ti3 .to3 .to3.shd .to3.msk .to3.lmsk .to3.emsk \
+                    .to3.flat .to3.prn .to3.fprn \
+                    .td0 .td0.prn .td0.flat .td0.unflat \
+                    .ti4 .tm1 .to4 .to4.msk .to4.msk.thr \
+                    .to4.ooc .to4.full /;
 my $out;
 
 ####################################################
@@ -49,6 +69,20 @@ gggggggggggggggggggggggggggggggga
 HERE
 close(FILE);
 
+open(FILE, '>', '.ta0') or die $!;
+print FILE <<"HERE";
+>chr2
+gggggggggggggggggggggggggggggggga
+HERE
+close(FILE);
+
+open(FILE, '>', '.ti3') or die $!;
+print FILE <<"HERE";
+>chr3
+acgtgcatgcaatcgatcgtagctagctgatcgatgcatgcatcgacgatcgtagctacg
+HERE
+close(FILE);
+
 open(FILE, '>', '.tm0') or die $!;
 print FILE <<"HERE";
 >chr2
@@ -60,31 +94,52 @@ close(FILE);
 ## TEST INDEX BUILD
 ####################################################
 
-$out = `./gtree ix build -r .ti1 -o .to0`;
+$out = `$gtree ix build -r .ti1 -o .to0`;
 ok( $out =~ /nodes: 32/, 'build single index window' );
 ok( $out !~ /ERROR/, 'build single index window' );
 
-$out = `./gtree ix build -r .ti1 -o .to1`;
+$out = `$gtree ix build -r .ti1 -o .to1`;
 ok( $out =~ /nodes: 32/, 'build index window with duplicate nodes' );
 ok( $out !~ /ERROR/, 'execution has errors' );
 
-$out = `./gtree ix build -r .ti2 -o .to2`;
+$out = `$gtree ix build -r .ti2 -o .to2`;
 ok( $out =~ /nodes: 33/, 'build index with branching' );
 ok( $out !~ /ERROR/, 'execution has errors' );
 
+$out = `$gtree ix build -r .ti2 -o /dev/full`;
+ok( $? != 0 && $out =~ /could not write index file/,
+    'build fails when the index cannot be written' );
+
+$out = `$gtree ix build -t 4 -r .ti2 -o .to2.thr`;
+ok( $out =~ /nodes: 33/, 'build index with multiple threads' );
+ok( `cmp .to2 .to2.thr` eq '', 'threaded build matches serial build' );
+
+$out = `$gtree ix build --bulk -r .ti2 -o .to2.blk`;
+ok( $out =~ /nodes: 33/, 'bulk build index with branching' );
+ok( `cmp .to2 .to2.blk` eq '', 'bulk build matches serial build' );
+
+system('gzip -c .ti2 > .ti2.gz');
+$out = `$gtree ix build -r .ti2.gz -o .to2.gz`;
+ok( $out =~ /nodes: 33/, 'build index from gzip input' );
+ok( `cmp .to2 .to2.gz` eq '', 'gzip build matches plain build' );
+
+$out = `$gtree ix build --mem-limit 1K -r .ti2 -o .to2.ooc`;
+ok( $out =~ /nodes: 33/, 'out-of-core build index with branching' );
+ok( `cmp .to2 .to2.ooc` eq '', 'out-of-core build matches serial build' );
+
 ####################################################
 ## TEST INDEX LOAD
 ####################################################
 
-$out = `./gtree ix stat -n -ix .to0`;
+$out = `$gtree ix stat -n -ix .to0`;
 ok( $out =~ /nodes: 32/, 'stat single index window' );
 ok( $out !~ /ERROR/, 'execution has errors' );
 
-$out = `./gtree ix stat -n -ix .to1`;
+$out = `$gtree ix stat -n -ix .to1`;
 ok( $out =~ /nodes: 32/, 'stat index window with duplicate nodes' );
 ok( $out !~ /ERROR/, 'execution has errors' );
 
-$out = `./gtree ix stat -n -ix .to2`;
+$out = `$gtree ix stat -n -ix .to2`;
 ok( $out =~ /nodes: 33/, 'stat index with branching' );
 ok( $out !~ /ERROR/, 'execution has errors' );
 
@@ -92,35 +147,193 @@ ok( $out !~ /ERROR/, 'execution has errors' );
 ## TEST INDEX PRUNE
 ####################################################
 
-$out = `./gtree ix prune -ix .to0 -o .to0.prn`;
+$out = `$gtree ix prune -ix .to0 -o .to0.prn`;
 ok( $out =~ /nodes: 2/, 'prune single index window' );
 ok( $out !~ /ERROR/, 'execution has errors' );
 
-$out = `./gtree ix prune -ix .to1 -o .to1.prn`;
+$out = `$gtree ix prune -ix .to1 -o .to1.prn`;
 ok( $out =~ /nodes: 2/, 'prune index window with duplicate nodes' );
 ok( $out !~ /ERROR/, 'execution has errors' );
 
-$out = `./gtree ix prune -ix .to2 -o .to2.prn`;
+$out = `$gtree ix prune -ix .to2 -o .to2.prn`;
 ok( $out =~ /nodes: 33/, 'prune index with branching' );
 ok( $out !~ /ERROR/, 'execution has errors' );
 
+`$gtree ix prune -t 4 -ix .to2 -o .to2.tprn`;
+ok( `cmp .to2.prn .to2.tprn` eq '', 'threaded prune matches serial prune' );
+
+$out = `$gtree ix prune --stream -ix .to2 -o .to2.sprn`;
+ok( $out =~ /nodes: 33/, 'stream prune index with branching' );
+ok( `cmp .to2.prn .to2.sprn` eq '', 'stream prune matches prune' );
+
+$out = `$gtree ix prune --stream -t 4 -ix .to2 -o .to2.sprn`;
+ok( $? != 0 && $out =~ /ERROR/, 'stream prune rejects threads' );
+
+# a single chain deeper than any window, as only a crafted index has. Matches
+# alternate between 1 and 0 down the chain, so no node of it can be pruned.
+my $depth = 100;
+open( my $deep, '>:raw', '.td0' );
+print $deep 'GTIX', pack('l<l<L<', 1, 0, 1), pack('Q<', 4), "chr1\0";
+for (my $i = 0; $i < $depth; $i++) {
+    print $deep pack('CCC', 1, 0, $i % 2 ? 0 : 1);
+}
+print $deep "\0" x 4;
+for (my $i = $depth - 1; $i >= 0; $i--) {
+    print $deep pack('l<q<', 0, $i) unless $i % 2;
+    print $deep "\0" x 3 if $i > 0;
+}
+close( $deep );
+
+$out = `$gtree ix prune -ix .td0 -o .td0.prn`;
+ok( $? == 0 && $out =~ /nodes: $depth\n/ && $out !~ /ERROR/,
+    'prune index deeper than any window' );
+`$gtree ix convert -ix .td0 -o .td0.flat`;
+`$gtree ix convert -f stream -ix .td0.flat -o .td0.unflat`;
+ok( `cmp .td0 .td0.unflat` eq '', 'deep flat index converts back unchanged' );
+
+####################################################
+## TEST INDEX APPEND
+####################################################
+
+$out = `$gtree ix append -ix .to0 -r .ta0 -o .to0.app`;
+ok( $out =~ /nodes: 33/ && $out =~ /desc\[1\]: chr2/,
+    'append new contig to index' );
+ok( $out !~ /ERROR/, 'execution has errors' );
+
+$out = `$gtree ix build --prune -r .ti2 -o .to2.bprn`;
+ok( $out =~ /nodes: 33/, 'build index with pruning' );
+ok( `cmp .to2.prn .to2.bprn` eq '', 'pruned build matches build and prune' );
+
 ####################################################
 ## TEST INDEX MASK
 ####################################################
 
-$out = `./gtree ix mask -r .tm0 -ix .to0 -o .to0.msk`;
+$out = `$gtree ix mask -r .tm0 -ix .to0 -o .to0.msk`;
 ok( $out =~ /nodes: 32/, 'mask single index window' );
 ok( $out !~ /ERROR/, 'execution has errors' );
 
+# threads each take a chunk of at least 2^16 bases, so the reference must
+# hold two of them. It repeats the indexed sequence, filling nodes up.
+my $seed = 1;
+my @bases = map {
+    $seed = (1103515245 * $seed + 12345) % 2147483648;
+    substr('acgt', ($seed >> 16) % 4, 1);
+} 1 .. 4000;
+my $ix4 = join('', @bases);
+open(FILE, '>', '.ti4') or die $!;
+print FILE ">chr4\n$ix4\n";
+close(FILE);
+open(FILE, '>', '.tm1') or die $!;
+print FILE ">chr5\n";
+for (my $i = 0; $i < 36; $i++) {
+    print FILE $i % 3 ? scalar reverse($ix4) : $ix4, "\n";
+}
+close(FILE);
+
+`$gtree ix build -r .ti4 -o .to4`;
+`$gtree ix build --mem-limit 1K -r .ti4 -o .to4.ooc`;
+ok( `cmp .to4 .to4.ooc` eq '', 'streamed out-of-core build matches build' );
+
+# spill files cut short by a file size limit fail the build
+{
+    local $SIG{XFSZ} = 'IGNORE';
+    $out = `sh -c 'ulimit -f 1; exec $gtree ix build --mem-limit 1K -r .tm1 -o .to4.full'`;
+}
+ok( $? != 0 && $out =~ /ERROR: could not write to the spill file/
+        && ! -e '.to4.full',
+    'out-of-core build fails on a spill write error' );
+`$gtree ix mask -r .tm1 -ix .to4 -o .to4.msk`;
+$out = `$gtree ix mask -t 2 -r .tm1 -ix .to4 -o .to4.msk.thr`;
+ok( $out =~ /masking with 2 threads/
+        && `cmp .to4.msk .to4.msk.thr` eq '',
+    'threaded mask matches serial mask' );
+
+`$gtree ix mask -r .ti0 -ix .to0.msk -o .to0.msk.ti0`;
+`$gtree ix mask -r .tm0 -r .ti0 -ix .to0 -o .to0.msk2`;
+ok( `cmp .to0.msk.ti0 .to0.msk2` eq '', 'batch mask matches repeated masks' );
+
 # NOTE:
 #   expected pruned length is 2+ masking seq + 1 for root node
 #                                            + 1 for last selective node
-$out = `./gtree ix prune -ix .to0.msk -o .to0.msk.prn`;
+$out = `$gtree ix prune -ix .to0.msk -o .to0.msk.prn`;
 ok( $out =~ /nodes: 7/, 'mask single index window' );
 ok( $out !~ /ERROR/, 'execution has errors' );
 
+####################################################
+## TEST INDEX CONVERT
+####################################################
+
+`$gtree ix convert -ix .to2 -o .to2.flat`;
+`$gtree ix convert -f stream -ix .to2.flat -o .to2.unflat`;
+ok( `cmp .to2 .to2.unflat` eq '', 'flat index converts back unchanged' );
+
+`$gtree ix prune -ix .to2.flat -o .to2.fprn`;
+ok( `cmp .to2.prn .to2.fprn` eq '', 'mapped flat index prunes the same' );
+
+# point a node of the flat index past the end of its section
+open( my $flat, '<:raw', '.to2.flat' );
+my $bytes = do { local $/; <$flat> };
+close( $flat );
+my $nodes = unpack( 'Q<', substr( $bytes, 48 + 32 + 8, 8 ) );
+substr( $bytes, $nodes + 24 + 8, 4 ) = pack( 'L<', 0x7fffffff );
+open( $flat, '>:raw', '.to2.bflat' );
+print $flat $bytes;
+close( $flat );
+# nodes are only checked when asked to, a load maps the file and no more
+$out = `$gtree ix stat --verify -ix .to2.bflat`;
+ok( $? != 0 && $out =~ /ERROR: index file .* is corrupt/,
+    'corrupt flat index rejected' );
+
+`$gtree ix prune --verify -ix .to2.flat -o .to2.fprn`;
+ok( $? == 0 && `cmp .to2.prn .to2.fprn` eq '', 'sound flat index verifies' );
+
+`$gtree ix convert -f compact -ix .to2 -o .to2.cmp`;
+`$gtree ix convert -f stream -ix .to2.cmp -o .to2.uncmp`;
+ok( `cmp .to2 .to2.uncmp` eq '', 'compact index converts back unchanged' );
+
+`$gtree ix convert -f sharded -ix .to2 -o .to2.shd`;
+`$gtree ix convert -t 4 -f stream -ix .to2.shd -o .to2.unshd`;
+ok( `cmp .to2 .to2.unshd` eq '', 'sharded index loads back unchanged' );
+
+####################################################
+## TEST LAZY INDEX
+####################################################
+
+$out = `$gtree ix build -r .ti3 -o .to3`;
+ok( $out =~ /node kinds: node4 [1-9]\d*, path [1-9]/,
+    'build reports the mix of node kinds' );
+
+`$gtree ix convert -ix .to3 -o .to3.flat`;
+`$gtree ix prune -ix .to3.flat -o .to3.fprn`;
+`$gtree ix prune -ix .to3 -o .to3.prn`;
+ok( `cmp .to3.prn .to3.fprn` eq '', 'flat index prunes the same' );
+
+`$gtree ix convert -f sharded -ix .to3 -o .to3.shd`;
+`$gtree ix mask -r .ti3 -ix .to3 -o .to3.msk`;
+
+$out = `$gtree ix stat --lazy -ix .to3.shd`;
+ok( $out =~ /lazy shards: \d+, 0 reads/, 'lazy stat reads no shards' );
+
+`$gtree ix mask --lazy -r .ti3 -ix .to3.shd -o .to3.lmsk`;
+ok( `cmp .to3.msk .to3.lmsk` eq '', 'lazy mask matches mask' );
+
+$out = `$gtree ix mask --lazy --mem-limit 1K -r .ti3 -ix .to3.shd -o .to3.emsk`;
+ok( $out =~ /[1-9]\d* evictions/ && `cmp .to3.msk .to3.emsk` eq '',
+    'lazy mask evicting shards matches mask' );
+
+# the shards walked least recently go first, and no more are held than fit
+$out = `$gtree ix mask --lazy --mem-limit 4K -r .ti3 -ix .to3.shd -o .to3.emsk`;
+ok( $out =~ /[1-9]\d* evictions, \d+ bytes resident, (\d+) at most/
+        && $1 <= 4096 && `cmp .to3.msk .to3.emsk` eq '',
+    'lazy mask holds shards within the memory limit' );
+
+$out = `$gtree ix mask --mem-limit 1K -r .ti3 -ix .to3 -o .to3.emsk`;
+ok( $? != 0 && $out =~ /ERROR/, 'mask only takes a memory limit lazily' );
+
 # clean up test files
 unlink( @test_files );
 
-ok( ! -e @test_files, 'fully cleaned up' );
+ok( ! grep( { -e } @test_files ), 'fully cleaned up' );
+
+chdir($cwd);
 